@@ -0,0 +1,181 @@
+/*
+Date: 18 Oct 2026 10:41:07.552903184
+File: bvh.h
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: A bounding volume hierarchy answering the queries of the octree.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+
+*/
+
+#ifndef __BVH_H_0E6F2B94C3A15D7E8F41B09D62C7A8E5__
+#define __BVH_H_0E6F2B94C3A15D7E8F41B09D62C7A8E5__
+
+// Check for missing includes.
+#if not defined _GLIBCXX_VECTOR
+#error "bvh.h: missing include - vector"
+#elif not defined __OCTREE_H_C320E78EB2172B4CB9E10507D5D96B4A__
+#error "bvh.h: missing include - datastruct/octree.h"
+#endif
+
+//
+// Some terminology:
+//
+// BVH:           bounding volume hierarchy. A tree of boxes where each node
+//                bounds the boxes of its children. Unlike the nodes of an
+//                octree, the boxes of siblings may overlap but each item is
+//                held exactly once, however large it is.
+// Lane:          one of the bvhWidth children of a node. A lane holds either
+//                a child node or a single item, along with its box.
+//
+// Points, boxes and items are those of the octree (see octree.h).
+
+// Children of each node, the index used for 'no child' and the bit marking
+// a lane which holds an item rather than a node.
+const unsigned int bvhWidth = 4;
+const unsigned int bvhNone = 0xffffffff;
+const unsigned int bvhItem = 0x80000000;
+
+// Queries size their traversal stacks by this. Build() sorts items by a
+// Morton code of 10 levels and then by their index, so no path from the
+// root is longer than 64 binary splits and each node visited leaves at
+// most bvhWidth - 1 more lanes to visit later.
+const unsigned int bvhStackSize = 3 * 64 + bvhWidth;
+
+// A node of the BVH. The boxes of its lanes are stored with each coordinate
+// in its own array (mMin[0] holds min.x of all lanes and so on) so that all
+// lanes are tested against a query together. mChild[n] is the node of lane
+// n, or bvhItem with the index of the item (into the ids of the BVH) or
+// bvhNone when the lane is empty. Lanes in use come first.
+template <typename Scalar, unsigned int Dim>
+struct BvhNode
+{
+   Scalar mMin[Dim][bvhWidth];
+   Scalar mMax[Dim][bvhWidth];
+   unsigned int mChild[bvhWidth];
+};
+
+// The shape and memory of a BVH, from GetStats(). Memory is in bytes.
+struct BvhStats
+{
+   unsigned int mNodes;             // nodes in the tree
+   unsigned int mDepth;             // nodes on the longest path from the root
+   size_t mItems;                   // items held
+   double mLanesUsed;               // lanes in use per node (up to bvhWidth)
+   size_t mNodeBytes;               // nodes in use
+   size_t mIdBytes;                 // item ids in use
+   size_t mScratchBytes;            // Build() buffers
+   size_t mBytes;                   // all memory held, in use or not
+};
+
+// Buffers kept between builds (defined in bvh.cpp).
+template <typename Scalar, unsigned int Dim>
+struct BvhScratch;
+
+// A BVH is an alternative to the octree for scenes whose items differ
+// wildly in size. The octree copies an item into every leaf it overlaps, so
+// a few large items among many small ones take a lot of memory and slow
+// down every query passing through them. The BVH holds each item once and
+// its memory only grows with the number of items.
+//
+// Building:
+// * Build() is the only way in: the BVH is rebuilt from an array of items
+//   rather than changed item by item. It sorts the items by the Morton code
+//   of their centre (a parallel radix sort), builds a binary tree over the
+//   sorted codes (each node found independently of the others, in
+//   parallel), works out the bounds of all nodes from the leaves up (also
+//   in parallel) and finally folds the binary tree into nodes of bvhWidth
+//   lanes, opening the largest child of each node first. Queries walk the
+//   folded tree.
+//
+// Memory:
+// * Nodes lie in one array with the root first. Like the octree, the arrays
+//   and the Build() buffers keep their memory between builds so that
+//   rebuilding a BVH of a similar size does not allocate.
+//
+// Thread safety:
+// * The queries (all const functions) only read the BVH. Any number of
+//   threads may query it at the same time as long as no thread rebuilds it.
+//
+// Types:
+// * BvhT is compiled (in bvh.cpp) for the same coordinate and payload types
+//   and numbers of axes as OctreeT. Each coordinate type tests the lanes of
+//   a node with SIMD instructions of its own.
+template <typename Scalar, typename Payload, unsigned int Dim = 3>
+class BvhT
+{
+public:
+   typedef PointT<Scalar, Dim> Point;
+   typedef aabbT<Scalar, Dim> aabb;
+   typedef ItemT<Scalar, Payload, Dim> Item;
+   typedef typename OctreeReal<Scalar>::type Real;
+
+private:
+   typedef BvhNode<Scalar, Dim> Node;
+   typedef BvhScratch<Scalar, Dim> Scratch;
+
+public:
+   BvhT();
+   BvhT(const BvhT& o) = delete;
+   virtual ~BvhT();
+
+   // Replaces the contents of the BVH with count items. The work is spread
+   // across all cores. Fails if count does not fit in 31 bits.
+   bool Build(Item const* pItems, size_t count);
+
+   // Clear the BVH (in constant time).
+   bool Reset();
+
+   // Statistics. GetStats() walks the whole tree.
+   void GetStats(BvhStats& stats) const;
+
+   // The queries of the octree (see octree.h), with the same arguments and
+   // results. Items are held once, so none is found twice, and the whole of
+   // each item is considered since a BVH has no bounds of its own.
+   int Query(Point const& point, Payload* outResults, int maxResults) const;
+   int QueryBox(aabb const& box, Payload* outResults, int maxResults) const;
+   int QuerySphere(Point const& centre, Real radius, Payload* outResults,
+      int maxResults) const;
+   int RayCast(Point const& origin, Point const& dir, Real maxT,
+      Payload* outResults, Real* outT, int maxResults) const;
+
+private:
+   std::vector<Node> mNodes;        // all nodes (root first)
+   std::vector<Payload> mIds;       // ids of the items (in Morton order)
+   unsigned int mNodeCount;         // nodes in use
+   unsigned int mItemCount;         // items held
+   Scratch* mpScratch;              // Build() buffers
+
+   void buildCodes(Item const* pItems, size_t count);
+   void buildTree();
+   void buildBounds(Item const* pItems);
+   void collapse(Item const* pItems);
+   void getLaneBounds(Item const* pItems, unsigned int ref, aabb& bounds)
+      const;
+};
+
+typedef BvhT<float, int> Bvh;
+typedef BvhT<float, int, 2> Bvh2;
+
+#endif   // __BVH_H_0E6F2B94C3A15D7E8F41B09D62C7A8E5__
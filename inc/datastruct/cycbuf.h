@@ -33,6 +33,9 @@ Version control
 22 Mar 2019 Duncan Camilleri           Added copyright notice
 31 Mar 2019 Duncan Camilleri           Using helpers.h for byte support
 05 Apr 2019 Duncan Camilleri           Introduced reset()
+18 Oct 2026 Duncan Camilleri           Added find(), peek() and consumeUntil()
+18 Oct 2026 Duncan Camilleri           Read/write counters replace pointers
+18 Oct 2026 Duncan Camilleri           waitReadable() and waitWritable()
 
 */
 
@@ -42,6 +45,8 @@ Version control
 // Check for missing includes.
 #if not defined _GLIBCXX_STRING
 #error "cycbuf.h: missing include - string"
+#elif not defined _SYS_TIME_H
+#error "cycbuf.h: missing include - sys/time.h"
 #elif not defined __HELPERS_H_1181F24416A281704183E457A90E8460__
 #error "cycbuf.h: missing include - helpers.h"
 #endif
@@ -58,23 +63,30 @@ enum cycsiz : unsigned int {
 
 // Cyclic buffer
 // Rules:
-// * Buffer consists of a start and end defining the space of the whole buffer.
-// * Buffer has a head which defines the start of data
-// * Buffer has a tail which defines the end of data
-// * The tail pointer never contains any valid data
-// * The end pointer never contains any valid data
-// * When head == tail, the buffer is empty
-// * When head == tail - 1, the buffer is full
-// * When head == start and tail = end, buffer is also full
+// * The buffer size is a power of two (all cycsiz values are).
+// * A read and a write counter hold the total number of bytes ever read from
+//   and written to the buffer. They only ever increase (until reset).
+// * The head (start of data) is the read counter masked by size - 1.
+// * The tail (end of data) is the write counter masked by size - 1.
+// * write - read is the number of bytes in the buffer.
+// * When write == read, the buffer is empty
+// * When write - read == size, the buffer is full (all of it is usable)
+// * The buffer holds no pointers into itself so it may be copied or moved
+//   byte for byte.
+// * One thread may read while another thread writes. Counters are published
+//   with release/acquire ordering. reset() and copies are not thread safe.
 
 template <unsigned int size>
 class cycbuf
 {
+   static_assert((size & (size - 1)) == 0,
+      "cycbuf: size must be a power of two");
+
 public:
    // Construction/Destruction
    cycbuf();
-   cycbuf(const cycbuf& c);
-   virtual ~cycbuf();
+   cycbuf(const cycbuf& c) = default;
+   ~cycbuf() = default;
 
    // Conversion.
    std::string toString();
@@ -103,25 +115,65 @@ public:
    byte* getWriteTail(size_t& s);
    void pushWriteTail(size_t s);
 
+   // Search functions.
+   // These functions look into the data held by the cyclic buffer without
+   // copying it out. Offsets are relative to the read head; offset 0 is the
+   // next byte that readcopy() or getReadHead() would return. Data that wraps
+   // around the end of the buffer is dealt with internally.
+   // find returns the offset of the first occurrence of pPattern at or after
+   // offset 'from' or npos if the pattern is not in the buffer (yet).
+   // peek returns a pointer to the data at offset and reduces s to the number
+   // of contiguous bytes available at that pointer. If the data wraps, call
+   // peek again with offset + s to get the remainder.
+   // consumeUntil disposes of all data up to and including the first
+   // occurrence of pDelim and returns the number of bytes disposed. When the
+   // delimiter is not found, nothing is disposed and 0 is returned.
+   static const size_t npos = (size_t)-1;
+   size_t find(byte const* pPattern, size_t len, size_t from = 0) const;
+   byte const* peek(size_t offset, size_t& s) const;
+   size_t consumeUntil(byte const* pDelim, size_t len);
+
+   // Waiting functions.
+   // These block the reading thread until there is data to read or the
+   // writing thread until there is space to write, or until the timeout
+   // expires (a null timeout waits forever). Both return true when ready.
+   // Sleeping is done on a futex and the other side only makes the wake up
+   // system call when somebody is actually asleep.
+   bool waitReadable(const timeval* const pTimeout = nullptr);
+   bool waitWritable(const timeval* const pTimeout = nullptr);
+
    void reset();
 
 private:
-   bool mFailWrite = false;               // when the buffer is not big enough
-
-   byte* mpHead = mBuf;                   // head of data
-   byte* mpTail = mpHead;                 // tail of data
-   byte* mpStart = mBuf;                  // start of buffer
-   byte* mpEnd = &mBuf[size - 1];         // end of buffer
+   static const unsigned long long mMask = size - 1;
+
+   unsigned long long mRead = 0;          // bytes read (head of data)
+   unsigned long long mWrite = 0;         // bytes written (tail of data)
+   unsigned int mWriteSeq = 0;            // futex: bumped for sleeping reader
+   unsigned int mReaderWaiting = 0;       // reader sleeping on mWriteSeq
+   unsigned int mReadSeq = 0;             // futex: bumped for sleeping writer
+   unsigned int mWriterWaiting = 0;       // writer sleeping on mReadSeq
    byte mBuf[(int)size];                  // whole buffer
 
 public:
    // Buffer status checks
-   bool isEmpty();
-   bool isFull();
+   bool isEmpty() const;
+   bool isFull() const;
+
+   // Number of bytes available for reading.
+   size_t getReadSize() const;
 
 private:
-   bool isReadReady();
-   bool isWriteReady();
+   // Thread safe counter access (see COUNTERS in cycbuf.cpp).
+   size_t readable() const;
+   size_t writable() const;
+   void publishRead(size_t s);
+   void publishWrite(size_t s);
+
+   // Gets the data in the buffer as two segments (the second being empty
+   // unless the data wraps). Returns the total size of both.
+   size_t getSegments(byte const*& pSeg1, size_t& s1,
+      byte const*& pSeg2, size_t& s2) const;
 };
 
 #endif   // __CYCBUF_H_F25692AD56E4CE3BBACE97C4F90C99B8__
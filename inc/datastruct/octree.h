@@ -26,6 +26,27 @@ Purpose: A 3D octagonal tree for collision detection and more.
 
 Version control
 22 Mar 2019 Duncan Camilleri           Added copyright notice
+18 Oct 2026 Duncan Camilleri           Linear (flat array) octree
+18 Oct 2026 Duncan Camilleri           Parallel bulk Build()
+18 Oct 2026 Duncan Camilleri           QueryBox() and QuerySphere()
+18 Oct 2026 Duncan Camilleri           QueryKNN()
+18 Oct 2026 Duncan Camilleri           QueryBatch()
+18 Oct 2026 Duncan Camilleri           Freeze() and ParallelQuery()
+18 Oct 2026 Duncan Camilleri           Remove() and Update()
+18 Oct 2026 Duncan Camilleri           Memory kept between builds
+18 Oct 2026 Duncan Camilleri           Split policy
+18 Oct 2026 Duncan Camilleri           Loose octree
+18 Oct 2026 Duncan Camilleri           RayCast()
+18 Oct 2026 Duncan Camilleri           ForEachOverlappingPair()
+18 Oct 2026 Duncan Camilleri           Save() and Map()
+18 Oct 2026 Duncan Camilleri           SIMD item overlap test
+18 Oct 2026 Duncan Camilleri           Templated coordinate and payload types
+18 Oct 2026 Duncan Camilleri           Quadtree (2D) from the same template
+18 Oct 2026 Duncan Camilleri           Statistics and query counters
+18 Oct 2026 Duncan Camilleri           Query hints for coherent queries
+18 Oct 2026 Duncan Camilleri           Loose octree pairs in one walk down
+18 Oct 2026 Duncan Camilleri           Small trees QueryBatch() point by point
+18 Oct 2026 Duncan Camilleri           Default policy bounds copies of items
 */
 
 #ifndef __OCTREE_H_C320E78EB2172B4CB9E10507D5D96B4A__
@@ -41,56 +62,348 @@ Version control
 //                equally sized child cubes.
 // Leaf:          a node which is not split any further. It will be a bounding
 //                cube containing a list of object references it encloses.
-struct Point
+// Quadtree:      the same in 2D (Dim 2). Each node has 4 child squares.
+//
+// Coordinates are of type Scalar: float, double or int (fixed point, in
+// whatever unit suits the world). Items carry a Payload: an integer or
+// pointer type identifying them. Points of Dim 2 have no z at all.
+template <typename Scalar, unsigned int Dim = 3>
+struct PointT
+{
+   Scalar x;
+   Scalar y;
+   Scalar z;
+};
+
+template <typename Scalar>
+struct PointT<Scalar, 2>
 {
-   float x;
-   float y;
-   float z;
+   Scalar x;
+   Scalar y;
 };
 
-struct aabb
+template <typename Scalar, unsigned int Dim = 3>
+struct aabbT
 {
-   Point min;
-   Point max;
+   PointT<Scalar, Dim> min;
+   PointT<Scalar, Dim> max;
 };
 
-struct Item
+template <typename Scalar, typename Payload, unsigned int Dim = 3>
+struct ItemT
 {
-   int mId;
-   aabb mBounds;
+   Payload mId;
+   aabbT<Scalar, Dim> mBounds;
 };
 
+// The float octree with int ids.
+typedef PointT<float> Point;
+typedef aabbT<float> aabb;
+typedef ItemT<float, int> Item;
+
 // Const pointers to const structs.
 typedef const Point* const CPointPtr;
 typedef const aabb* const CAabbPtr;
 
-// A sequence identifying the index of each node in a vector.
+// A sequence identifying the index of each child node within its parent.
+// The index is the child's Morton digit: bit 0 is set for the right (+x),
+// bit 1 for the bottom (+y) and bit 2 for the near (+z) half. A quadtree
+// only uses the first 4 (the far ones).
 typedef enum _pointIdx {
-   nodeIdxTopLeftNear = 0x0000,
-   nodeIdxTopRightNear = 0x0001,
-   nodeIdxBtmLeftNear = 0x0002,
-   nodeIdxBtmRightNear = 0x0003,
-   nodeIdxTopLeftFar = 0x0004,
-   nodeIdxTopRightFar = 0x0005,
-   nodeIdxBtmLeftFar = 0x0006,
-   nodeIdxBtmRightFar = 0x0007,
+   nodeIdxTopLeftFar = 0x0000,
+   nodeIdxTopRightFar = 0x0001,
+   nodeIdxBtmLeftFar = 0x0002,
+   nodeIdxBtmRightFar = 0x0003,
+   nodeIdxTopLeftNear = 0x0004,
+   nodeIdxTopRightNear = 0x0005,
+   nodeIdxBtmLeftNear = 0x0006,
+   nodeIdxBtmRightNear = 0x0007,
    nodeIdxOutOfBounds = 0xffff
 } PointIdx;
 
-class Octree
+// Type used for distances, radii and positions along rays: the coordinate
+// type itself for floating point and double for fixed point coordinates
+// (whose squares would overflow).
+template <typename Scalar>
+struct OctreeReal
+{
+   typedef Scalar type;
+};
+
+template <>
+struct OctreeReal<int>
+{
+   typedef double type;
+};
+
+// Items held in one item block and the index used for 'no node/block'.
+const unsigned int octreeBlockItems = 8;
+const unsigned int octreeNone = 0xffffffff;
+
+// Levels encoded in a Morton code (Dim bits each) and the largest leaf
+// Build() and Add() leave unsplit.
+const unsigned int octreeMortonLevels = 10;
+const unsigned int octreeBuildLeafItems = 8;
+
+// A leaf is not split when its children would hold this many times its
+// items between them, or more (see OctreePolicy).
+const unsigned int octreeSplitGrowth = 2;
+
+// Deepest level of any node (the root being level 0). Nodes at this level
+// are never split. Queries size their traversal stacks by it.
+const unsigned int octreeMaxLevels = 32;
+const unsigned int octreeStackSize = 7 * octreeMaxLevels + 8;
+
+// When to split a leaf. By default Add() splits leaves as Build() does: once
+// more than octreeBuildLeafItems items cut into a leaf, down to level
+// octreeMortonLevels. Items are copied into every leaf they overlap, so
+// under any policy a leaf is not split when its children would hold
+// octreeSplitGrowth times as many items between them or more. Splitting
+// then stops once the leaves are about the size of the items in them and
+// crowded items of similar sizes are held a few times each rather than once
+// per smallest cell they cover.
+// * mMaxLeafItems: when not 0, a leaf is split only once more items than
+//   this cut into it (items covering all of the leaf or only touching its
+//   sides do not count), down to mMaxDepth. Build() also stops splitting at
+//   this many. Only the number of items changes: the children must still
+//   hold fewer than octreeSplitGrowth times as many.
+// * mMaxDepth: nodes at this level (the root being 0) are never split. At
+//   most octreeMaxLevels.
+// * mMinNodeSize: nodes are never split into children smaller than this
+//   along any axis.
+// * mKeepStraddlers: items overlapping more than one child of a node stay
+//   at the node rather than being copied into every child they overlap.
+//   Every item is then held by exactly one node.
+// * mLooseness: when more than 1 the octree is loose. The items of a node may
+//   stick out of it up to bounds mLooseness times its size (about the same
+//   centre), 2 being usual. Each item is held by exactly one node: the
+//   deepest one its size allows along the path of its centre. Adding or
+//   removing an item then only walks down that path. Leaves are split once
+//   they hold more than mMaxLeafItems items (octreeBuildLeafItems when 0)
+//   and mKeepStraddlers is ignored.
+struct OctreePolicy
 {
+   unsigned int mMaxLeafItems;
+   unsigned int mMaxDepth;
+   float mMinNodeSize;
+   bool mKeepStraddlers;
+   float mLooseness;
+};
+
+const OctreePolicy octreeDefaultPolicy =
+   { 0, octreeMaxLevels, 0.0f, false, 0.0f };
+
+// A node of the linear octree. Nodes do not store their bounds; these are
+// worked out from the root bounds while descending.
+struct OctreeNode
+{
+   unsigned int mChild;             // first of the children (0: leaf)
+   unsigned int mBlock;             // first item block (octreeNone: none)
+   unsigned int mCount;             // items held by this node
+   unsigned int mParent;            // parent node (octreeNone: root)
+};
+
+// The shape and memory of a tree, from GetStats(). Levels count from the
+// root (0). mLeafItems[b] is the number of leaves holding 2^(b-1) up to
+// 2^b - 1 items (those holding none in mLeafItems[0]), the last bucket
+// taking all larger leaves. Memory is in bytes.
+const unsigned int octreeStatsBuckets = 16;
+
+struct OctreeStats
+{
+   unsigned int mNodes;             // nodes in the tree
+   unsigned int mLeaves;            // of which leaves
+   unsigned int mDepth;             // level of the deepest node
+   unsigned int mLevelNodes[octreeMaxLevels + 1];  // nodes at each level
+   size_t mLevelItems[octreeMaxLevels + 1];        // items at each level
+   unsigned int mLeafItems[octreeStatsBuckets];    // leaves by items held
+   unsigned int mMostLeafItems;     // items held by the fullest leaf
+   size_t mItems;                   // distinct items
+   size_t mCopies;                  // items held by all nodes
+   double mDuplication;             // copies per item (1: none, 0: empty)
+   unsigned int mBlocks;            // item blocks in use
+   size_t mNodeBytes;               // nodes in use
+   size_t mBlockBytes;              // item blocks in use
+   size_t mIndexBytes;              // id index (see Remove())
+   size_t mScratchBytes;            // Build() buffers
+   size_t mMapBytes;                // mapped file (see Map())
+   size_t mBytes;                   // all memory held, in use or not
+};
+
+// Kinds of query counted apart (see GetCounters()).
+typedef enum _octreeQueryKind {
+   octreeQueryPoint = 0,            // Query(), QueryBatch(), ParallelQuery()
+   octreeQueryBox,                  // QueryBox()
+   octreeQuerySphere,               // QuerySphere()
+   octreeQueryKNN,                  // QueryKNN()
+   octreeQueryRay,                  // RayCast()
+   octreeQueryKinds
+} OctreeQueryKind;
+
+// Work done by the queries of one kind: the nodes looked at and the items
+// tested against the query.
+struct OctreeCounters
+{
+   unsigned long long mQueries;
+   unsigned long long mNodes;
+   unsigned long long mItems;
+};
+
+// Nodes a hint remembers: the one the last query ended at and those above it.
+const unsigned int octreeHintLevels = 4;
+
+// Where the last query of one caller (say one moving entity) ended, so that
+// its next query can start from there rather than from the root (see
+// Query()). A hint belongs to the caller: keep one per entity or query and
+// zero it before its first use. A hint found stale (the tree was rebuilt,
+// reset or had nodes joined since, or it comes from another tree) is
+// simply ignored, so any hint gives the same results as no hint at all.
+template <typename Scalar, unsigned int Dim = 3>
+struct OctreeHintT
+{
+   const void* mpTree;              // octree the hint was filled by
+   unsigned int mLayout;            // layout of that tree at the time
+   unsigned int mNode;              // node the last query ended at
+   unsigned int mLevels;            // bounds held (0: none)
+   aabbT<Scalar, Dim> mBounds[octreeHintLevels];   // of mNode and up
+};
+
+// Up to octreeBlockItems items of a node with each coordinate in its own
+// array so that they can be tested together (mMin[0] holds min.x and so on).
+template <typename Scalar, typename Payload, unsigned int Dim>
+struct OctreeBlock
+{
+   Scalar mMin[Dim][octreeBlockItems];
+   Scalar mMax[Dim][octreeBlockItems];
+   Payload mId[octreeBlockItems];
+   unsigned int mNext;              // next block of the node (or free list)
+};
+
+// One leaf holding a copy of an item. The refs of an id are chained so that
+// the leaves of an item are found without searching the tree.
+struct OctreeRef
+{
+   unsigned int mNode;              // leaf holding the item
+   unsigned int mNext;              // next ref of the id (or free list)
+};
+
+// A slot of the id table: an id and its first ref (octreeNone: empty).
+template <typename Payload>
+struct OctreeIdSlot
+{
+   Payload mId;
+   unsigned int mRef;
+};
+
+// Buffers kept between builds (defined in octree.cpp).
+struct OctreeScratch;
+
+// Nodes handed down by ForEachOverlappingPair() and the buffers holding
+// them (defined in octree.cpp).
+struct OctreePairNode;
+template <typename Scalar, unsigned int Dim>
+struct OctreePairWork;
+
+// Memory:
+// * Nodes, item blocks and the id index live in arrays which are never
+//   given back while the octree exists. Reset() (and Build()) only mark them
+//   as empty so that building a tree of a similar size again, say once per
+//   frame, carves it out of the same memory without allocating any.
+//
+// Thread safety:
+// * The queries (all const functions) only read the octree. Any number of
+//   threads may query the same octree at the same time as long as no thread
+//   changes it.
+// * Freeze() turns the octree into a read only snapshot: all functions
+//   which change it fail until Thaw() is called, so a frozen octree can
+//   always be shared between threads.
+//
+// Files:
+// * Save() writes the nodes and blocks of the octree to a file exactly as
+//   they are laid out in memory. Map() maps such a file (read only) and
+//   queries it in place, so loading takes the same time however big the
+//   tree is and processes mapping the same file share its pages.
+//
+// Types:
+// * OctreeT is compiled (in octree.cpp) for float, double and int
+//   coordinates, each with int, long long and void* payloads, in 3D and in
+//   2D (Dim 2, a quadtree). Octree is the 3D float one with int ids and
+//   Quadtree the 2D one. Double or fixed point coordinates keep small
+//   items exact far from the origin, where floats are too coarse to tell
+//   them apart. Each coordinate type has block tests of its own so none
+//   pays for the others, and a quadtree stores and tests no z.
+template <typename Scalar, typename Payload, unsigned int Dim = 3>
+class OctreeT
+{
+public:
+   typedef PointT<Scalar, Dim> Point;
+   typedef aabbT<Scalar, Dim> aabb;
+   typedef ItemT<Scalar, Payload, Dim> Item;
+   typedef typename OctreeReal<Scalar>::type Real;
+   typedef void (*PairFn)(Payload idA, Payload idB, void* pCtx);
+   typedef OctreeHintT<Scalar, Dim> Hint;
+
+   // Children of each intermediate node.
+   static const unsigned int Children = 1u << Dim;
+
 private:
-   Octree();
+   typedef OctreeBlock<Scalar, Payload, Dim> Block;
+   typedef OctreeIdSlot<Payload> IdSlot;
+   typedef OctreePairNode PairNode;
+   typedef OctreePairWork<Scalar, Dim> PairWork;
+
+   OctreeT();
 
 public:
-   Octree(aabb& bounds);
-   virtual ~Octree();
+   OctreeT(aabb& bounds);
+   OctreeT(aabb& bounds, OctreePolicy const& policy);
+   OctreeT(const OctreeT& o) = delete;
+   virtual ~OctreeT();
+
+   // Add an item to the octree. Fails while frozen.
+   bool Add(aabb const& bounds, Payload id);
+
+   // Remove every item with id from the octree or move it to new bounds.
+   // Both fail if there is no such item or while frozen. Nodes left without
+   // any items below them are joined back into their parent.
+   // The leaves of each id are indexed the first time either is called
+   // (and kept up to date from then on) so the work done is in proportion
+   // to the leaves of the item rather than to the size of the octree. An
+   // item moving within the single leaf holding it is updated in place.
+   bool Remove(Payload id);
+   bool Update(Payload id, aabb const& bounds);
 
-   // Add an item to the octree.
-   void Add(aabb const& bounds, int id);
+   // Replaces the contents of the octree with count items in one go. The
+   // work is spread across all cores, which is where it gains over adding
+   // the items one by one. Queries return the same items as they would had
+   // the items been added with Add(). Fails while frozen.
+   bool Build(Item const* pItems, size_t count);
 
-   // Clear the octree.
-   void Reset();
+   // Clear the octree (in constant time). Fails while frozen.
+   bool Reset();
+
+   // Split policy. It can only be changed while the octree is empty.
+   bool SetPolicy(OctreePolicy const& policy);
+   OctreePolicy const& GetPolicy() const;
+
+   // Read only snapshots.
+   // Freeze() packs the items of each leaf next to each other (in node
+   // order) for faster queries and stops any changes until Thaw().
+   void Freeze();
+   void Thaw();
+   bool isFrozen() const;
+
+   // Files.
+   // Save() writes a packed copy of the octree (as Freeze() would pack it)
+   // to path, replacing the file without disturbing processes which have
+   // the old one mapped. Map() replaces the contents of the octree with
+   // those of a file written by Save() (on a machine of the same byte order)
+   // and leaves it frozen. Nothing is read up front: pages are read from
+   // the file as queries first touch them. Thaw() copies the tree out of
+   // the file so that it can be changed again. Map() fails on an octree
+   // frozen with Freeze() and only checks the header of the file.
+   bool Save(const char* const path) const;
+   bool Map(const char* const path);
 
    //
    // OCTREE FUNCTIONALITY
@@ -99,17 +412,210 @@ public:
    // Console me!
    void printf();
 
+   // Statistics.
+   // GetStats() walks the whole tree (taking time in proportion to its
+   // size) and describes its shape and the memory it holds. printStats()
+   // prints the same, along with the query counters, in a few lines.
+   void GetStats(OctreeStats& stats) const;
+   void printStats() const;
+
+   // Query counters. These are only counted when octree.cpp is built with
+   // OCTREE_COUNTERS defined (make COUNTERS=1); otherwise no query pays for
+   // them and GetCounters() returns false with every counter 0. pCounters
+   // is an array of octreeQueryKinds counters, one per OctreeQueryKind,
+   // holding the work done since the octree was made or ResetCounters()
+   // was last called. Queries running on several threads at once add their
+   // counts up as each ends.
+   bool GetCounters(OctreeCounters* pCounters) const;
+   void ResetCounters();
+
    // Find up to 'maxResults' intersecting items and write them into
    // 'outResults' array. Returns the actual number of results stored.
-   int Query(Point const& point, int* outResults, int maxResults) const;
+   int Query(Point const& point, Payload* outResults, int maxResults) const;
+
+   // Query for each of count points at once. The results of point n are
+   // written to 'outResults' from index outFirst[n] and there are outCount[n]
+   // of them. Returns the total number of results stored (up to maxResults).
+   // Points are reordered internally so that neighbours are queried together
+   // which is much faster than calling Query for each. Trees small enough to
+   // stay in the cache gain nothing from the reordering and are queried
+   // point by point.
+   int QueryBatch(Point const* pPoints, int count, Payload* outResults,
+      int maxResults, int* outFirst, int* outCount) const;
+
+   // As QueryBatch but the points are shared between threads (one per core).
+   // Each thread queries a run of neighbouring points into a buffer of its
+   // own and the buffers are joined at the end. Results are identical to
+   // those of QueryBatch (points of a small tree are not reordered either).
+   int ParallelQuery(Point const* pPoints, int count, Payload* outResults,
+      int maxResults, int* outFirst, int* outCount) const;
+
+   // Find up to 'maxResults' items overlapping box (or lying within radius of
+   // centre) and write them into 'outResults' array. Each item is reported
+   // once even though it may be held by many leaves. Only the parts of items
+   // within the bounds of the octree are considered. Returns the actual
+   // number of results stored.
+   int QueryBox(aabb const& box, Payload* outResults, int maxResults) const;
+   int QuerySphere(Point const& centre, Real radius, Payload* outResults,
+      int maxResults) const;
+
+   // As Query() and QueryBox() but starting from where the last query with
+   // the same hint ended. The nodes the hint remembers are tried from the
+   // deepest up (through the parent of each) until one holds the point (or
+   // the whole box), and the walk down starts there. Queries moving a little
+   // from one frame to the next then skip most of the tree. The hint is
+   // updated for the next query. Results are those of the plain queries
+   // (for boxes, possibly in another order). A loose octree ignores hints.
+   int Query(Point const& point, Payload* outResults, int maxResults,
+      Hint& hint) const;
+   int QueryBox(aabb const& box, Payload* outResults, int maxResults,
+      Hint& hint) const;
+
+   // Find the k items nearest to point and write them into 'outResults' and
+   // their distances into 'outDistances' (both arrays of k), nearest first.
+   // Distances are measured to the nearest point of each item within the
+   // bounds of the octree (0 when the item holds point). Returns the actual
+   // number of results stored (less than k if there are not enough items).
+   int QueryKNN(Point const& point, int k, Payload* outResults,
+      Real* outDistances) const;
+
+   // Find up to 'maxResults' items hit by the ray from origin along dir, up
+   // to maxT times dir, and write them into 'outResults' and where the ray
+   // enters each (as a multiple of dir, 0 when origin lies within the item)
+   // into 'outT', nearest first. With maxResults 1 this is the first hit. A
+   // segment from a to b is the ray from a along b - a with maxT 1. Only the
+   // parts of items within the bounds of the octree are considered. Returns
+   // the actual number of results stored.
+   int RayCast(Point const& origin, Point const& dir, Real maxT,
+      Payload* outResults, Real* outT, int maxResults) const;
+
+   // Calls fn(idA, idB, pCtx) exactly once for each pair of items which
+   // overlap (or touch) within the bounds of the octree, in no particular
+   // order, and returns the number of pairs. The nodes are shared between
+   // threads (one per core) so fn may be called from several threads at the
+   // same time.
+   size_t ForEachOverlappingPair(PairFn fn, void* pCtx) const;
 
 private:
-   aabb mBounds;                    // as a leaf node this is the bounding rect
-   std::vector<Octree> mLeaves;     // as an intermediate node this is filled
-   std::vector<Item> mItems;        // as a leaf node this may be filled
+   aabb mBounds;                    // bounds of the root node
+   std::vector<OctreeNode> mNodes;  // all nodes (root first, siblings
+                                    // stored together in Morton order)
+   std::vector<Block> mBlocks;      // item blocks of all nodes
+   OctreeNode* mpNodes;             // nodes in use (mNodes or mapped)
+   Block* mpBlocks;                 // blocks in use (mBlocks or mapped)
+   unsigned int mNodeCount;         // nodes at mpNodes
+   unsigned int mBlockCount;        // blocks at mpBlocks
+   void* mpMap;                     // mapped file (Map())
+   size_t mMapSize;                 // size of the mapped file
+   unsigned int mFreeBlock;         // first unused block
+   unsigned int mFreeNode;          // first of unused sibling nodes
+                                    // (chained through mParent)
+   bool mFrozen;                    // read only snapshot
+   OctreeScratch* mpScratch;        // Build() buffers
+   OctreePolicy mPolicy;            // when to split
+
+   // Leaves of each id (see Remove()).
+   std::vector<IdSlot> mIds;        // id table
+   unsigned int mIdCount;           // ids in mIds
+   std::vector<OctreeRef> mRefs;    // refs of all ids
+   unsigned int mFreeRef;           // first unused ref
+   bool mIndexed;                   // the index is in use
+
+   // Work done by queries (see GetCounters()).
+   mutable OctreeCounters mCounters[octreeQueryKinds];
+
+   // Renumbered whenever nodes may have been given other bounds (the tree
+   // was reset or nodes were joined), so that stale hints are ignored.
+   unsigned int mLayout;
+
+   void setArrays();
+   void unmap();
+   bool isLeaf(unsigned int node) const;
+   unsigned int findLeaf(Point const& point, aabb& bounds) const;
+   int queryNode(unsigned int node, Point const& point, Payload* outResults,
+      int maxResults) const;
+   int queryPoint(Point const& point, Payload* outResults,
+      int maxResults) const;
+   bool isBatchSorted() const;
+   int queryPath(unsigned int leaf, Point const& point, Payload* outResults,
+      int maxResults) const;
+   unsigned int getPathItems(unsigned int leaf) const;
+   size_t forEachPair(unsigned int node, aabb const& bounds, PairFn fn,
+      void* pCtx, std::vector<unsigned int> const& others,
+      std::vector<aabb> const& reaches) const;
+   size_t forEachPairBelow(unsigned int node, aabb const& bounds,
+      Item const& item, PairFn fn, void* pCtx) const;
+   void forEachLoosePair(unsigned int threads, PairFn fn, void* pCtx,
+      std::vector<size_t>& pairs) const;
+   size_t forEachLoosePairBelow(std::vector<PairNode> const& near,
+      unsigned int depth, PairFn fn, void* pCtx, PairWork& work) const;
+   size_t forEachPairNear(std::vector<PairNode> const& near, PairFn fn,
+      void* pCtx, PairWork& work) const;
+   void getPairBounds(unsigned int node, std::vector<aabb>& held,
+      std::vector<aabb>& below) const;
+   void getLoosePairCandidates(std::vector<PairNode> const& near,
+      aabb const* pBelow, std::vector<PairNode>& out) const;
+   bool getLoosePairNodes(PairNode const& parent, unsigned int c,
+      std::vector<PairNode> const& candidates, aabb const* pBelow,
+      std::vector<PairNode>& out) const;
+   bool isPairOwned(aabb const& a, aabb const& b, aabb const& node) const;
+   int queryLoose(Point const& point, Payload* outResults,
+      int maxResults) const;
+   int queryBox(unsigned int start, aabb const& startBounds, aabb const& box,
+      Payload* outResults, int maxResults) const;
+   int queryBoxNode(unsigned int node, aabb const& bounds, aabb const& box,
+      Payload* outResults, int maxResults) const;
+   unsigned int findHinted(Point const& lo, Point const& hi, Hint& hint,
+      aabb& bounds) const;
+   void add(unsigned int node, aabb const& bounds, Item const& item,
+      unsigned int level);
+   void promote(unsigned int node, aabb const& bounds, unsigned int level);
+   bool canSplit(unsigned int level) const;
+   unsigned int getCuttingItems(unsigned int node, aabb const& bounds) const;
+   bool isSplitUseful(unsigned int node, aabb const* pChildBounds) const;
+   static unsigned int countChildren(aabb const* pChildBounds,
+      aabb const& box);
+   bool isKeptByNode(unsigned int node, aabb const& nodeBounds,
+      unsigned int level, aabb const& bounds) const;
 
-   bool isLeaf() const;             // am I a leaf?
-   void promote();                  // promotes a leaf node to intermediate
+   // Items held by one node only (see OctreePolicy).
+   bool isLoose() const;
+   bool isHeldOnce() const;
+   int findChild(aabb const& bounds, Item const& item) const;
+   unsigned int findLooseNode(aabb const& bounds) const;
+   void getLooseBounds(aabb const& bounds, aabb& loose) const;
+   void getReach(unsigned int node, aabb const& bounds, aabb& reach) const;
+   void collapse(unsigned int node);
+   unsigned int getNodeBounds(unsigned int node, aabb& bounds) const;
+
+   // Returns true if pt belongs to leaf. Each point belongs to exactly one
+   // leaf: points on the middle of a node go to the upper half.
+   bool isPointOwned(Point const& pt, aabb const& leaf) const;
+   void printf(unsigned int node, aabb const& bounds);
+
+   // Bulk loading.
+   void buildNodes(Item const* pItems, unsigned int const* pOrder,
+      unsigned int const* pCodes, size_t count);
+   void buildLeaves(Item const* pItems, unsigned int const* pOrder,
+      size_t count);
+
+   // Item blocks.
+   void pushItem(unsigned int node, Item const& item);
+   void getItem(unsigned int block, unsigned int slot, Item& item) const;
+   void setItem(unsigned int block, unsigned int slot, Item const& item);
+   bool findItem(unsigned int node, Payload id, unsigned int& block,
+      unsigned int& slot) const;
+   void removeItem(unsigned int node, unsigned int block, unsigned int slot);
+   unsigned int allocBlock();
+   void freeBlock(unsigned int block);
+
+   // Id index.
+   void buildIndex();
+   void addRef(Payload id, unsigned int node);
+   void removeRef(Payload id, unsigned int node);
+   unsigned int findId(Payload id) const;
+   void eraseId(unsigned int slot);
+   void growIds();
 
    //
    // STATIC HELPERS.
@@ -119,10 +625,22 @@ private:
    // based on the position of the point within bounds.
    static PointIdx findPos(aabb const& bounds, Point const& point);
 
-   // Assumes an array of 8 bounds which will be filled with the bounds of the
-   // child cubes of bounds.
+   // Assumes an array of Children bounds which will be filled with the
+   // bounds of the child cubes of bounds.
    static void getChildBounds(aabb const& bounds, aabb* childbounds);  
 
+   // Gets the bounds of the child cube 'idx' of bounds.
+   static void getChildBound(aabb const& bounds, int idx, aabb& childbound);
+
+   // Returns the Morton code (Dim * 10 bits) of the cell of pt within bounds
+   // when each axis is split into 1024 cells (10 levels). The code holds the
+   // PointIdx of each level from the root down, Dim bits at a time.
+   static unsigned int mortonCode(aabb const& bounds, Point const& pt);
+
+   // Returns the number of items in the first block of a node holding count
+   // items (the first block is the only one which may not be full).
+   static unsigned int firstBlockItems(unsigned int count);
+
    // Returns true of pt lies within ab.
    static bool isPointInBounds(Point const& pt, aabb const& ab);
 
@@ -131,6 +649,31 @@ private:
 
    // Returns true if the big bounds wholly enclose the small bounds.
    static bool isCubeEnclosed(aabb const& big, aabb const& small);
+
+   // Returns true if a and b overlap or touch.
+   static bool isCubeOverlap(aabb const& a, aabb const& b);
+
+   // Returns the only child of bounds which item overlaps or -1 when it
+   // overlaps more than one (or none).
+   static int findItemChild(aabb const& bounds, Item const& item);
+
+   // Returns true if bounds overlap the inside of node without covering it.
+   static bool isCutting(aabb const& node, aabb const& bounds);
+
+   // Returns true if bounds lie strictly within node, clear of its sides.
+   static bool isStrictlyIn(aabb const& node, aabb const& bounds);
+
+   // Returns true if bounds touch or cross the middle of node along any axis.
+   static bool isStraddling(aabb const& node, aabb const& bounds);
+
+   // Returns the square of the distance from pt to the nearest point of ab.
+   static Real distanceSq(Point const& pt, aabb const& ab);
+
+   // Returns the middle of lo and hi. Children are split here everywhere.
+   static Scalar getHalf(Scalar lo, Scalar hi);
 };
 
+typedef OctreeT<float, int> Octree;
+typedef OctreeT<float, int, 2> Quadtree;
+
 #endif   // __OCTREE_H_C320E78EB2172B4CB9E10507D5D96B4A__
@@ -0,0 +1,133 @@
+/*
+Date: 18 Oct 2026 17:20:44.071353218
+File: shmcycbuf.h
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: A cyclic buffer in POSIX shared memory for passing data between
+         processes.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+18 Oct 2026 Duncan Camilleri           Reclaim slots of dead consumers
+
+*/
+
+#ifndef __SHMCYCBUF_H_D49224BF412A4736B980C63BC5EC79C0__
+#define __SHMCYCBUF_H_D49224BF412A4736B980C63BC5EC79C0__
+
+// Check for missing includes.
+#if not defined _GLIBCXX_STRING
+#error "shmcycbuf.h: missing include - string"
+#elif not defined _SYS_TIME_H
+#error "shmcycbuf.h: missing include - sys/time.h"
+#elif not defined __HELPERS_H_1181F24416A281704183E457A90E8460__
+#error "shmcycbuf.h: missing include - helpers.h"
+#endif
+
+// Maximum number of consumers that can attach to one shared buffer.
+const int shmcycbufMaxReaders = 8;
+
+// Layout of the shared memory segment (defined in shmcycbuf.cpp).
+struct shmcycbufhdr;
+
+// Shared memory cyclic buffer
+// Rules:
+// * One producer process creates the named segment and is the only writer.
+// * Up to shmcycbufMaxReaders consumer processes open the segment. Each one
+//   reads the whole stream independently from the point it attached.
+// * Like cycbuf, the buffer is managed by a write counter and (one per
+//   consumer) read counters which only ever increase. The buffer size is a
+//   power of two and the counters are masked to find positions in it.
+// * The producer can only overwrite data which every attached consumer has
+//   read, so the slowest consumer limits the producer.
+// * Each consumer slot records the process id of its owner. The slot of a
+//   consumer which dies without closing is freed once its process is gone
+//   (reaped), when the producer runs out of space or a new consumer opens.
+//   Producer and consumers must therefore share a process id namespace.
+// * Counters are published with release/acquire ordering so the protocol is
+//   safe across processes without locks.
+// * waitReadable/waitWritable sleep on a futex in the segment. The peer only
+//   makes the wake up system call when somebody is actually sleeping.
+class shmcycbuf
+{
+public:
+   // Construction/Destruction
+   shmcycbuf();
+   shmcycbuf(const shmcycbuf& c) = delete;
+   virtual ~shmcycbuf();
+
+   // Producer: creates the segment 'name' (as per shm_open, i.e. "/name")
+   // holding size bytes of data (rounded up to a power of two). Fails with
+   // errno EEXIST if the segment exists, unless replace is true, in which
+   // case it is removed first (e.g. one left by a producer which crashed).
+   bool create(const char* const name, size_t size, bool replace = false);
+
+   // Consumer: attaches to the existing segment 'name'. Reading starts with
+   // the next byte the producer writes.
+   bool open(const char* const name);
+
+   // Detaches from (consumer) or closes and removes (producer) the segment.
+   // Consumers can still read what is left after the producer closes.
+   void close();
+
+   // Copy functions.
+   // writecopy is for the producer and readcopy for consumers.
+   size_t readcopy(byte* pBuf, size_t s);
+   size_t writecopy(byte const* pBuf, size_t s);
+
+   // Direct access functions.
+   // These work as with cycbuf and hand out pointers into the shared memory
+   // so that data is never copied on its way from producer to consumer.
+   byte const* getReadHead(size_t& s);
+   void pushReadHead(size_t s);
+   byte* getWriteTail(size_t& s);
+   void pushWriteTail(size_t s);
+
+   // Waiting functions.
+   // Block until there is data to read (consumer) or space to write
+   // (producer), or until the timeout expires. A null timeout waits forever.
+   // Returns true when ready. waitReadable also returns false once the
+   // producer has closed and all data has been read.
+   bool waitReadable(const timeval* const pTimeout = nullptr);
+   bool waitWritable(const timeval* const pTimeout = nullptr);
+
+   // Buffer status checks
+   bool isOpen() const;
+   bool isProducer() const;
+   size_t getReadSize() const;            // bytes this consumer can read
+   size_t getWriteSize() const;           // bytes the producer can write
+
+private:
+   shmcycbufhdr* mpHdr = nullptr;         // shared header
+   byte* mpData = nullptr;                // shared data
+   size_t mSize = 0;                      // data size (power of two)
+   size_t mMapSize = 0;                   // header and data size
+   int mReader = -1;                      // consumer slot (-1 producer)
+   std::string mName;                     // segment name
+
+   bool map(int fd, size_t mapSize);
+   bool reclaimReaders();
+   void notifyReaders();
+   void notifyWriter();
+};
+
+#endif   // __SHMCYCBUF_H_D49224BF412A4736B980C63BC5EC79C0__
@@ -0,0 +1,539 @@
+/*
+Date: 18 Oct 2026 10:12:41.508172303
+File: bench.cpp
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: Cyclic buffer benchmark and stress test.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+18 Oct 2026 Duncan Camilleri           Full capacity checks and copy test
+18 Oct 2026 Duncan Camilleri           Lock free producer/consumer with waits
+18 Oct 2026 Duncan Camilleri           Stress find(), peek() and consumeUntil()
+
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <memory.h>
+#include <sys/time.h>                  // helpers.h
+#include <helpers.h>
+#include "datastruct/cycbuf.h"
+
+using namespace std;
+
+// Chunk sizes used for every buffer size.
+static const size_t gChunks[] = { 1, 16, 64, 256, 1024, 4096 };
+static const size_t gChunkCount = sizeof(gChunks) / sizeof(gChunks[0]);
+
+// Bytes moved per benchmark case and the cap on operations per case.
+static const size_t gBenchBytes = 64 * 1024 * 1024;
+static const size_t gBenchMaxOps = 8 * 1024 * 1024;
+
+//
+// HELPERS
+//
+
+// Seconds elapsed since start.
+static double elapsed(chrono::steady_clock::time_point start)
+{
+   chrono::duration<double> d = chrono::steady_clock::now() - start;
+   return d.count();
+}
+
+// Small and fast pseudo random generator (xorshift64).
+static inline uint64_t nextrand(uint64_t& state)
+{
+   state ^= state << 13;
+   state ^= state >> 7;
+   state ^= state << 17;
+   return state;
+}
+
+// The byte expected at stream position seq. Not periodic over 256 bytes so
+// that skipped or repeated blocks are detected.
+static inline byte seqbyte(uint64_t seq)
+{
+   return (byte)((seq * 0x9E3779B97F4A7C15ull) >> 56);
+}
+
+static void report(const char* api, unsigned int size, size_t chunk,
+   size_t bytes, size_t ops, double secs)
+{
+   printf("%-8s %9u %6zu %10.3f GB/s %12.0f ops/s\n", api, size, chunk,
+      (bytes / secs) / 1e9, ops / secs);
+}
+
+//
+// BENCHMARKS
+//
+
+// Write followed by read of the same chunk with readcopy/writecopy.
+template <unsigned int size>
+void benchCopy(size_t chunk)
+{
+   cycbuf<size>* pCyc = new cycbuf<size>;
+   byte* pIn = new byte[chunk];
+   byte* pOut = new byte[chunk];
+   memset(pIn, 0x5a, chunk);
+
+   size_t loops = min(gBenchBytes / chunk, gBenchMaxOps);
+   size_t bytes = 0;
+   size_t ops = 0;
+   auto start = chrono::steady_clock::now();
+   for (size_t n = 0; n < loops; ++n) {
+      bytes += pCyc->writecopy(pIn, chunk);
+      pCyc->readcopy(pOut, chunk);
+      ops += 2;
+   }
+   report("copy", size, chunk, bytes, ops, elapsed(start));
+
+   delete [] pOut;
+   delete [] pIn;
+   delete pCyc;
+}
+
+// Write followed by read of the same chunk with the direct access functions.
+template <unsigned int size>
+void benchDirect(size_t chunk)
+{
+   cycbuf<size>* pCyc = new cycbuf<size>;
+   byte* pIn = new byte[chunk];
+   byte* pOut = new byte[chunk];
+   memset(pIn, 0x5a, chunk);
+
+   size_t loops = min(gBenchBytes / chunk, gBenchMaxOps);
+   size_t bytes = 0;
+   size_t ops = 0;
+   auto start = chrono::steady_clock::now();
+   for (size_t n = 0; n < loops; ++n) {
+      size_t s = 0;
+      byte* pTail = pCyc->getWriteTail(s);
+      s = min(s, chunk);
+      if (pTail) memcpy(pTail, pIn, s);
+      pCyc->pushWriteTail(s);
+      bytes += s;
+
+      byte const* pHead = pCyc->getReadHead(s);
+      s = min(s, chunk);
+      if (pHead) memcpy(pOut, pHead, s);
+      pCyc->pushReadHead(s);
+      ops += 2;
+   }
+   report("direct", size, chunk, bytes, ops, elapsed(start));
+
+   delete [] pOut;
+   delete [] pIn;
+   delete pCyc;
+}
+
+// One producer and one consumer thread passing data through the buffer
+// without locks. Each side sleeps with waitWritable/waitReadable when it
+// can't make progress.
+template <unsigned int size>
+void benchSpsc(size_t chunk)
+{
+   cycbuf<size>* pCyc = new cycbuf<size>;
+   const size_t total = gBenchBytes / 4;
+   size_t ops = 0;
+
+   auto start = chrono::steady_clock::now();
+   thread producer([&]() {
+      byte* pIn = new byte[chunk];
+      memset(pIn, 0x5a, chunk);
+      size_t sent = 0;
+      while (sent < total && pCyc->waitWritable()) {
+         size_t s = min(chunk, total - sent);
+         sent += pCyc->writecopy(pIn, s);
+      }
+      delete [] pIn;
+   });
+
+   byte* pOut = new byte[chunk];
+   size_t recvd = 0;
+   while (recvd < total && pCyc->waitReadable()) {
+      recvd += pCyc->readcopy(pOut, chunk);
+      ++ops;
+   }
+   producer.join();
+   report("spsc", size, chunk, recvd, ops, elapsed(start));
+
+   delete [] pOut;
+   delete pCyc;
+}
+
+template <unsigned int size>
+void benchSize()
+{
+   for (size_t n = 0; n < gChunkCount; ++n) benchCopy<size>(gChunks[n]);
+   for (size_t n = 0; n < gChunkCount; ++n) benchDirect<size>(gChunks[n]);
+   for (size_t n = 0; n < gChunkCount; ++n) benchSpsc<size>(gChunks[n]);
+}
+
+void bench()
+{
+   printf("%-8s %9s %6s %15s %18s\n",
+      "api", "size", "chunk", "throughput", "rate");
+   benchSize<tiny>();
+   benchSize<small>();
+   benchSize<medium>();
+   benchSize<large>();
+   benchSize<huge>();
+}
+
+//
+// STRESS TEST
+//
+
+// Returns the offset of the first occurrence of pattern in data at or after
+// from, or npos, comparing byte by byte.
+static size_t refFind(vector<byte> const& data, vector<byte> const& pattern,
+   size_t from)
+{
+   const size_t len = pattern.size();
+   for (size_t pos = from; pos + len <= data.size(); ++pos) {
+      size_t n = 0;
+      while (n < len && data[pos + n] == pattern[n]) ++n;
+      if (n == len) return pos;
+   }
+
+   return cycbuf<tiny>::npos;
+}
+
+// Performs random operations on a buffer and checks the state after each one
+// against a model of what has been written and read. Data is written as a
+// non repeating stream so that any lost, duplicated or reordered byte is
+// caught. Returns false on the first failure.
+template <unsigned int size>
+bool stressSize(uint64_t ops, uint64_t seed)
+{
+   cycbuf<size>* pCyc = new cycbuf<size>;
+   const size_t maxChunk = min(size * 2, 8192);
+   byte* pTmp = new byte[maxChunk];
+   uint64_t wseq = 0;                     // stream position written
+   uint64_t rseq = 0;                     // stream position read
+   uint64_t base = 0;                     // stream position at last reset
+   uint64_t rnd = seed;
+   bool ok = true;
+   vector<byte> data;
+   vector<byte> pattern;
+
+   auto fail = [&](uint64_t op, const char* const what) {
+      printf("stress %u: op %llu: %s (written %llu read %llu avail %zu)\n",
+         size, (unsigned long long)op, what, (unsigned long long)wseq,
+         (unsigned long long)rseq, pCyc->getReadSize());
+      ok = false;
+   };
+
+   auto verify = [&](byte const* p, size_t s) {
+      for (size_t n = 0; n < s; ++n, ++rseq) {
+         if (p[n] != seqbyte(rseq)) return false;
+      }
+      return true;
+   };
+
+   // Checks find(), peek() and consumeUntil() against a byte by byte search
+   // of the data the model holds. Patterns are copied from the stream, half
+   // of them straddling the point where the data wraps around the end of
+   // the buffer. Some are altered so they may not be found, some run past
+   // the data or are longer than all of it, and offsets may lie beyond the
+   // data.
+   auto search = [&](uint64_t op) {
+      const size_t avail = (size_t)(wseq - rseq);
+      data.resize(avail);
+      for (size_t n = 0; n < avail; ++n) data[n] = seqbyte(rseq + n);
+
+      uint64_t r = nextrand(rnd);
+      size_t len = 1 + (size_t)(r % 16);
+      size_t at = avail ? (size_t)((r >> 8) % avail) : 0;
+      size_t wrapAt = size - (size_t)((rseq - base) & (size - 1));
+      if ((r >> 32) & 1 && len > 1 && wrapAt < avail) {
+         at = wrapAt - min(1 + (size_t)((r >> 36) % (len - 1)), wrapAt);
+      }
+
+      // Shape 0 is longer than all of the data and shape 1 has its last
+      // byte altered. The others are left as copied.
+      unsigned int shape = (unsigned int)((r >> 40) & 3);
+      if (shape == 0) {
+         len = avail + 1 + (size_t)((r >> 42) % 4);
+         at = 0;
+      }
+      pattern.resize(len);
+      for (size_t n = 0; n < len; ++n) pattern[n] = seqbyte(rseq + at + n);
+      if (shape == 1) {
+         pattern[len - 1] = (byte)((unsigned char)pattern[len - 1] ^
+            (unsigned char)(1 + (r >> 44) % 255));
+      }
+
+      size_t from = (size_t)((r >> 52) % (avail + 3));
+      if (pCyc->find(pattern.data(), len, from) != refFind(data, pattern, from))
+         fail(op, "find vs byte search");
+
+      // Peek a range (or past the data) piece by piece.
+      r = nextrand(rnd);
+      size_t offset = (size_t)(r % (avail + 3));
+      size_t want = 1 + (size_t)((r >> 16) % maxChunk);
+      size_t got = 0;
+      int pieces = 0;
+      while (got < want && ok) {
+         size_t s = want - got;
+         byte const* p = pCyc->peek(offset + got, s);
+         if (offset + got >= avail) {
+            if (p || s) fail(op, "peek past the data");
+            break;
+         }
+         if (!p || s == 0 || s > want - got) {
+            fail(op, "peek size");
+            break;
+         }
+         for (size_t n = 0; n < s; ++n) {
+            if (p[n] != data[offset + got + n]) {
+               fail(op, "peek data mismatch");
+               break;
+            }
+         }
+         got += s;
+         ++pieces;
+      }
+      if (offset < avail && got != min(want, avail - offset))
+         fail(op, "peek did not reach the end of the range");
+      if (pieces > 2) fail(op, "peek took more than two pieces");
+
+      // Dispose of data up to a delimiter half of the time.
+      if ((r >> 48) & 1) {
+         size_t pos = refFind(data, pattern, 0);
+         size_t gone = pCyc->consumeUntil(pattern.data(), len);
+         if (gone != (pos == cycbuf<size>::npos ? 0 : pos + len))
+            fail(op, "consumeUntil disposed of the wrong count");
+         rseq += gone;
+      }
+   };
+
+   for (uint64_t op = 0; op < ops && ok; ++op) {
+      uint64_t r = nextrand(rnd);
+      size_t s = (size_t)((r >> 8) % (maxChunk + 1));
+      bool wasEmpty = pCyc->isEmpty();
+      bool wasFull = pCyc->isFull();
+
+      switch (r & 0x07) {
+      case 0:
+      case 1: {
+         // Write copy.
+         for (size_t n = 0; n < s; ++n) pTmp[n] = seqbyte(wseq + n);
+         size_t w = pCyc->writecopy(pTmp, s);
+         if (w > s) fail(op, "writecopy wrote more than asked");
+         if (s > 0 && (w == 0) != wasFull) fail(op, "writecopy vs isFull");
+         wseq += w;
+         break;
+      }
+      case 2:
+      case 3: {
+         // Read copy.
+         size_t rd = pCyc->readcopy(pTmp, s);
+         if (rd > s) fail(op, "readcopy read more than asked");
+         if (s > 0 && (rd == 0) != wasEmpty) fail(op, "readcopy vs isEmpty");
+         if (!verify(pTmp, rd)) fail(op, "readcopy data mismatch");
+         break;
+      }
+      case 4: {
+         // Direct write.
+         size_t avail = 0;
+         byte* pTail = pCyc->getWriteTail(avail);
+         if ((pTail == nullptr) != wasFull) fail(op, "getWriteTail vs isFull");
+         size_t w = min(avail, s);
+         for (size_t n = 0; n < w; ++n) pTail[n] = seqbyte(wseq + n);
+         pCyc->pushWriteTail(w);
+         wseq += w;
+         break;
+      }
+      case 5:
+      case 6: {
+         // Direct read.
+         size_t avail = 0;
+         byte const* pHead = pCyc->getReadHead(avail);
+         if ((pHead == nullptr) != wasEmpty) fail(op, "getReadHead vs isEmpty");
+         if (avail > wseq - rseq) fail(op, "getReadHead beyond data");
+         size_t rd = min(avail, s);
+         if (!verify(pHead, rd)) fail(op, "getReadHead data mismatch");
+         pCyc->pushReadHead(rd);
+         break;
+      }
+      default:
+         // Occasionally start over or carry on with a copy of the buffer
+         // and now and then look into the data.
+         if ((r >> 32) % 1024 == 0) {
+            pCyc->reset();
+            rseq = wseq;
+            base = wseq;
+         } else if ((r >> 32) % 1024 == 1) {
+            cycbuf<size>* pCopy = new cycbuf<size>(*pCyc);
+            delete pCyc;
+            pCyc = pCopy;
+         } else if ((r >> 32) % 16 == 2) {
+            search(op);
+         }
+         break;
+      }
+
+      // Invariants which hold after every operation.
+      size_t avail = pCyc->getReadSize();
+      if (avail != wseq - rseq) fail(op, "read size does not match model");
+      if (avail > size) fail(op, "read size beyond capacity");
+      if (pCyc->isEmpty() != (avail == 0)) fail(op, "isEmpty vs read size");
+      if (pCyc->isFull() != (avail == size)) fail(op, "isFull vs read size");
+   }
+
+   // Drain whatever is left and verify it.
+   byte const* pHead = nullptr;
+   size_t avail = 0;
+   while (ok && (pHead = pCyc->getReadHead(avail)) != nullptr) {
+      if (!verify(pHead, avail)) fail(ops, "drain data mismatch");
+      pCyc->pushReadHead(avail);
+   }
+   if (ok && rseq != wseq) fail(ops, "data left after drain");
+
+   printf("stress %-9u %llu ops %s\n", size, (unsigned long long)ops,
+      ok ? "ok" : "FAILED");
+
+   delete [] pTmp;
+   delete pCyc;
+   return ok;
+}
+
+// Streams bytes from a writer thread to a reader thread with random chunk
+// sizes, a mix of copy and direct access functions and waits, checking every
+// byte on the reading side.
+template <unsigned int size>
+bool stressSpsc(uint64_t bytes, uint64_t seed)
+{
+   cycbuf<size>* pCyc = new cycbuf<size>;
+   const size_t maxChunk = min(size * 2, 8192);
+
+   thread writer([&]() {
+      byte* pTmp = new byte[maxChunk];
+      uint64_t rnd = seed;
+      uint64_t wseq = 0;
+      while (wseq < bytes && pCyc->waitWritable()) {
+         uint64_t r = nextrand(rnd);
+         size_t s = (size_t)min((uint64_t)((r >> 8) % maxChunk) + 1,
+            bytes - wseq);
+         if (r & 1) {
+            for (size_t n = 0; n < s; ++n) pTmp[n] = seqbyte(wseq + n);
+            wseq += pCyc->writecopy(pTmp, s);
+         } else {
+            size_t avail = 0;
+            byte* pTail = pCyc->getWriteTail(avail);
+            size_t w = min(avail, s);
+            for (size_t n = 0; n < w; ++n) pTail[n] = seqbyte(wseq + n);
+            pCyc->pushWriteTail(w);
+            wseq += w;
+         }
+      }
+      delete [] pTmp;
+   });
+
+   byte* pTmp = new byte[maxChunk];
+   uint64_t rnd = ~seed;
+   uint64_t rseq = 0;
+   bool ok = true;
+   while (ok && rseq < bytes && pCyc->waitReadable()) {
+      uint64_t r = nextrand(rnd);
+      size_t s = (size_t)((r >> 8) % maxChunk) + 1;
+      byte const* p = pTmp;
+      size_t rd = 0;
+      if (r & 1) {
+         rd = pCyc->readcopy(pTmp, s);
+      } else {
+         p = pCyc->getReadHead(rd);
+         rd = min(rd, s);
+      }
+      for (size_t n = 0; n < rd && ok; ++n) ok = (p[n] == seqbyte(rseq + n));
+      if (!(r & 1)) pCyc->pushReadHead(rd);
+      rseq += rd;
+   }
+
+   // After a failure keep draining so the writer can finish.
+   while (!ok && rseq < bytes && pCyc->waitReadable()) {
+      size_t rd = 0;
+      pCyc->getReadHead(rd);
+      pCyc->pushReadHead(rd);
+      rseq += rd;
+   }
+   writer.join();
+
+   printf("spsc   %-9u %llu bytes %s\n", size, (unsigned long long)bytes,
+      ok ? "ok" : "FAILED");
+
+   delete [] pTmp;
+   delete pCyc;
+   return ok;
+}
+
+bool stress(uint64_t ops)
+{
+   // Operations are spread evenly across the buffer sizes.
+   uint64_t each = ops / 5;
+   bool ok = true;
+   ok = stressSize<tiny>(each, 0x1234567887654321ull) && ok;
+   ok = stressSize<small>(each, 0x2345678998765432ull) && ok;
+   ok = stressSize<medium>(each, 0x3456789aa9876543ull) && ok;
+   ok = stressSize<large>(each, 0x456789abba987654ull) && ok;
+   ok = stressSize<huge>(each, 0x56789abccba98765ull) && ok;
+
+   // Reader and writer threads streaming one byte per operation above.
+   ok = stressSpsc<tiny>(each, 0x6789abcddcba9876ull) && ok;
+   ok = stressSpsc<large>(each, 0x789abcdeedcba987ull) && ok;
+   return ok;
+}
+
+//
+// MAIN
+//
+
+// Usage: cycbufbench [bench|stress|all] [stress operations]
+int main(int argc, char** argv)
+{
+   string mode = (argc > 1) ? argv[1] : "all";
+   uint64_t ops = (argc > 2) ? strtoull(argv[2], nullptr, 10) : 100000000ull;
+
+   if (mode == "bench" || mode == "all") {
+      printf("Cyclic buffer benchmark\n");
+      printf("-----------------------\n");
+      bench();
+      printf("\n");
+   }
+
+   if (mode == "stress" || mode == "all") {
+      printf("Cyclic buffer stress test\n");
+      printf("-------------------------\n");
+      if (!stress(ops)) return 1;
+   }
+
+   return 0;
+}
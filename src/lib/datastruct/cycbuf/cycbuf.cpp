@@ -32,15 +32,29 @@ Version control
 26 Mar 2019 Duncan Camilleri           cycbuf.h moved to global inc dir
 31 Mar 2019 Duncan Camilleri           helpers.h needed for byte buffer
 05 Apr 2019 Duncan Camilleri           Introduced reset()
+18 Oct 2026 Duncan Camilleri           Added find(), peek() and consumeUntil()
+18 Oct 2026 Duncan Camilleri           Read/write counters replace pointers
+18 Oct 2026 Duncan Camilleri           waitReadable() and waitWritable()
 
 */
 
 // Includes
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <memory.h>
 #include <string>
+#if defined __AVX2__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 #include <helpers.h>
 #include <datastruct/cycbuf.h>
+#include "futex.h"
 
 using namespace std;
 
@@ -51,24 +65,47 @@ template class cycbuf<large>;
 template class cycbuf<huge>;
 
 //
-// CONSTRUCTION/DESTRUCTION
+// SCANNING KERNELS
 //
 
-template <unsigned int size>
-cycbuf<size>::cycbuf()
+// Returns a pointer to the first occurrence of c within the s bytes at p or
+// nullptr if there is none. Compares 32 (AVX2) or 16 (SSE2) bytes at a time
+// when compiled for it and leaves the tail (or other platforms) to memchr.
+static inline byte const* scanbyte(byte const* p, size_t s, byte c)
 {
-   memset(mBuf, 0, size);
+#if defined __AVX2__
+   const __m256i needle32 = _mm256_set1_epi8((char)c);
+   while (s >= 32) {
+      __m256i blk = _mm256_loadu_si256((const __m256i*)p);
+      unsigned int mask =
+         (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(blk, needle32));
+      if (mask) return p + __builtin_ctz(mask);
+      p += 32;
+      s -= 32;
+   }
+#endif
+#if defined __SSE2__
+   const __m128i needle16 = _mm_set1_epi8((char)c);
+   while (s >= 16) {
+      __m128i blk = _mm_loadu_si128((const __m128i*)p);
+      unsigned int mask =
+         (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(blk, needle16));
+      if (mask) return p + __builtin_ctz(mask);
+      p += 16;
+      s -= 16;
+   }
+#endif
+   return (byte const*)memchr(p, (int)c, s);
 }
 
-template <unsigned int size>
-cycbuf<size>::cycbuf(const cycbuf& c)
-: cycbuf()
-{
-}
+//
+// CONSTRUCTION/DESTRUCTION
+//
 
 template <unsigned int size>
-cycbuf<size>::~cycbuf()
+cycbuf<size>::cycbuf()
 {
+   memset(mBuf, 0, size);
 }
 
 //
@@ -99,27 +136,24 @@ std::string cycbuf<size>::toString()
 template <unsigned int size>
 size_t cycbuf<size>::readcopy(byte* pBuf, size_t s)
 {
-   // Check for data availability and head at end of buffer.
-   if (!isReadReady()) return 0;
-
    // Determine number of bytes to copy based on available data.
-   // Remembering that tail always sits in an empty space which is not used.
-   size_t avail = (mpHead > mpTail) ? mpEnd - mpHead : mpTail - mpHead;
+   size_t avail = readable();
    size_t copyBytes = min(avail, s);
-
-   // Copy the memory to the cyclic buffer and empty.
-   memcpy(pBuf, mpHead, copyBytes);
-   memset(mpHead, 0, copyBytes);
+   if (copyBytes == 0) return 0;
+
+   // Data may wrap around the end of the buffer so copy up to two parts.
+   size_t at = (size_t)(mRead & mMask);
+   size_t first = min(copyBytes, size - at);
+   memcpy(pBuf, &mBuf[at], first);
+   memset(&mBuf[at], 0, first);
+   if (first < copyBytes) {
+      memcpy(pBuf + first, mBuf, copyBytes - first);
+      memset(mBuf, 0, copyBytes - first);
+   }
 
    // Move the head.
-   mpHead += copyBytes;
-
-   // If no more data to copy, succeed.
-   size_t remaining = (s == copyBytes ? 0 : s - copyBytes);
-   if (remaining == 0) return copyBytes;
-
-   // More data needs to be copied.
-   return copyBytes + readcopy(pBuf + copyBytes, remaining);
+   publishRead(copyBytes);
+   return copyBytes;
 }
 
 // Write copy will copy the buffer pBuf into the cyclic buffer.
@@ -128,26 +162,22 @@ size_t cycbuf<size>::readcopy(byte* pBuf, size_t s)
 template <unsigned int size>
 size_t cycbuf<size>::writecopy(byte* pBuf, size_t s)
 {
-   // Check for space availability and tail at end of buffer.
-   if (!isWriteReady()) return 0;
-
    // Determine number of bytes to copy based on available space.
-   // Remembering that tail always sits in an empty space which is not used.
-   size_t avail = (mpHead > mpTail) ? mpHead - (mpTail + 1) : mpEnd - mpTail;
-   size_t copyBytes = min(avail, s);
-
-   // Copy the memory to the cyclic buffer.
-   memcpy(mpTail, pBuf, copyBytes);
+   size_t space = writable();
+   size_t copyBytes = min(space, s);
+   if (copyBytes == 0) return 0;
+
+   // Space may wrap around the end of the buffer so copy up to two parts.
+   size_t at = (size_t)(mWrite & mMask);
+   size_t first = min(copyBytes, size - at);
+   memcpy(&mBuf[at], pBuf, first);
+   if (first < copyBytes) {
+      memcpy(mBuf, pBuf + first, copyBytes - first);
+   }
 
    // Move the tail.
-   mpTail += copyBytes;
-
-   // If no more data to copy, succeed.
-   size_t remaining = (s == copyBytes ? 0 : s - copyBytes);
-   if (remaining == 0) return copyBytes;
-
-   // More data needs to be copied.
-   return copyBytes + writecopy(pBuf + copyBytes, remaining);
+   publishWrite(copyBytes);
+   return copyBytes;
 }
 
 //
@@ -170,19 +200,14 @@ size_t cycbuf<size>::writecopy(byte* pBuf, size_t s)
 
 // Returns a read only buffer pointing to the start of the cyclic
 // buffer. s will have the number of bytes that are available for
-// reading in the cyclic buffer.
+// reading in the cyclic buffer up to the end of the buffer memory.
 template <unsigned int size>
 byte const* cycbuf<size>::getReadHead(size_t& s)
 {
-   // Check for data availability and head at end of buffer.
-   if (!isReadReady()) {
-      s = 0;
-      return nullptr;
-   }
-
-   // Determine data available and return.
-   s = (mpHead > mpTail) ? mpEnd - mpHead : mpTail - mpHead;
-   return mpHead;
+   size_t avail = readable();
+   size_t at = (size_t)(mRead & mMask);
+   s = min(avail, size - at);
+   return (s == 0) ? nullptr : &mBuf[at];
 }
 
 // Moves the head to the right, implying that data can be disposed
@@ -190,16 +215,16 @@ byte const* cycbuf<size>::getReadHead(size_t& s)
 template <unsigned int size>
 void cycbuf<size>::pushReadHead(size_t s)
 {
-   // Check for data availability and head at end of buffer.
-   if (!isReadReady()) return;
-
-   // Determine data available and return.
-   size_t avail = (mpHead > mpTail) ? mpEnd - mpHead : mpTail - mpHead;
-   size_t dispose = min(s, avail);
-
-   // Clear memory and move head.
-   memset(mpHead, 0, dispose);
-   mpHead += dispose;
+   size_t avail = readable();
+   size_t dispose = min(avail, s);
+   if (dispose == 0) return;
+
+   // Clear memory (which may wrap) and move head.
+   size_t at = (size_t)(mRead & mMask);
+   size_t first = min(dispose, size - at);
+   memset(&mBuf[at], 0, first);
+   if (first < dispose) memset(mBuf, 0, dispose - first);
+   publishRead(dispose);
 }
 
 // Returns a buffer where data can be stored and the size up to how much
@@ -207,41 +232,187 @@ void cycbuf<size>::pushReadHead(size_t s)
 template <unsigned int size>
 byte* cycbuf<size>::getWriteTail(size_t& s)
 {
-   // Check for space availability and tail at end of buffer.
-   if (!isWriteReady()) {
+   size_t space = writable();
+   size_t at = (size_t)(mWrite & mMask);
+   s = min(space, size - at);
+   return (s == 0) ? nullptr : &mBuf[at];
+}
+
+// Moves the tail to the right, committing data written to the buffer
+// returned by getWriteTail.
+template <unsigned int size>
+void cycbuf<size>::pushWriteTail(size_t s)
+{
+   size_t space = writable();
+   size_t bypass = min(space, s);
+   if (bypass > 0) publishWrite(bypass);
+}
+
+//
+// SEARCH FUNCTIONS
+//
+
+// Finds the first occurrence of pPattern (len bytes) in the buffer at or after
+// offset 'from' and returns its offset from the read head. Candidates are
+// located with the scanning kernel on the first pattern byte within each
+// segment and then verified in full, including patterns which straddle the
+// wrap point. Returns npos when the pattern is not found.
+template <unsigned int size>
+size_t cycbuf<size>::find(byte const* pPattern, size_t len, size_t from) const
+{
+   byte const* pSeg[2];
+   size_t s[2];
+   size_t total = getSegments(pSeg[0], s[0], pSeg[1], s[1]);
+   if (!pPattern || len == 0 || len > total || from > total - len) return npos;
+
+   // Last offset at which the pattern may start.
+   const size_t last = total - len;
+   size_t segAt = 0;                      // offset of current segment
+   for (int n = 0; n < 2; segAt += s[n], ++n) {
+      size_t pos = max(from, segAt);
+      size_t segLast = min(last, segAt + s[n] - 1);
+      if (s[n] == 0 || pos > segLast) continue;
+
+      while (pos <= segLast) {
+         byte const* pCand =
+            scanbyte(pSeg[n] + (pos - segAt), segLast - pos + 1, pPattern[0]);
+         if (!pCand) break;
+         pos = segAt + (pCand - pSeg[n]);
+
+         // Verify the rest of the pattern, which may continue in the
+         // second segment.
+         size_t inSeg = min(len, segAt + s[n] - pos);
+         if (memcmp(pCand, pPattern, inSeg) == 0 &&
+            (inSeg == len ||
+               memcmp(pSeg[1], pPattern + inSeg, len - inSeg) == 0))
+         {
+            return pos;
+         }
+
+         ++pos;
+      }
+   }
+
+   return npos;
+}
+
+// Returns a pointer to the data at offset (relative to the read head) and sets
+// s to the number of contiguous bytes at that pointer, up to the requested s.
+// Nothing is copied or disposed.
+template <unsigned int size>
+byte const* cycbuf<size>::peek(size_t offset, size_t& s) const
+{
+   byte const* pSeg1 = nullptr;
+   byte const* pSeg2 = nullptr;
+   size_t s1 = 0, s2 = 0;
+   size_t total = getSegments(pSeg1, s1, pSeg2, s2);
+   if (offset >= total) {
       s = 0;
       return nullptr;
    }
 
-   // Determine number of bytes to copy based on available space.
-   // Remembering that tail always sits in an empty space which is not used.
-   s = (mpHead > mpTail) ? mpHead - (mpTail + 1) : mpEnd - mpTail;
-   return mpTail;
+   if (offset < s1) {
+      s = min(s, s1 - offset);
+      return pSeg1 + offset;
+   }
+
+   s = min(s, total - offset);
+   return pSeg2 + (offset - s1);
 }
 
+// Disposes of all data up to and including the first occurrence of pDelim.
+// Returns the number of bytes disposed or 0 if the delimiter is not found.
 template <unsigned int size>
-void cycbuf<size>::pushWriteTail(size_t s)
+size_t cycbuf<size>::consumeUntil(byte const* pDelim, size_t len)
 {
-   // Check for space availability and tail at end of buffer.
-   if (!isWriteReady()) return;
+   size_t pos = find(pDelim, len);
+   if (pos == npos) return 0;
+
+   // The data may wrap so push the head one segment at a time.
+   size_t dispose = pos + len;
+   size_t remaining = dispose;
+   while (remaining > 0) {
+      size_t avail = 0;
+      if (!getReadHead(avail)) break;
+      size_t push = min(avail, remaining);
+      pushReadHead(push);
+      remaining -= push;
+   }
 
-   // Determine number of bytes to copy based on available space.
-   // Remembering that tail always sits in an empty space which is not used.
-   size_t avail = (mpHead > mpTail) ? mpHead - (mpTail + 1) : mpEnd - mpTail;
-   size_t bypass = min(s, avail);
+   return dispose - remaining;
+}
+
+//
+// WAITING FUNCTIONS
+//
+
+// Sleeps until there is data to read or the timeout expires. The reader
+// announces that it is sleeping before checking one last time, so a writer
+// publishing data at the same moment either sees the announcement and wakes
+// it or its data is seen by the check. Nothing sleeps (and no system call is
+// made) when data is already there.
+template <unsigned int size>
+bool cycbuf<size>::waitReadable(const timeval* const pTimeout)
+{
+   if (readable() > 0) return true;
+
+   timespec deadline;
+   if (pTimeout) futexdeadline(pTimeout, deadline);
+
+   bool ready = false;
+   __atomic_store_n(&mReaderWaiting, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for (;;) {
+      unsigned int seq = __atomic_load_n(&mWriteSeq, __ATOMIC_SEQ_CST);
+      if (readable() > 0) {
+         ready = true;
+         break;
+      }
+      if (!futexwait(&mWriteSeq, seq, pTimeout ? &deadline : nullptr, false)) {
+         ready = readable() > 0;
+         break;
+      }
+   }
+   __atomic_store_n(&mReaderWaiting, 0, __ATOMIC_SEQ_CST);
+
+   return ready;
+}
+
+// Sleeps until there is space to write or the timeout expires. Mirrors
+// waitReadable().
+template <unsigned int size>
+bool cycbuf<size>::waitWritable(const timeval* const pTimeout)
+{
+   if (writable() > 0) return true;
+
+   timespec deadline;
+   if (pTimeout) futexdeadline(pTimeout, deadline);
+
+   bool ready = false;
+   __atomic_store_n(&mWriterWaiting, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for (;;) {
+      unsigned int seq = __atomic_load_n(&mReadSeq, __ATOMIC_SEQ_CST);
+      if (writable() > 0) {
+         ready = true;
+         break;
+      }
+      if (!futexwait(&mReadSeq, seq, pTimeout ? &deadline : nullptr, false)) {
+         ready = writable() > 0;
+         break;
+      }
+   }
+   __atomic_store_n(&mWriterWaiting, 0, __ATOMIC_SEQ_CST);
 
-   // Move tail.
-   mpTail += bypass;
+   return ready;
 }
 
-// Empties the buffer and resets all pointers.
+// Empties the buffer and resets both counters.
 template <unsigned int size>
 void cycbuf<size>::reset()
 {
-   mpHead = mBuf;             // head of data
-   mpTail = mpHead;           // tail of data
-   mpStart = mBuf;            // start of buffer
-   mpEnd = &mBuf[size - 1];   // end of buffer
+   mRead = 0;
+   mWrite = 0;
 
    memset(mBuf, 0, size);
 }
@@ -251,58 +422,90 @@ void cycbuf<size>::reset()
 //
 
 // Checks whether the buffer is empty.
-// A buffer is empty when the head and tail point to
-// the same location. Since the end position is never
-// used, if the head is at or after the end position,
-// it's implied that the next starting location is
-// the start of the buffer. However, if the tail (which is
-// also never used) is at the start of the buffer, then it
-// can be implied that both head and tail are in the same
-// location. In that case, the buffer is also assumed to be empty.
+// Everything written has been read.
 template <unsigned int size>
-inline bool cycbuf<size>::isEmpty()
+inline bool cycbuf<size>::isEmpty() const
 {
-   return mpHead == mpTail ||
-      (mpHead >= mpEnd && mpTail == mpStart);
+   return __atomic_load_n(&mWrite, __ATOMIC_ACQUIRE) ==
+      __atomic_load_n(&mRead, __ATOMIC_ACQUIRE);
 }
 
 // Checks whether the buffer is full.
-// This is when the tail is one position ahead of the head.
-// Like isEmpty(), the end position of the buffer also needs to
-// be taken into account.
+// The whole buffer holds unread data.
+template <unsigned int size>
+inline bool cycbuf<size>::isFull() const
+{
+   return __atomic_load_n(&mWrite, __ATOMIC_ACQUIRE) -
+      __atomic_load_n(&mRead, __ATOMIC_ACQUIRE) == size;
+}
+
+// Returns the number of bytes available for reading across both segments.
+template <unsigned int size>
+size_t cycbuf<size>::getReadSize() const
+{
+   return readable();
+}
+
+// Gets the data in the buffer as up to two segments without moving the head.
+// The first segment starts at the head and the second segment is only filled
+// when the data wraps around to the start of the buffer.
+template <unsigned int size>
+size_t cycbuf<size>::getSegments(byte const*& pSeg1, size_t& s1,
+   byte const*& pSeg2, size_t& s2) const
+{
+   size_t avail = readable();
+   size_t at = (size_t)(mRead & mMask);
+   s1 = min(avail, size - at);
+   s2 = avail - s1;
+   pSeg1 = (s1 == 0) ? nullptr : &mBuf[at];
+   pSeg2 = (s2 == 0) ? nullptr : mBuf;
+   return avail;
+}
+
+//
+// COUNTERS
+// The reading thread owns mRead and the writing thread owns mWrite. Each
+// side loads the other's counter with acquire and publishes its own with
+// release so that data copied before a counter moves is visible to the
+// other side once it sees the new counter.
+//
+
+// Number of bytes available for reading (reading side).
+template <unsigned int size>
+inline size_t cycbuf<size>::readable() const
+{
+   return (size_t)(__atomic_load_n(&mWrite, __ATOMIC_ACQUIRE) - mRead);
+}
+
+// Number of bytes available for writing (writing side).
 template <unsigned int size>
-inline bool cycbuf<size>::isFull()
+inline size_t cycbuf<size>::writable() const
 {
-      return (mpHead == mpStart && mpTail >= mpEnd) ||
-         (mpTail == (mpHead - 1));
+   return (size_t)(size - (mWrite - __atomic_load_n(&mRead, __ATOMIC_ACQUIRE)));
 }
 
-// Checks to make sure that there is data in the buffer (by calling
-// isEmpty() and also adjusts head position for reading if it's at the
-// end of the buffer.
+// Moves the head and wakes the writer only if it is sleeping. The fence
+// orders the new head before the check of the sleeping flag (pairing with
+// the fence in waitWritable).
 template <unsigned int size>
-inline bool cycbuf<size>::isReadReady()
+inline void cycbuf<size>::publishRead(size_t s)
 {
-   // Check for empty buffer first.
-   if (isEmpty()) return false;
+   __atomic_store_n(&mRead, mRead + s, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&mWriterWaiting, __ATOMIC_RELAXED) == 0) return;
 
-   // If head has reached past the end of the buffer, move it to
-   // start. Data is always available as per check above (isEmpty()).
-   if (mpHead >= mpEnd) mpHead = mpStart;
-   return true;
+   __atomic_fetch_add(&mReadSeq, 1, __ATOMIC_SEQ_CST);
+   futexwake(&mReadSeq, false);
 }
 
-// Ensures there is space for writing in the buffer. Also checks to
-// see if the tail needs to be repositioned for writing whenever it is
-// at the end of the buffer.
+// Moves the tail and wakes the reader only if it is sleeping.
 template <unsigned int size>
-inline bool cycbuf<size>::isWriteReady()
+inline void cycbuf<size>::publishWrite(size_t s)
 {
-   // Can never write to a full buffer.
-   if (isFull()) return false;
+   __atomic_store_n(&mWrite, mWrite + s, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&mReaderWaiting, __ATOMIC_RELAXED) == 0) return;
 
-   // If tail has reached the end of the buffer, move it to
-   // start. Space is always available as per check above (isFull()).
-   if (mpTail >= mpEnd) mpTail = mpStart;
-   return true;
+   __atomic_fetch_add(&mWriteSeq, 1, __ATOMIC_SEQ_CST);
+   futexwake(&mWriteSeq, false);
 }
@@ -0,0 +1,84 @@
+/*
+Date: 18 Oct 2026 16:53:16.922466743
+File: futex.h
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: Minimal futex wait/wake wrappers for the cyclic buffers.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+
+*/
+
+#ifndef __FUTEX_H_796BCB6086554C4B91B5CDA00B79646E__
+#define __FUTEX_H_796BCB6086554C4B91B5CDA00B79646E__
+
+// Check for missing includes.
+#if not defined _SYS_TIME_H
+#error "futex.h: missing include - sys/time.h"
+#elif not defined _TIME_H
+#error "futex.h: missing include - time.h"
+#elif not defined _ERRNO_H
+#error "futex.h: missing include - errno.h"
+#elif not defined _UNISTD_H
+#error "futex.h: missing include - unistd.h"
+#elif not defined _SYSCALL_H
+#error "futex.h: missing include - sys/syscall.h"
+#elif not defined _LINUX_FUTEX_H
+#error "futex.h: missing include - linux/futex.h"
+#endif
+
+// Converts a relative timeout into an absolute deadline on the monotonic
+// clock so that waits which are woken early can carry on with the time left.
+inline void futexdeadline(const timeval* const pTimeout, timespec& deadline)
+{
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += pTimeout->tv_sec;
+   deadline.tv_nsec += pTimeout->tv_usec * 1000;
+   if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+   }
+}
+
+// Sleeps while the 32 bit word at pWord holds the value expected. Returns
+// false once the absolute (monotonic) deadline has passed and true otherwise
+// (woken, value already changed or interrupted - callers re-check their
+// condition). A null deadline waits forever. Words in memory shared between
+// processes must pass shared as true.
+inline bool futexwait(unsigned int* pWord, unsigned int expected,
+   const timespec* const pDeadline, bool shared)
+{
+   int op = FUTEX_WAIT_BITSET | (shared ? 0 : FUTEX_PRIVATE_FLAG);
+   long r = syscall(SYS_futex, pWord, op, expected, pDeadline, nullptr,
+      FUTEX_BITSET_MATCH_ANY);
+   return !(r == -1 && errno == ETIMEDOUT);
+}
+
+// Wakes all threads (or processes) sleeping on pWord.
+inline void futexwake(unsigned int* pWord, bool shared)
+{
+   int op = FUTEX_WAKE | (shared ? 0 : FUTEX_PRIVATE_FLAG);
+   syscall(SYS_futex, pWord, op, 0x7fffffff, nullptr, nullptr, 0);
+}
+
+#endif   // __FUTEX_H_796BCB6086554C4B91B5CDA00B79646E__
@@ -28,14 +28,20 @@ Version control
 22 Mar 2019 Duncan Camilleri           Added copyright notice
 22 Mar 2019 Duncan Camilleri           Fixed bug with pushRead() old name call
 31 Mar 2019 Duncan Camilleri           helpers.h needed for byte buffer
+18 Oct 2026 Duncan Camilleri           Shared memory cyclic buffer test
+18 Oct 2026 Duncan Camilleri           Dead consumer and EEXIST tests
 
 */
 
 #include <string>
 #include <memory.h>
+#include <errno.h>
+#include <unistd.h>                    // fork
+#include <sys/wait.h>                  // waitpid
 #include <sys/time.h>                  // helpers.h
 #include <helpers.h>
 #include "datastruct/cycbuf.h"
+#include "datastruct/shmcycbuf.h"
 
 using namespace std;
 
@@ -137,6 +143,107 @@ void cyclicdaTest()
    rw((byte*)"wxyz", 4, true);
 }
 
+// Tests the shared memory cyclic buffer with one producer process and two
+// consumer processes, each of which gets all of the data.
+void shmTest()
+{
+   const char* const name = "/cycbuftest";
+   const int consumers = 2;
+   shmcycbuf producer;
+   if (!producer.create(name, tiny)) {
+      printf("could not create %s\n", name);
+      return;
+   }
+
+   // Consumers signal through the pipe once attached.
+   int attached[2];
+   if (pipe(attached) == -1) return;
+
+   // Nothing buffered may be inherited (and printed twice) by consumers.
+   fflush(stdout);
+   pid_t pids[consumers];
+   for (int n = 0; n < consumers; ++n) {
+      pids[n] = fork();
+      if (pids[n] != 0) continue;
+
+      // Consumer process.
+      shmcycbuf consumer;
+      bool ok = consumer.open(name);
+      ::write(attached[1], "x", 1);
+      if (!ok) _exit(1);
+
+      string got;
+      byte buf[8];
+      while (consumer.waitReadable()) {
+         size_t s = consumer.readcopy(buf, sizeof(buf));
+         got.append((char*)buf, s);
+      }
+      printf("consumer %d read: '%s'\n", n, got.c_str());
+      fflush(stdout);
+      _exit(0);
+   }
+
+   // Wait for the consumers and write more than fits in the buffer.
+   char x;
+   for (int n = 0; n < consumers; ++n) ::read(attached[0], &x, 1);
+   const char* const msg = "the quick brown fox jumps over the lazy dog";
+   size_t len = strlen(msg);
+   size_t sent = 0;
+   while (sent < len && producer.waitWritable()) {
+      sent += producer.writecopy((byte const*)msg + sent, len - sent);
+   }
+   printf("producer wrote: '%s'\n", msg);
+   producer.close();
+
+   for (int n = 0; n < consumers; ++n) waitpid(pids[n], nullptr, 0);
+   ::close(attached[0]);
+   ::close(attached[1]);
+}
+
+// Tests that a second producer cannot take over a live segment and that the
+// slot of a consumer which dies without closing stops holding the producer.
+void shmDeadTest()
+{
+   const char* const name = "/cycbuftest";
+   shmcycbuf producer;
+   if (!producer.create(name, tiny, true)) {
+      printf("could not create %s\n", name);
+      return;
+   }
+
+   shmcycbuf second;
+   bool ok = second.create(name, tiny);
+   printf("second create: %s\n",
+      ok ? "replaced live segment" : (errno == EEXIST ? "EEXIST" : "failed"));
+
+   // A consumer which attaches and exits without closing.
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid == 0) {
+      shmcycbuf consumer;
+      _exit(consumer.open(name) ? 0 : 1);
+   }
+   waitpid(pid, nullptr, 0);
+
+   // Without reclaiming, the producer would stop after tiny bytes.
+   byte buf[tiny * 4] = {};
+   size_t sent = 0;
+   timeval timeout = { 1, 0 };
+   while (sent < sizeof(buf) && producer.waitWritable(&timeout)) {
+      sent += producer.writecopy(buf + sent, sizeof(buf) - sent);
+   }
+   printf("producer wrote %zu of %zu bytes past a dead consumer\n", sent,
+      sizeof(buf));
+
+   // Only an open producer writes.
+   shmcycbuf consumer;
+   consumer.open(name);
+   printf("consumer wrote %zu bytes\n", consumer.writecopy(buf, tiny));
+   consumer.close();
+   producer.close();
+   printf("closed producer wrote %zu bytes\n", producer.writecopy(buf, tiny));
+}
+
 int main(int argc, char** argv)
 {
    printf("Copy cyclic buffer test\n");
@@ -147,5 +254,11 @@ int main(int argc, char** argv)
    printf("Direct access cyclic buffer test\n");
    printf("--------------------------------\n");
    cyclicdaTest();
+
+   printf("\n");
+   printf("Shared memory cyclic buffer test\n");
+   printf("--------------------------------\n");
+   shmTest();
+   shmDeadTest();
    return 0;
 }
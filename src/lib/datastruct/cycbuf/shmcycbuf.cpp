@@ -0,0 +1,526 @@
+/*
+Date: 18 Oct 2026 17:20:44.183905617
+File: shmcycbuf.cpp
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: A cyclic buffer in POSIX shared memory for passing data between
+         processes.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+18 Oct 2026 Duncan Camilleri           Reclaim slots of dead consumers
+
+*/
+
+// Includes
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <memory.h>
+#include <string>
+#include <helpers.h>
+#include <datastruct/shmcycbuf.h>
+#include "futex.h"
+
+using namespace std;
+
+// Identifies an initialized segment ("cycb").
+static const unsigned int gShmMagic = 0x63796362;
+
+// Consumer slot states. A slot in use holds the process id of its owner
+// (which is being attached) and slotActive once it is reading. Owner and
+// state change together so a slot is claimed, freed or taken from a dead
+// owner with a single compare and swap.
+enum shmslot : unsigned int {
+   slotFree = 0,
+   slotActive = 0x80000000,               // reading
+   slotPid = 0x7fffffff                   // owner process id
+};
+
+// How often a sleeping producer checks whether consumers have died.
+static const timeval gShmReclaimPoll = { 0, 100000 };
+
+// A consumer's read counter. Each one sits on its own cache line so that
+// consumers do not slow each other (or the producer) down.
+struct alignas(64) shmreader
+{
+   unsigned long long mRead;              // bytes read by this consumer
+   unsigned int mState;                   // shmslot and owner process id
+};
+
+// The shared header. Producer and consumer fields are kept on separate
+// cache lines. Data follows the header at the next page boundary.
+struct shmcycbufhdr
+{
+   unsigned int mMagic;                   // set last once initialized
+   unsigned int mClosed;                  // producer has closed
+   unsigned long long mSize;              // data size (power of two)
+
+   alignas(64) unsigned long long mWrite; // bytes written by the producer
+   unsigned int mWriteSeq;                // futex: bumped for sleeping readers
+   unsigned int mReadersWaiting;          // consumers sleeping on mWriteSeq
+
+   alignas(64) unsigned int mReadSeq;     // futex: bumped for sleeping writer
+   unsigned int mWriterWaiting;           // producer sleeping on mReadSeq
+
+   shmreader mReaders[shmcycbufMaxReaders];
+};
+
+// Offset of the data from the start of the segment.
+static size_t dataOffset()
+{
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   return ((sizeof(shmcycbufhdr) + page - 1) / page) * page;
+}
+
+// True when the slot state is held by a process which no longer exists. A
+// consumer which crashed (or exited without closing) is gone once its
+// process has been reaped.
+static bool isSlotDead(unsigned int state)
+{
+   if (state == slotFree) return false;
+   return kill((pid_t)(state & slotPid), 0) == -1 && errno == ESRCH;
+}
+
+// True when timespec a is earlier than b.
+static bool isBefore(timespec const& a, timespec const& b)
+{
+   if (a.tv_sec != b.tv_sec) return a.tv_sec < b.tv_sec;
+   return a.tv_nsec < b.tv_nsec;
+}
+
+//
+// CONSTRUCTION/DESTRUCTION
+//
+
+shmcycbuf::shmcycbuf()
+{
+}
+
+shmcycbuf::~shmcycbuf()
+{
+   close();
+}
+
+// Creates the shared segment as the producer. The header is initialized
+// before the magic number is published so consumers never attach to a half
+// built segment. An existing segment is only removed when asked to (it may
+// belong to a running producer); otherwise creation fails with EEXIST.
+bool shmcycbuf::create(const char* const name, size_t size, bool replace)
+{
+   if (isOpen() || !name || size == 0) return false;
+
+   // Round the size up to a power of two.
+   size_t pow2 = 1;
+   while (pow2 < size) pow2 <<= 1;
+
+   if (replace) shm_unlink(name);
+   int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+   if (fd == -1) return false;
+
+   size_t mapSize = dataOffset() + pow2;
+   if (ftruncate(fd, (off_t)mapSize) == -1 || !map(fd, mapSize)) {
+      ::close(fd);
+      shm_unlink(name);
+      return false;
+   }
+   ::close(fd);
+
+   // ftruncate zero fills so only the non zero fields need setting.
+   mpHdr->mSize = pow2;
+   mSize = pow2;
+   mReader = -1;
+   mName = name;
+   __atomic_store_n(&mpHdr->mMagic, gShmMagic, __ATOMIC_RELEASE);
+   return true;
+}
+
+// Attaches to an existing segment as a consumer by claiming a free slot or
+// the slot of a consumer which died without closing.
+bool shmcycbuf::open(const char* const name)
+{
+   if (isOpen() || !name) return false;
+
+   int fd = shm_open(name, O_RDWR, 0);
+   if (fd == -1) return false;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size <= dataOffset() ||
+      !map(fd, (size_t)st.st_size))
+   {
+      ::close(fd);
+      return false;
+   }
+   ::close(fd);
+
+   // The producer must have finished initializing.
+   if (__atomic_load_n(&mpHdr->mMagic, __ATOMIC_ACQUIRE) != gShmMagic ||
+      mpHdr->mSize + dataOffset() != mMapSize)
+   {
+      close();
+      return false;
+   }
+   mSize = (size_t)mpHdr->mSize;
+
+   // Claim a slot.
+   unsigned int self = (unsigned int)getpid() & slotPid;
+   for (int n = 0; n < shmcycbufMaxReaders && mReader < 0; ++n) {
+      unsigned int* pState = &mpHdr->mReaders[n].mState;
+      unsigned int expected = __atomic_load_n(pState, __ATOMIC_SEQ_CST);
+      if (expected != slotFree && !isSlotDead(expected)) continue;
+      if (__atomic_compare_exchange_n(pState, &expected, self, false,
+         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      {
+         mReader = n;
+      }
+   }
+   if (mReader < 0) {
+      close();
+      return false;
+   }
+
+   // Start at the current write position. The producer only takes active
+   // slots into account so the position is taken again after activating; a
+   // write in flight while activating then only covers bytes after it.
+   shmreader& rd = mpHdr->mReaders[mReader];
+   unsigned long long w = __atomic_load_n(&mpHdr->mWrite, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&rd.mRead, w, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&rd.mState, self | slotActive, __ATOMIC_SEQ_CST);
+   w = __atomic_load_n(&mpHdr->mWrite, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&rd.mRead, w, __ATOMIC_SEQ_CST);
+
+   mName = name;
+   return true;
+}
+
+// Consumers release their slot (which may free space for the producer). The
+// producer marks the segment closed, wakes any sleeping consumers and removes
+// the name. Mappings held by consumers stay valid until they close.
+void shmcycbuf::close()
+{
+   if (!mpHdr) return;
+
+   if (mReader >= 0) {
+      __atomic_store_n(&mpHdr->mReaders[mReader].mState, slotFree,
+         __ATOMIC_RELEASE);
+      notifyWriter();
+   } else if (__atomic_load_n(&mpHdr->mMagic, __ATOMIC_ACQUIRE) == gShmMagic &&
+      !mName.empty())
+   {
+      __atomic_store_n(&mpHdr->mClosed, 1, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&mpHdr->mWriteSeq, 1, __ATOMIC_SEQ_CST);
+      futexwake(&mpHdr->mWriteSeq, true);
+      shm_unlink(mName.c_str());
+   }
+
+   munmap(mpHdr, mMapSize);
+   mpHdr = nullptr;
+   mpData = nullptr;
+   mSize = 0;
+   mMapSize = 0;
+   mReader = -1;
+   mName.clear();
+}
+
+//
+// COPY FUNCTIONS
+//
+
+// Copies up to s bytes of unread data into pBuf (consumer only). Data which
+// wraps around the end of the buffer is copied in two parts.
+size_t shmcycbuf::readcopy(byte* pBuf, size_t s)
+{
+   size_t avail = getReadSize();
+   size_t copyBytes = min(avail, s);
+   if (copyBytes == 0) return 0;
+
+   shmreader& rd = mpHdr->mReaders[mReader];
+   size_t at = (size_t)(rd.mRead & (mSize - 1));
+   size_t first = min(copyBytes, mSize - at);
+   memcpy(pBuf, mpData + at, first);
+   if (first < copyBytes) memcpy(pBuf + first, mpData, copyBytes - first);
+
+   __atomic_store_n(&rd.mRead, rd.mRead + copyBytes, __ATOMIC_RELEASE);
+   notifyWriter();
+   return copyBytes;
+}
+
+// Copies up to s bytes from pBuf into the buffer (producer only) and
+// publishes them to all consumers at once.
+size_t shmcycbuf::writecopy(byte const* pBuf, size_t s)
+{
+   if (!mpHdr || mReader >= 0) return 0;
+
+   size_t space = getWriteSize();
+   if (space == 0 && reclaimReaders()) space = getWriteSize();
+   size_t copyBytes = min(space, s);
+   if (copyBytes == 0) return 0;
+
+   size_t at = (size_t)(mpHdr->mWrite & (mSize - 1));
+   size_t first = min(copyBytes, mSize - at);
+   memcpy(mpData + at, pBuf, first);
+   if (first < copyBytes) memcpy(mpData, pBuf + first, copyBytes - first);
+
+   __atomic_store_n(&mpHdr->mWrite, mpHdr->mWrite + copyBytes,
+      __ATOMIC_RELEASE);
+   notifyReaders();
+   return copyBytes;
+}
+
+//
+// DIRECT ACCESS FUNCTIONS
+//
+
+// Returns a pointer to unread data in shared memory and sets s to the number
+// of contiguous bytes available there (consumer only).
+byte const* shmcycbuf::getReadHead(size_t& s)
+{
+   s = 0;
+   if (!mpHdr || mReader < 0) return nullptr;
+
+   size_t at = (size_t)(mpHdr->mReaders[mReader].mRead & (mSize - 1));
+   size_t avail = getReadSize();
+   s = min(avail, mSize - at);
+   return (s == 0) ? nullptr : mpData + at;
+}
+
+// Marks s bytes as read, freeing them for the producer once every consumer
+// is done with them.
+void shmcycbuf::pushReadHead(size_t s)
+{
+   size_t avail = getReadSize();
+   size_t dispose = min(avail, s);
+   if (dispose == 0) return;
+
+   shmreader& rd = mpHdr->mReaders[mReader];
+   __atomic_store_n(&rd.mRead, rd.mRead + dispose, __ATOMIC_RELEASE);
+   notifyWriter();
+}
+
+// Returns a pointer to free space in shared memory and sets s to the number
+// of contiguous bytes which can be written there (producer only).
+byte* shmcycbuf::getWriteTail(size_t& s)
+{
+   s = 0;
+   if (!mpHdr || mReader >= 0) return nullptr;
+
+   size_t at = (size_t)(mpHdr->mWrite & (mSize - 1));
+   size_t space = getWriteSize();
+   if (space == 0 && reclaimReaders()) space = getWriteSize();
+   s = min(space, mSize - at);
+   return (s == 0) ? nullptr : mpData + at;
+}
+
+// Publishes s bytes written through getWriteTail to the consumers.
+void shmcycbuf::pushWriteTail(size_t s)
+{
+   size_t space = getWriteSize();
+   size_t bypass = min(space, s);
+   if (bypass == 0) return;
+
+   __atomic_store_n(&mpHdr->mWrite, mpHdr->mWrite + bypass, __ATOMIC_RELEASE);
+   notifyReaders();
+}
+
+//
+// WAITING FUNCTIONS
+//
+
+// Sleeps until this consumer has data to read. The sleeping count is raised
+// before the final check so that a producer publishing data at the same time
+// either sees it (and wakes us) or its data is seen by the check.
+bool shmcycbuf::waitReadable(const timeval* const pTimeout)
+{
+   if (!mpHdr || mReader < 0) return false;
+   if (getReadSize() > 0) return true;
+
+   timespec deadline;
+   if (pTimeout) futexdeadline(pTimeout, deadline);
+
+   bool ready = false;
+   __atomic_fetch_add(&mpHdr->mReadersWaiting, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for (;;) {
+      unsigned int seq = __atomic_load_n(&mpHdr->mWriteSeq, __ATOMIC_SEQ_CST);
+      if (getReadSize() > 0) {
+         ready = true;
+         break;
+      }
+      if (__atomic_load_n(&mpHdr->mClosed, __ATOMIC_ACQUIRE)) break;
+      if (!futexwait(&mpHdr->mWriteSeq, seq, pTimeout ? &deadline : nullptr,
+         true))
+      {
+         ready = getReadSize() > 0;
+         break;
+      }
+   }
+   __atomic_fetch_sub(&mpHdr->mReadersWaiting, 1, __ATOMIC_SEQ_CST);
+
+   return ready;
+}
+
+// Sleeps until the producer has space to write (the slowest consumer has
+// read something, detached or died). A dead consumer wakes nobody so the
+// sleep is cut into gShmReclaimPoll long pieces, checking for dead consumers
+// in between.
+bool shmcycbuf::waitWritable(const timeval* const pTimeout)
+{
+   if (!mpHdr || mReader >= 0) return false;
+   if (getWriteSize() > 0) return true;
+
+   timespec deadline;
+   if (pTimeout) futexdeadline(pTimeout, deadline);
+
+   bool ready = false;
+   __atomic_store_n(&mpHdr->mWriterWaiting, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for (;;) {
+      unsigned int seq = __atomic_load_n(&mpHdr->mReadSeq, __ATOMIC_SEQ_CST);
+      if (getWriteSize() > 0 || (reclaimReaders() && getWriteSize() > 0)) {
+         ready = true;
+         break;
+      }
+
+      timespec poll;
+      futexdeadline(&gShmReclaimPoll, poll);
+      bool last = pTimeout && !isBefore(poll, deadline);
+      if (!futexwait(&mpHdr->mReadSeq, seq, last ? &deadline : &poll, true) &&
+         last)
+      {
+         ready = getWriteSize() > 0;
+         break;
+      }
+   }
+   __atomic_store_n(&mpHdr->mWriterWaiting, 0, __ATOMIC_SEQ_CST);
+
+   return ready;
+}
+
+//
+// BUFFER STATUS CHECKS
+//
+
+bool shmcycbuf::isOpen() const
+{
+   return mpHdr != nullptr;
+}
+
+bool shmcycbuf::isProducer() const
+{
+   return mpHdr != nullptr && mReader < 0;
+}
+
+// Number of bytes written by the producer which this consumer has not read.
+size_t shmcycbuf::getReadSize() const
+{
+   if (!mpHdr || mReader < 0) return 0;
+
+   unsigned long long w = __atomic_load_n(&mpHdr->mWrite, __ATOMIC_ACQUIRE);
+   return (size_t)(w - mpHdr->mReaders[mReader].mRead);
+}
+
+// Number of bytes the producer can write without overwriting data which an
+// active consumer has not read yet.
+size_t shmcycbuf::getWriteSize() const
+{
+   if (!mpHdr || mReader >= 0) return 0;
+
+   unsigned long long w = mpHdr->mWrite;
+   unsigned long long used = 0;
+   for (int n = 0; n < shmcycbufMaxReaders; ++n) {
+      shmreader& rd = mpHdr->mReaders[n];
+      unsigned int state = __atomic_load_n(&rd.mState, __ATOMIC_ACQUIRE);
+      if ((state & slotActive) == 0) continue;
+
+      unsigned long long r = __atomic_load_n(&rd.mRead, __ATOMIC_ACQUIRE);
+      if (w - r > used) used = w - r;
+   }
+
+   return (used >= mSize) ? 0 : (size_t)(mSize - used);
+}
+
+//
+// HELPERS
+//
+
+// Frees the slots of consumers which died without closing (producer only).
+// The compare and swap only succeeds if the slot still holds the dead owner,
+// so a consumer claiming it at the same time is never thrown out. Returns
+// true if a slot was freed.
+bool shmcycbuf::reclaimReaders()
+{
+   bool freed = false;
+   for (int n = 0; n < shmcycbufMaxReaders; ++n) {
+      unsigned int* pState = &mpHdr->mReaders[n].mState;
+      unsigned int state = __atomic_load_n(pState, __ATOMIC_ACQUIRE);
+      if (!isSlotDead(state)) continue;
+
+      if (__atomic_compare_exchange_n(pState, &state, slotFree, false,
+         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      {
+         freed = true;
+      }
+   }
+
+   return freed;
+}
+
+// Maps the segment and sets the header and data pointers.
+bool shmcycbuf::map(int fd, size_t mapSize)
+{
+   void* p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (p == MAP_FAILED) return false;
+
+   mpHdr = (shmcycbufhdr*)p;
+   mpData = (byte*)p + dataOffset();
+   mMapSize = mapSize;
+   return true;
+}
+
+// Wakes consumers only when at least one is sleeping. The fence orders the
+// publication of mWrite before the check of the sleeping count (and pairs
+// with the fence in waitReadable).
+void shmcycbuf::notifyReaders()
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&mpHdr->mReadersWaiting, __ATOMIC_RELAXED) == 0) return;
+
+   __atomic_fetch_add(&mpHdr->mWriteSeq, 1, __ATOMIC_SEQ_CST);
+   futexwake(&mpHdr->mWriteSeq, true);
+}
+
+// Wakes the producer only when it is sleeping.
+void shmcycbuf::notifyWriter()
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&mpHdr->mWriterWaiting, __ATOMIC_RELAXED) == 0) return;
+
+   __atomic_fetch_add(&mpHdr->mReadSeq, 1, __ATOMIC_SEQ_CST);
+   futexwake(&mpHdr->mReadSeq, true);
+}
@@ -0,0 +1,2273 @@
+/*
+Date: 18 Oct 2026 18:02:37.415520961
+File: bench.cpp
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: Octree benchmark.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+18 Oct 2026 Duncan Camilleri           Box and sphere query checks
+18 Oct 2026 Duncan Camilleri           Nearest items against brute force
+18 Oct 2026 Duncan Camilleri           Batched point queries
+18 Oct 2026 Duncan Camilleri           Parallel and frozen queries
+18 Oct 2026 Duncan Camilleri           Moving and removing items
+18 Oct 2026 Duncan Camilleri           Allocations per rebuild
+18 Oct 2026 Duncan Camilleri           Split policies
+18 Oct 2026 Duncan Camilleri           Loose octree
+18 Oct 2026 Duncan Camilleri           RayCast()
+18 Oct 2026 Duncan Camilleri           ForEachOverlappingPair()
+18 Oct 2026 Duncan Camilleri           Saving and mapping files
+18 Oct 2026 Duncan Camilleri           Flat, tiny and crossing items
+18 Oct 2026 Duncan Camilleri           Double and fixed point worlds
+18 Oct 2026 Duncan Camilleri           Quadtrees
+18 Oct 2026 Duncan Camilleri           Statistics and query counters
+18 Oct 2026 Duncan Camilleri           Scenes with latency percentiles and JSON
+18 Oct 2026 Duncan Camilleri           BVH against the octree
+18 Oct 2026 Duncan Camilleri           Query hints
+18 Oct 2026 Duncan Camilleri           Copies of crowded items
+
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <memory.h>
+#include <math.h>
+#include <ctype.h>
+#include <malloc.h>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "datastruct/octree.h"
+#include "datastruct/bvh.h"
+
+using namespace std;
+
+// Size of the world along each axis.
+static const float gWorld = 1024;
+
+// Queries of each kind used to check a tree against a brute force search.
+static const size_t gCheckQueries = 1000;
+
+// Add() is only timed up to this many items as it gets very slow.
+static const size_t gAddMost = 100000;
+
+// Runs of benchBatch() and how much slower than a loop of Query() its
+// fastest QueryBatch() run may be before it counts as slower (timing noise
+// when both take the same path).
+static const int gBatchRuns = 5;
+static const double gBatchSlower = 0.9;
+
+// Most copies of each crowded item a split policy may make and most heap
+// taken per item while filling the tree (see benchCrowd()).
+static const double gCrowdCopies = 8;
+static const size_t gCrowdItemBytes = 256;
+
+// Heap allocations made so far by the whole program and the bytes in use
+// (the most since gPeakBytes was last reset).
+static atomic<size_t> gAllocs(0);
+static atomic<size_t> gLiveBytes(0);
+static atomic<size_t> gPeakBytes(0);
+
+// Counts an allocation of size bytes. All forms of new and delete go through
+// countedNew() and countedDelete() so that every pair matches.
+static void* countedNew(size_t size)
+{
+   gAllocs++;
+   void* p = malloc(size ? size : 1);
+   if (!p) throw bad_alloc();
+
+   size_t live = gLiveBytes += malloc_usable_size(p);
+   size_t peak = gPeakBytes;
+   while (live > peak && !gPeakBytes.compare_exchange_weak(peak, live)) { }
+   return p;
+}
+
+static void countedDelete(void* p) noexcept
+{
+   if (p) gLiveBytes -= malloc_usable_size(p);
+   free(p);
+}
+
+void* operator new(size_t size) { return countedNew(size); }
+void* operator new[](size_t size) { return countedNew(size); }
+void operator delete(void* p) noexcept { countedDelete(p); }
+void operator delete[](void* p) noexcept { countedDelete(p); }
+void operator delete(void* p, size_t) noexcept { countedDelete(p); }
+void operator delete[](void* p, size_t) noexcept { countedDelete(p); }
+
+//
+// HELPERS
+//
+
+// Seconds elapsed since start.
+static double elapsed(chrono::steady_clock::time_point start)
+{
+   chrono::duration<double> d = chrono::steady_clock::now() - start;
+   return d.count();
+}
+
+// Small and fast pseudo random generator (xorshift64).
+static inline uint64_t nextrand(uint64_t& state)
+{
+   state ^= state << 13;
+   state ^= state >> 7;
+   state ^= state << 17;
+   return state;
+}
+
+// A random value from 0 to range - 1.
+static inline unsigned int randrange(uint64_t& state, unsigned int range)
+{
+   return (unsigned int)((nextrand(state) >> 16) % range);
+}
+
+// Items are boxes with whole number corners and sides of 1 to 8.
+static void makeItems(vector<Item>& items, size_t count, uint64_t seed)
+{
+   items.resize(count);
+   for (size_t n = 0; n < count; ++n) {
+      Item& item = items[n];
+      item.mId = (int)n;
+      item.mBounds.min.x = (float)randrange(seed, (unsigned int)gWorld - 8);
+      item.mBounds.min.y = (float)randrange(seed, (unsigned int)gWorld - 8);
+      item.mBounds.min.z = (float)randrange(seed, (unsigned int)gWorld - 8);
+      item.mBounds.max.x = item.mBounds.min.x + 1 + randrange(seed, 8);
+      item.mBounds.max.y = item.mBounds.min.y + 1 + randrange(seed, 8);
+      item.mBounds.max.z = item.mBounds.min.z + 1 + randrange(seed, 8);
+   }
+}
+
+// Random point in the world.
+static Point randomPoint(uint64_t& seed)
+{
+   Point pt;
+   pt.x = (float)randrange(seed, (unsigned int)gWorld * 16) / 16;
+   pt.y = (float)randrange(seed, (unsigned int)gWorld * 16) / 16;
+   pt.z = (float)randrange(seed, (unsigned int)gWorld * 16) / 16;
+   return pt;
+}
+
+// Returns true if pt lies within ab.
+static bool isPointIn(Point const& pt, aabb const& ab)
+{
+   return pt.x >= ab.min.x && pt.x <= ab.max.x &&
+      pt.y >= ab.min.y && pt.y <= ab.max.y &&
+      pt.z >= ab.min.z && pt.z <= ab.max.z;
+}
+
+// Returns true if a and b overlap.
+static bool isOverlap(aabb const& a, aabb const& b)
+{
+   return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+      a.min.y <= b.max.y && b.min.y <= a.max.y &&
+      a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// Square of the distance from pt to ab.
+static float distanceSq(Point const& pt, aabb const& ab)
+{
+   float dx = max(max(ab.min.x - pt.x, pt.x - ab.max.x), 0.0f);
+   float dy = max(max(ab.min.y - pt.y, pt.y - ab.max.y), 0.0f);
+   float dz = max(max(ab.min.z - pt.z, pt.z - ab.max.z), 0.0f);
+   return dx * dx + dy * dy + dz * dz;
+}
+
+// Narrows [tEnter, tExit] to the part of the ray from o along d within ab.
+// Returns false if nothing is left.
+static bool rayIn(Point const& o, Point const& d, aabb const& ab,
+   float& tEnter, float& tExit)
+{
+   const float* pO = &o.x;
+   const float* pD = &d.x;
+   const float* pMin = &ab.min.x;
+   const float* pMax = &ab.max.x;
+   for (int a = 0; a < 3; ++a) {
+      if (pD[a] == 0) {
+         if (pO[a] < pMin[a] || pO[a] > pMax[a]) return false;
+         continue;
+      }
+
+      float t1 = (pMin[a] - pO[a]) / pD[a];
+      float t2 = (pMax[a] - pO[a]) / pD[a];
+      tEnter = max(tEnter, min(t1, t2));
+      tExit = min(tExit, max(t1, t2));
+   }
+
+   return tEnter <= tExit;
+}
+
+// Returns true if found holds the same ids as expect (in any order).
+static bool sameIds(vector<int>& found, int n, vector<int>& expect)
+{
+   sort(found.begin(), found.begin() + n);
+   sort(expect.begin(), expect.end());
+   return (size_t)n == expect.size() &&
+      equal(expect.begin(), expect.end(), found.begin());
+}
+
+// Returns the number of point, box and sphere queries for which the tree and
+// a brute force search of items disagree. Tree is an Octree or a Bvh.
+template <typename Tree>
+static size_t check(Tree const& tree, vector<Item> const& items,
+   uint64_t seed)
+{
+   const int maxResults = 4096;
+   vector<int> found(maxResults);
+   vector<int> expect;
+   size_t wrong = 0;
+   for (size_t q = 0; q < gCheckQueries; ++q) {
+      Point pt = randomPoint(seed);
+
+      // Point.
+      int n = tree.Query(pt, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isPointIn(pt, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Box of up to 32 along each side.
+      aabb box;
+      box.min = pt;
+      box.max.x = pt.x + randrange(seed, 33);
+      box.max.y = pt.y + randrange(seed, 33);
+      box.max.z = pt.z + randrange(seed, 33);
+      n = tree.QueryBox(box, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isOverlap(box, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Sphere of radius up to 16.
+      float radius = (float)randrange(seed, 17);
+      n = tree.QuerySphere(pt, radius, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (distanceSq(pt, items[i].mBounds) <= radius * radius) {
+            expect.push_back(items[i].mId);
+         }
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+   }
+
+   return wrong;
+}
+
+//
+// BENCHMARKS
+//
+
+// Loads count items with Add() (when not too many) and with Build() and
+// checks the trees against a brute force search.
+static bool benchBuild(size_t count)
+{
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+
+   Octree built(world);
+   auto start = chrono::steady_clock::now();
+   built.Build(items.data(), count);
+   double buildSecs = elapsed(start);
+   size_t buildWrong = check(built, items, 0xfedcba9876543210ull);
+   printf("build %9zu items  Build %8.3fs", count, buildSecs);
+
+   size_t addWrong = 0;
+   if (count <= gAddMost) {
+      Octree added(world);
+      start = chrono::steady_clock::now();
+      for (size_t n = 0; n < count; ++n) {
+         added.Add(items[n].mBounds, items[n].mId);
+      }
+      double addSecs = elapsed(start);
+      addWrong = check(added, items, 0xfedcba9876543210ull);
+      printf("  Add %8.3fs (%.1fx, %zu wrong)", addSecs, addSecs / buildSecs,
+         addWrong);
+   }
+
+   printf("  %s\n", buildWrong == 0 && addWrong == 0 ? "ok" : "MISMATCH");
+   if (buildWrong) {
+      printf("   %zu of %zu queries wrong\n", buildWrong, gCheckQueries * 3);
+   }
+
+   return buildWrong == 0 && addWrong == 0;
+}
+
+// Returns true if the tree holds each of items exactly once: querying the
+// whole world must find each item once.
+static bool holdsAll(Octree const& tree, aabb const& world,
+   vector<Item> const& items)
+{
+   vector<int> found(items.size() + 1);
+   int n = tree.QueryBox(world, found.data(), (int)found.size());
+   vector<int> expect(items.size());
+   for (size_t i = 0; i < items.size(); ++i) expect[i] = items[i].mId;
+   return sameIds(found, n, expect);
+}
+
+// Moves one in a hundred of count items a little (at most 1 along each axis)
+// and replaces one in a thousand with new items each frame. The cost of
+// keeping the tree (split as per policy) up to date is compared with
+// building it again and the tree is checked to hold exactly the items left.
+static bool benchUpdate(size_t count, OctreePolicy const& policy,
+   char const* const name)
+{
+   const int frames = 10;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   Octree tree(world, policy);
+   tree.Build(items.data(), count);
+
+   // Where each id is in items.
+   vector<size_t> where(count);
+   for (size_t n = 0; n < count; ++n) where[n] = n;
+
+   uint64_t seed = 0x0f1e2d3c4b5a6978ull;
+   size_t moves = count / 100;
+   size_t swaps = count / 1000;
+   double updateSecs = 0;
+   double buildSecs = 0;
+   bool ok = true;
+   for (int frame = 0; frame < frames; ++frame) {
+      auto start = chrono::steady_clock::now();
+      for (size_t m = 0; m < moves; ++m) {
+         Item& item = items[randrange(seed, (unsigned int)items.size())];
+         float* pMin = &item.mBounds.min.x;
+         float* pMax = &item.mBounds.max.x;
+         for (int a = 0; a < 3; ++a) {
+            float step = (float)randrange(seed, 3) - 1;
+            if (pMin[a] + step < 0 || pMax[a] + step > gWorld) step = 0;
+            pMin[a] += step;
+            pMax[a] += step;
+         }
+         ok = tree.Update(item.mId, item.mBounds) && ok;
+      }
+
+      vector<Item> fresh;
+      makeItems(fresh, swaps, seed + frame);
+      for (size_t m = 0; m < swaps; ++m) {
+         size_t n = randrange(seed, (unsigned int)items.size());
+         ok = tree.Remove(items[n].mId) && ok;
+         ok = !tree.Remove(items[n].mId) && ok;
+
+         // Swap remove and add a new item in its place.
+         items[n] = items.back();
+         where[items[n].mId] = n;
+         items.pop_back();
+         fresh[m].mId = (int)where.size();
+         where.push_back(items.size());
+         items.push_back(fresh[m]);
+         ok = tree.Add(fresh[m].mBounds, fresh[m].mId) && ok;
+      }
+      updateSecs += elapsed(start);
+
+      Octree built(world, policy);
+      start = chrono::steady_clock::now();
+      built.Build(items.data(), items.size());
+      buildSecs += elapsed(start);
+   }
+
+   ok = holdsAll(tree, world, items) && ok;
+   size_t wrong = check(tree, items, 0xfedcba9876543210ull);
+
+   printf("move  %9zu items  %-7s %zu moves %zu swaps  %8.3f ms/frame"
+      "  Build %8.3f ms/frame  %7.1fx  (%zu wrong)  %s\n", count, name,
+      moves, swaps, updateSecs * 1e3 / frames, buildSecs * 1e3 / frames,
+      buildSecs / updateSecs, wrong, ok ? "ok" : "MISMATCH");
+   return ok;
+}
+
+// Casts rays from random points (a quarter of them along the axes) through
+// trees of count items split as per three policies. The first hit and all
+// hits (in order) are checked against a brute force search.
+static bool benchRay(size_t count)
+{
+   const size_t rays = 200;
+   const int maxResults = 4096;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   vector<Point> origins(rays);
+   vector<Point> dirs(rays);
+   uint64_t seed = 0x2468ace013579bdfull;
+   for (size_t r = 0; r < rays; ++r) {
+      origins[r] = randomPoint(seed);
+      Point to = randomPoint(seed);
+      dirs[r].x = to.x - origins[r].x;
+      dirs[r].y = to.y - origins[r].y;
+      dirs[r].z = to.z - origins[r].z;
+      if (r % 4 == 0) {
+         int axis = randrange(seed, 3);
+         float* pD = &dirs[r].x;
+         for (int a = 0; a < 3; ++a) if (a != axis) pD[a] = 0;
+      }
+   }
+
+   // Brute force: every item along each ray, nearest first.
+   vector<vector<pair<float, int> > > expect(rays);
+   auto start = chrono::steady_clock::now();
+   for (size_t r = 0; r < rays; ++r) {
+      float tMin = 0;
+      float tMax = 1e30f;
+      if (!rayIn(origins[r], dirs[r], world, tMin, tMax)) continue;
+      for (size_t i = 0; i < count; ++i) {
+         float tEnter = tMin;
+         float tExit = tMax;
+         if (rayIn(origins[r], dirs[r], items[i].mBounds, tEnter, tExit)) {
+            expect[r].push_back(make_pair(tEnter, items[i].mId));
+         }
+      }
+      sort(expect[r].begin(), expect[r].end());
+   }
+   double bruteSecs = elapsed(start);
+
+   const char* names[] = { "default", "keep 8", "loose 2" };
+   OctreePolicy policies[3];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+   policies[2] = octreeDefaultPolicy;
+   policies[2].mMaxLeafItems = 8;
+   policies[2].mLooseness = 2.0f;
+
+   bool ok = true;
+   vector<int> ids(maxResults);
+   vector<float> ts(maxResults);
+   for (int p = 0; p < 3; ++p) {
+      Octree tree(world, policies[p]);
+      tree.Build(items.data(), count);
+
+      // First hits.
+      size_t wrong = 0;
+      start = chrono::steady_clock::now();
+      for (size_t r = 0; r < rays; ++r) {
+         int n = tree.RayCast(origins[r], dirs[r], 1e30f, ids.data(),
+            ts.data(), 1);
+         if (n != (expect[r].empty() ? 0 : 1)) {
+            wrong++;
+         } else if (n && fabs(ts[0] - expect[r][0].first) > 1e-5f) {
+            wrong++;
+         }
+      }
+      double firstSecs = elapsed(start);
+
+      // All hits.
+      start = chrono::steady_clock::now();
+      for (size_t r = 0; r < rays; ++r) {
+         int n = tree.RayCast(origins[r], dirs[r], 1e30f, ids.data(),
+            ts.data(), maxResults);
+         bool same = (size_t)n == expect[r].size();
+         for (int i = 0; same && i < n; ++i) {
+            same = fabs(ts[i] - expect[r][i].first) <= 1e-5f;
+         }
+
+         vector<int> want;
+         for (size_t i = 0; i < expect[r].size(); ++i) {
+            want.push_back(expect[r][i].second);
+         }
+         if (!same || !sameIds(ids, n, want)) wrong++;
+      }
+      double allSecs = elapsed(start);
+
+      printf("ray   %9zu items  %-7s  first %8.1f us/ray  all %8.1f us/ray"
+         "  brute %10.1f us/ray  %7.1fx  %s\n", count, names[p],
+         firstSecs * 1e6 / rays, allSecs * 1e6 / rays,
+         bruteSecs * 1e6 / rays, bruteSecs / firstSecs,
+         wrong == 0 ? "ok" : "MISMATCH");
+      ok = wrong == 0 && ok;
+   }
+
+   return ok;
+}
+
+// ForEachOverlappingPair() callbacks: counting pairs and collecting them
+// (ordered within each pair) in a vector guarded by a mutex.
+struct PairList
+{
+   mutex mLock;
+   vector<pair<int, int> > mPairs;
+};
+
+static void countPair(int, int, void* pCtx)
+{
+   (*(atomic<size_t>*)pCtx)++;
+}
+
+static void listPair(int idA, int idB, void* pCtx)
+{
+   PairList& list = *(PairList*)pCtx;
+   lock_guard<mutex> lock(list.mLock);
+   list.mPairs.push_back(make_pair(min(idA, idB), max(idA, idB)));
+}
+
+// Finds the overlapping pairs of count items (spread evenly, and again with
+// every tenth item up to 64 along each side) with ForEachOverlappingPair()
+// and with a QueryBox() of each item for trees split as per three policies.
+// The pairs found must be the same.
+static bool benchPairs(size_t count)
+{
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   const char* kinds[] = { "even", "mixed" };
+   const char* names[] = { "default", "keep 8", "loose 2" };
+   OctreePolicy policies[3];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+   policies[2] = octreeDefaultPolicy;
+   policies[2].mMaxLeafItems = 8;
+   policies[2].mLooseness = 2.0f;
+
+   bool ok = true;
+   vector<int> found(count);
+   for (int kind = 0; kind < 2; ++kind) {
+      vector<Item> items;
+      makeItems(items, count, 0x0123456789abcdefull + count);
+      uint64_t seed = 0x7777bbbb1111eeeeull;
+      for (size_t n = 0; kind == 1 && n < count; n += 10) {
+         aabb& b = items[n].mBounds;
+         b.max.x = min(gWorld, b.min.x + 1 + randrange(seed, 64));
+         b.max.y = min(gWorld, b.min.y + 1 + randrange(seed, 64));
+         b.max.z = min(gWorld, b.min.z + 1 + randrange(seed, 64));
+      }
+
+      for (int p = 0; p < 3; ++p) {
+         Octree tree(world, policies[p]);
+         tree.Build(items.data(), count);
+
+         atomic<size_t> counted(0);
+         auto start = chrono::steady_clock::now();
+         size_t pairs = tree.ForEachOverlappingPair(countPair, &counted);
+         double pairSecs = elapsed(start);
+
+         // Each pair is found from both of its items.
+         vector<pair<int, int> > expect;
+         start = chrono::steady_clock::now();
+         for (size_t i = 0; i < count; ++i) {
+            int n = tree.QueryBox(items[i].mBounds, found.data(),
+               (int)found.size());
+            for (int f = 0; f < n; ++f) {
+               if (found[f] > items[i].mId) {
+                  expect.push_back(make_pair(items[i].mId, found[f]));
+               }
+            }
+         }
+         double querySecs = elapsed(start);
+
+         PairList list;
+         tree.ForEachOverlappingPair(listPair, &list);
+         sort(list.mPairs.begin(), list.mPairs.end());
+         sort(expect.begin(), expect.end());
+         bool same = pairs == counted && list.mPairs == expect;
+
+         printf("pairs %9zu items  %-7s %-7s %8zu pairs  ForEach %8.3f ms"
+            "  QueryBox %8.3f ms  %7.1fx  %s\n", count, kinds[kind],
+            names[p], pairs, pairSecs * 1e3, querySecs * 1e3,
+            querySecs / pairSecs, same ? "ok" : "MISMATCH");
+         ok = same && ok;
+      }
+   }
+
+   return ok;
+}
+
+// Fills trees of count items crowded together with the default policy and
+// with leaves of 8 items, by Add() and by Build(), and fails when items are
+// held more than gCrowdCopies times on average or the heap taken meanwhile
+// comes to more than gCrowdItemBytes per item. The items lie within a
+// space of 16 along each axis and are either of mixed sizes up to 9, all
+// the same box or slivers running across the world.
+static bool benchCrowd(size_t count)
+{
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   const char* kinds[] = { "crowded", "stacked", "slivers" };
+   const char* names[] = { "default", "leaf 8" };
+   OctreePolicy policies[2];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+
+   bool ok = true;
+   for (int kind = 0; kind < 3; ++kind) {
+      vector<Item> items;
+      makeItems(items, count, 0x0123456789abcdefull + count);
+      uint64_t seed = 0x2468ace013579bdfull + kind;
+      for (size_t n = 0; n < count; ++n) {
+         aabb& b = items[n].mBounds;
+         b.min.x = 300 + (float)randrange(seed, 8);
+         b.min.y = 300 + (float)randrange(seed, 8);
+         b.min.z = 300 + (float)randrange(seed, 8);
+         b.max.x = b.min.x + 1 + randrange(seed, 8);
+         b.max.y = b.min.y + 1 + randrange(seed, 8);
+         b.max.z = b.min.z + 1 + randrange(seed, 8);
+         if (kind == 1) {
+            b.min.x = b.min.y = b.min.z = 300;
+            b.max.x = b.max.y = b.max.z = 309;
+         } else if (kind == 2) {
+            b.min.x = 0;
+            b.max.x = gWorld;
+         }
+      }
+
+      for (int run = 0; run < 4; ++run) {
+         int p = run / 2;
+         bool build = run % 2 != 0;
+         size_t before = gLiveBytes;
+         gPeakBytes = before;
+         Octree tree(world, policies[p]);
+         auto start = chrono::steady_clock::now();
+         if (build) {
+            tree.Build(items.data(), count);
+         } else {
+            for (size_t n = 0; n < count; ++n) {
+               tree.Add(items[n].mBounds, items[n].mId);
+            }
+         }
+         double secs = elapsed(start);
+         size_t peak = gPeakBytes - before;
+
+         OctreeStats stats;
+         tree.GetStats(stats);
+         bool held = holdsAll(tree, world, items);
+         bool right = stats.mDuplication <= gCrowdCopies &&
+            peak <= gCrowdItemBytes * count;
+         printf("crowd %9zu items  %-7s  %-7s  %-5s %8.3fs  %9.1f MB"
+            "  %5.2f copies  depth %2u  %s\n", count, kinds[kind],
+            names[p], build ? "Build" : "Add", secs, peak / 1048576.0,
+            stats.mDuplication, stats.mDepth,
+            !held ? "MISMATCH" : right ? "ok" : "TOO MANY");
+         ok = held && right && ok;
+      }
+   }
+
+   return ok;
+}
+
+// Adds count items of three kinds to trees split as per four policies and
+// reports the time taken and the most memory in use. The kinds of items are
+// spread evenly, crowded into a space of 16 along each axis and spread
+// evenly with every tenth item up to 256 along each side.
+static bool benchPolicy(size_t count)
+{
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   const char* kinds[] = { "even", "crowded", "mixed" };
+   const char* names[] = { "default", "leaf 8", "keep 8", "loose 2" };
+   OctreePolicy policies[4];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[2] = policies[1];
+   policies[2].mKeepStraddlers = true;
+   policies[3] = policies[1];
+   policies[3].mLooseness = 2.0f;
+
+   bool ok = true;
+   for (int kind = 0; kind < 3; ++kind) {
+      vector<Item> items;
+      makeItems(items, count, 0x0123456789abcdefull + count);
+      uint64_t seed = 0x5555aaaa3333ccccull + kind;
+      for (size_t n = 0; n < count; ++n) {
+         aabb& b = items[n].mBounds;
+         if (kind == 1) {
+            // Within 504 to 520.
+            b.min.x = 504 + (float)randrange(seed, 8);
+            b.min.y = 504 + (float)randrange(seed, 8);
+            b.min.z = 504 + (float)randrange(seed, 8);
+            b.max.x = b.min.x + 1 + randrange(seed, 8);
+            b.max.y = b.min.y + 1 + randrange(seed, 8);
+            b.max.z = b.min.z + 1 + randrange(seed, 8);
+         } else if (kind == 2 && n % 10 == 0) {
+            b.max.x = min(gWorld, b.min.x + 1 + randrange(seed, 256));
+            b.max.y = min(gWorld, b.min.y + 1 + randrange(seed, 256));
+            b.max.z = min(gWorld, b.min.z + 1 + randrange(seed, 256));
+         }
+      }
+
+      for (int p = 0; p < 4; ++p) {
+         size_t before = gLiveBytes;
+         gPeakBytes = before;
+         Octree tree(world, policies[p]);
+         auto start = chrono::steady_clock::now();
+         for (size_t n = 0; n < count; ++n) {
+            tree.Add(items[n].mBounds, items[n].mId);
+         }
+         double secs = elapsed(start);
+         size_t peak = gPeakBytes - before;
+
+         bool held = holdsAll(tree, world, items);
+         size_t wrong = check(tree, items, 0xfedcba9876543210ull);
+         printf("split %9zu items  %-7s %-7s  Add %8.3fs  %9.1f MB"
+            "  (%zu wrong)  %s\n", count, kinds[kind], names[p], secs,
+            peak / 1048576.0, wrong, held ? "ok" : "MISMATCH");
+         ok = held && ok;
+      }
+   }
+
+   return ok;
+}
+
+// Adds count items of awkward shapes to trees of each policy and builds one
+// with Build(), all in a world reaching into negative coordinates: flat
+// items, points, items smaller than 1 and long thin bars crossing each other
+// (overlapping without either holding a corner of the other). Corners are
+// at sixteenths so few line up with the nodes.
+static bool benchShapes(size_t count)
+{
+   aabb world;
+   world.min.x = world.min.y = world.min.z = -gWorld;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items(count);
+   uint64_t seed = 0x0f1e2d3c4b5a6978ull;
+   unsigned int range = (unsigned int)gWorld * 32 - 64 * 16;
+   for (size_t n = 0; n < count; ++n) {
+      aabb& b = items[n].mBounds;
+      items[n].mId = (int)n;
+      b.min.x = (float)randrange(seed, range) / 16 - gWorld;
+      b.min.y = (float)randrange(seed, range) / 16 - gWorld;
+      b.min.z = (float)randrange(seed, range) / 16 - gWorld;
+      float side[3] = { 0 };
+      switch (n % 4) {
+      case 0:                          // flat
+         side[0] = side[1] = 1 + (float)randrange(seed, 64) / 16;
+         break;
+      case 1:                          // point
+         break;
+      case 2:                          // tiny
+         side[0] = side[1] = side[2] = (float)randrange(seed, 16) / 16;
+         break;
+      case 3:                          // thin bar along one axis
+         side[0] = side[1] = side[2] = 0.25f;
+         side[n % 3] = 64;
+         break;
+      }
+
+      b.max.x = b.min.x + side[n % 3];
+      b.max.y = b.min.y + side[(n + 1) % 3];
+      b.max.z = b.min.z + side[(n + 2) % 3];
+   }
+
+   const char* names[] = { "default", "keep 8", "loose 2" };
+   OctreePolicy policies[3];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+   policies[2] = octreeDefaultPolicy;
+   policies[2].mMaxLeafItems = 8;
+   policies[2].mLooseness = 2.0f;
+
+   bool ok = true;
+   for (int p = 0; p < 4; ++p) {
+      Octree tree(world, policies[p < 3 ? p : 0]);
+      auto start = chrono::steady_clock::now();
+      if (p < 3) {
+         for (size_t n = 0; n < count; ++n) {
+            tree.Add(items[n].mBounds, items[n].mId);
+         }
+      } else {
+         tree.Build(items.data(), count);
+      }
+      double secs = elapsed(start);
+
+      bool held = holdsAll(tree, world, items);
+      size_t wrong = check(tree, items, 0xfedcba9876543210ull);
+      printf("shape %9zu items  %-7s  %-5s %8.3fs  (%zu wrong)  %s\n",
+         count, p < 3 ? names[p] : "default", p < 3 ? "Add" : "Build",
+         secs, wrong, held && wrong == 0 ? "ok" : "MISMATCH");
+      ok = held && wrong == 0 && ok;
+   }
+
+   return ok;
+}
+
+// Rebuilds a tree of count items once per frame, with Build() and by adding
+// a tenth of them with Add() after clearing the tree, and counts the heap
+// allocations made after the first frame (none are expected when a single
+// thread does all the work).
+static bool benchRebuild(size_t count)
+{
+   const int frames = 10;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   size_t added = count / 10;
+
+   Octree tree(world);
+   double buildSecs = 0;
+   double addSecs = 0;
+   size_t allocs = 0;
+   for (int frame = 0; frame < frames; ++frame) {
+      size_t before = gAllocs;
+      auto start = chrono::steady_clock::now();
+      tree.Build(items.data(), count);
+      buildSecs += elapsed(start);
+
+      start = chrono::steady_clock::now();
+      tree.Build(nullptr, 0);
+      for (size_t n = 0; n < added; ++n) {
+         tree.Add(items[n].mBounds, items[n].mId);
+      }
+      addSecs += elapsed(start);
+      if (frame > 0) allocs += gAllocs - before;
+   }
+
+   bool ok = allocs == 0 || thread::hardware_concurrency() > 1;
+   printf("frame %9zu items  Build %8.3f ms/frame  Add %zu %8.3f ms/frame"
+      "  %zu allocations  %s\n", count, buildSecs * 1e3 / frames, added,
+      addSecs * 1e3 / frames, allocs, ok ? "ok" : "MISMATCH");
+   return ok;
+}
+
+// Times QueryKNN against a brute force search of count items and checks that
+// both find the same distances.
+static bool benchKnn(size_t count, int k)
+{
+   const size_t queries = 200;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   Octree tree(world);
+   tree.Build(items.data(), count);
+
+   vector<Point> points(queries);
+   uint64_t seed = 0x13579bdf2468ace0ull;
+   for (size_t q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+
+   // Tree.
+   vector<int> ids(k);
+   vector<float> found(queries * k);
+   vector<int> foundCount(queries);
+   auto start = chrono::steady_clock::now();
+   for (size_t q = 0; q < queries; ++q) {
+      foundCount[q] = tree.QueryKNN(points[q], k, ids.data(), &found[q * k]);
+   }
+   double treeSecs = elapsed(start);
+
+   // Brute force: keep the k smallest squared distances.
+   vector<float> expect(queries * k);
+   vector<float> dist(count);
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < queries; ++q) {
+      for (size_t i = 0; i < count; ++i) {
+         dist[i] = distanceSq(points[q], items[i].mBounds);
+      }
+      partial_sort(dist.begin(), dist.begin() + k, dist.end());
+      for (int n = 0; n < k; ++n) expect[q * k + n] = sqrt(dist[n]);
+   }
+   double bruteSecs = elapsed(start);
+
+   size_t wrong = 0;
+   for (size_t q = 0; q < queries; ++q) {
+      if (foundCount[q] != k) {
+         wrong++;
+         continue;
+      }
+
+      for (int n = 0; n < k; ++n) {
+         if (fabs(found[q * k + n] - expect[q * k + n]) > 1e-3f) {
+            wrong++;
+            break;
+         }
+      }
+   }
+
+   printf("knn   %9zu items  k %3d  %10.1f us/query  brute %10.1f us/query"
+      "  %7.1fx  %s\n", count, k, treeSecs * 1e6 / queries,
+      bruteSecs * 1e6 / queries, bruteSecs / treeSecs,
+      wrong == 0 ? "ok" : "MISMATCH");
+   return wrong == 0;
+}
+
+// Times a loop of Query against QueryBatch for points on a tree of count
+// items and checks that both give the same results. QueryBatch must not be
+// slower: small trees are queried point by point and big ones gain from the
+// sorting. Each is timed gBatchRuns times, taking turns, and the fastest
+// run kept so that noise does not count against either.
+static bool benchBatch(size_t count)
+{
+   const int queries = 1000000;
+   const int maxResults = 64;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   Octree tree(world);
+   tree.Build(items.data(), count);
+
+   vector<Point> points(queries);
+   uint64_t seed = 0x2468ace013579bdfull;
+   for (int q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+
+   vector<int> single((size_t)queries * maxResults);
+   vector<int> singleCount(queries);
+   vector<int> batch((size_t)queries * maxResults);
+   vector<int> first(queries);
+   vector<int> found(queries);
+   double singleSecs = 0;
+   double batchSecs = 0;
+   for (int run = 0; run < gBatchRuns; ++run) {
+      // One at a time.
+      auto start = chrono::steady_clock::now();
+      for (int q = 0; q < queries; ++q) {
+         singleCount[q] = tree.Query(points[q],
+            &single[(size_t)q * maxResults], maxResults);
+      }
+      double secs = elapsed(start);
+      if (run == 0 || secs < singleSecs) singleSecs = secs;
+
+      // Batch.
+      start = chrono::steady_clock::now();
+      tree.QueryBatch(points.data(), queries, batch.data(),
+         (int)batch.size(), first.data(), found.data());
+      secs = elapsed(start);
+      if (run == 0 || secs < batchSecs) batchSecs = secs;
+   }
+
+   size_t wrong = 0;
+   for (int q = 0; q < queries; ++q) {
+      vector<int>::iterator a = single.begin() + (size_t)q * maxResults;
+      vector<int>::iterator b = batch.begin() + first[q];
+      if (singleCount[q] != found[q] || !equal(a, a + found[q], b)) wrong++;
+   }
+
+   bool slower = singleSecs / batchSecs < gBatchSlower;
+   printf("batch %9zu items  Query %8.3f Mq/s  QueryBatch %8.3f Mq/s"
+      "  %7.2fx  %s\n", count, queries / singleSecs / 1e6,
+      queries / batchSecs / 1e6, singleSecs / batchSecs,
+      wrong ? "MISMATCH" : (slower ? "SLOWER" : "ok"));
+   return wrong == 0 && !slower;
+}
+
+// ParallelQuery (on the tree as built and frozen) must give exactly the same
+// output as QueryBatch, also when the results do not all fit.
+static bool benchParallel(size_t count)
+{
+   const int queries = 1000000;
+   const int maxResults = 64;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   Octree tree(world);
+   tree.Build(items.data(), count);
+
+   vector<Point> points(queries);
+   uint64_t seed = 0x2468ace013579bdfull;
+   for (int q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+
+   size_t size = (size_t)queries * maxResults;
+   vector<int> batch(size), batchFirst(queries), batchFound(queries);
+   vector<int> par(size), parFirst(queries), parFound(queries);
+   double secs[3] = { 0 };
+   bool same = true;
+   for (int pass = 0; pass < 3; ++pass) {
+      // Pass 0 is QueryBatch, 1 ParallelQuery and 2 ParallelQuery frozen.
+      if (pass == 2) tree.Freeze();
+      bool frozen = tree.isFrozen();
+      if (frozen && (tree.Add(items[0].mBounds, -1) || tree.Reset())) {
+         same = false;
+      }
+
+      auto start = chrono::steady_clock::now();
+      if (pass == 0) {
+         tree.QueryBatch(points.data(), queries, batch.data(), (int)size,
+            batchFirst.data(), batchFound.data());
+      } else {
+         tree.ParallelQuery(points.data(), queries, par.data(), (int)size,
+            parFirst.data(), parFound.data());
+      }
+      secs[pass] = elapsed(start);
+
+      // Frozen trees keep items in the same order.
+      if (pass > 0) {
+         same = same && par == batch && parFirst == batchFirst &&
+            parFound == batchFound;
+      }
+   }
+
+   // Truncated output.
+   int room = 1000;
+   int total = tree.QueryBatch(points.data(), queries, batch.data(), room,
+      batchFirst.data(), batchFound.data());
+   int parTotal = tree.ParallelQuery(points.data(), queries, par.data(),
+      room, parFirst.data(), parFound.data());
+   same = same && total == parTotal && parFirst == batchFirst &&
+      parFound == batchFound && equal(par.begin(), par.begin() + room,
+      batch.begin());
+
+   printf("par   %9zu items  QueryBatch %8.3f Mq/s  ParallelQuery %8.3f Mq/s"
+      "  frozen %8.3f Mq/s  %u threads  %s\n", count,
+      queries / secs[0] / 1e6, queries / secs[1] / 1e6,
+      queries / secs[2] / 1e6, thread::hardware_concurrency(),
+      same ? "ok" : "MISMATCH");
+   return same;
+}
+
+// Saves a built tree and maps the file into another. The mapped tree must
+// answer queries exactly as the tree saved (in the same order) and as a
+// brute force search. Thaw() must make it changeable again.
+static bool benchFile(size_t count)
+{
+   const int queries = 100000;
+   const int maxResults = 64;
+   const char* const path = "/tmp/octreebench.oct";
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   Octree tree(world);
+   auto start = chrono::steady_clock::now();
+   tree.Build(items.data(), count);
+   double buildSecs = elapsed(start);
+
+   start = chrono::steady_clock::now();
+   bool ok = tree.Save(path);
+   double saveSecs = elapsed(start);
+
+   aabb none;
+   memset(&none, 0, sizeof(none));
+   Octree mapped(none);
+   start = chrono::steady_clock::now();
+   ok = mapped.Map(path) && ok;
+   double mapSecs = elapsed(start);
+   ok = ok && mapped.isFrozen() && !mapped.Add(items[0].mBounds, -1);
+
+   vector<Point> points(queries);
+   uint64_t seed = 0x2468ace013579bdfull;
+   for (int q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+
+   size_t size = (size_t)queries * maxResults;
+   vector<int> a(size), aFirst(queries), aFound(queries);
+   vector<int> b(size), bFirst(queries), bFound(queries);
+   tree.Freeze();
+   tree.QueryBatch(points.data(), queries, a.data(), (int)size,
+      aFirst.data(), aFound.data());
+   start = chrono::steady_clock::now();
+   mapped.QueryBatch(points.data(), queries, b.data(), (int)size,
+      bFirst.data(), bFound.data());
+   double querySecs = elapsed(start);
+   ok = ok && a == b && aFirst == bFirst && aFound == bFound;
+   ok = ok && check(mapped, items, 0xfedcba9876543210ull) == 0;
+
+   // Mapping over a frozen tree fails, garbage and files of other types are
+   // refused and a thawed tree can be changed.
+   aabbT<double> dworld = { { 0, 0, 0 }, { gWorld, gWorld, gWorld } };
+   OctreeT<double, int> other(dworld);
+   ok = ok && !tree.Map(path) && !mapped.Map("/dev/null") &&
+      !other.Map(path);
+   mapped.Thaw();
+   ok = ok && mapped.Remove(items[0].mId) &&
+      mapped.Add(items[0].mBounds, items[0].mId) &&
+      check(mapped, items, 0xfedcba9876543210ull) == 0;
+   remove(path);
+
+   printf("file  %9zu items  Build %8.3fs  Save %8.3fs  Map %8.6fs"
+      "  mapped QueryBatch %8.3f Mq/s  %s\n", count, buildSecs, saveSecs,
+      mapSecs, queries / querySecs / 1e6, ok ? "ok" : "MISMATCH");
+   return ok;
+}
+
+// Builds a tree with Scalar coordinates of items moved base from the origin
+// along each axis and scaled by unit. Point, box and ray queries at
+// sixteenths are moved likewise and checked against a brute force search of
+// the items where they were. Returns the number of queries answered wrongly
+// along with the seconds taken to build the tree and to run count point
+// queries.
+template <typename Scalar>
+static size_t checkFar(vector<Item> const& items, double base, double unit,
+   double& buildSecs, double& querySecs)
+{
+   typedef typename OctreeT<Scalar, int>::Real Real;
+   auto far = [&](float v) { return (Scalar)((base + v) * unit); };
+   aabbT<Scalar> world;
+   world.min.x = world.min.y = world.min.z = far(0);
+   world.max.x = world.max.y = world.max.z = far(gWorld);
+
+   vector<ItemT<Scalar, int> > farItems(items.size());
+   for (size_t n = 0; n < items.size(); ++n) {
+      aabb const& b = items[n].mBounds;
+      aabbT<Scalar>& fb = farItems[n].mBounds;
+      farItems[n].mId = items[n].mId;
+      fb.min.x = far(b.min.x);
+      fb.min.y = far(b.min.y);
+      fb.min.z = far(b.min.z);
+      fb.max.x = far(b.max.x);
+      fb.max.y = far(b.max.y);
+      fb.max.z = far(b.max.z);
+   }
+
+   OctreeT<Scalar, int> tree(world);
+   auto start = chrono::steady_clock::now();
+   tree.Build(farItems.data(), farItems.size());
+   buildSecs = elapsed(start);
+
+   const int maxResults = 4096;
+   vector<int> found(maxResults);
+   vector<int> expect;
+   size_t wrong = 0;
+   uint64_t seed = 0xfedcba9876543210ull;
+   for (size_t q = 0; q < gCheckQueries; ++q) {
+      Point pt = randomPoint(seed);
+      PointT<Scalar> farPt = { far(pt.x), far(pt.y), far(pt.z) };
+
+      // Point.
+      int n = tree.Query(farPt, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isPointIn(pt, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Box of up to 8 along each side.
+      aabb box;
+      box.min = pt;
+      box.max.x = pt.x + (float)randrange(seed, 129) / 16;
+      box.max.y = pt.y + (float)randrange(seed, 129) / 16;
+      box.max.z = pt.z + (float)randrange(seed, 129) / 16;
+      aabbT<Scalar> farBox = { farPt,
+         { far(box.max.x), far(box.max.y), far(box.max.z) } };
+      n = tree.QueryBox(farBox, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isOverlap(box, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // First hit of a ray up to 8 times dir (whole numbers of up to 16).
+      Point dir;
+      dir.x = (float)randrange(seed, 33) - 16;
+      dir.y = (float)randrange(seed, 33) - 16;
+      dir.z = (float)randrange(seed, 33) - 16;
+      PointT<Scalar> farDir = { (Scalar)(dir.x * unit),
+         (Scalar)(dir.y * unit), (Scalar)(dir.z * unit) };
+      int id;
+      Real t;
+      int hits = tree.RayCast(farPt, farDir, 8, &id, &t, 1);
+      float first = 9;
+      for (size_t i = 0; i < items.size(); ++i) {
+         float tEnter = 0;
+         float tExit = 8;
+         if (rayIn(pt, dir, items[i].mBounds, tEnter, tExit)) {
+            first = min(first, tEnter);
+         }
+      }
+      if (hits != (first <= 8 ? 1 : 0)) {
+         wrong++;
+      } else if (hits) {
+         float tEnter = 0;
+         float tExit = 8;
+         if (!rayIn(pt, dir, items[id].mBounds, tEnter, tExit) ||
+            fabsf(tEnter - first) > 1e-4f) wrong++;
+      }
+   }
+
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < items.size(); ++q) {
+      Point pt = randomPoint(seed);
+      PointT<Scalar> farPt = { far(pt.x), far(pt.y), far(pt.z) };
+      tree.Query(farPt, found.data(), maxResults);
+   }
+   querySecs = elapsed(start);
+   return wrong;
+}
+
+// Builds trees of count items 2^24 from the origin (about 16000 km in
+// metres) with float, double and fixed point (sixteenths in an int)
+// coordinates. Floats there are 2 apart so the float tree cannot tell
+// neighbouring items apart and is only shown for comparison: the others must
+// answer every query as the items would near the origin.
+static bool benchFar(size_t count)
+{
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+
+   const double base = 16777216;
+   const char* names[] = { "float", "double", "int/16" };
+   double buildSecs[3];
+   double querySecs[3];
+   size_t wrong[3];
+   wrong[0] = checkFar<float>(items, base, 1, buildSecs[0], querySecs[0]);
+   wrong[1] = checkFar<double>(items, base, 1, buildSecs[1], querySecs[1]);
+   wrong[2] = checkFar<int>(items, base, 16, buildSecs[2], querySecs[2]);
+
+   bool ok = wrong[1] == 0 && wrong[2] == 0;
+   for (int n = 0; n < 3; ++n) {
+      printf("far   %9zu items  %-7s Build %8.3fs  Query %8.3f Mq/s"
+         "  (%zu wrong)  %s\n", count, names[n], buildSecs[n],
+         count / querySecs[n] / 1e6, wrong[n],
+         n == 0 ? "too coarse" : (wrong[n] == 0 ? "ok" : "MISMATCH"));
+   }
+
+   return ok;
+}
+
+// Quadtree versions of the brute force tests above.
+static bool isPointIn(Quadtree::Point const& pt, Quadtree::aabb const& ab)
+{
+   return pt.x >= ab.min.x && pt.x <= ab.max.x &&
+      pt.y >= ab.min.y && pt.y <= ab.max.y;
+}
+
+static bool isOverlap(Quadtree::aabb const& a, Quadtree::aabb const& b)
+{
+   return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+      a.min.y <= b.max.y && b.min.y <= a.max.y;
+}
+
+static float distanceSq(Quadtree::Point const& pt, Quadtree::aabb const& ab)
+{
+   float dx = max(max(ab.min.x - pt.x, pt.x - ab.max.x), 0.0f);
+   float dy = max(max(ab.min.y - pt.y, pt.y - ab.max.y), 0.0f);
+   return dx * dx + dy * dy;
+}
+
+static bool rayIn(Quadtree::Point const& o, Quadtree::Point const& d,
+   Quadtree::aabb const& ab, float& tEnter, float& tExit)
+{
+   Point o3 = { o.x, o.y, 0 };
+   Point d3 = { d.x, d.y, 0 };
+   aabb ab3 = { { ab.min.x, ab.min.y, 0 }, { ab.max.x, ab.max.y, 0 } };
+   return rayIn(o3, d3, ab3, tEnter, tExit);
+}
+
+// Returns the number of point, box, circle, nearest item and first hit
+// queries for which a quadtree and a brute force search of items disagree.
+static size_t checkQuad(Quadtree const& tree,
+   vector<Quadtree::Item> const& items, uint64_t seed)
+{
+   const int maxResults = 4096;
+   const int k = 4;
+   vector<int> found(maxResults);
+   vector<int> expect;
+   vector<float> dist(items.size());
+   size_t wrong = 0;
+   for (size_t q = 0; q < gCheckQueries; ++q) {
+      Point pt3 = randomPoint(seed);
+      Quadtree::Point pt = { pt3.x, pt3.y };
+
+      // Point.
+      int n = tree.Query(pt, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isPointIn(pt, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Box of up to 32 along each side.
+      Quadtree::aabb box;
+      box.min = pt;
+      box.max.x = pt.x + randrange(seed, 33);
+      box.max.y = pt.y + randrange(seed, 33);
+      n = tree.QueryBox(box, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (isOverlap(box, items[i].mBounds)) expect.push_back(items[i].mId);
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Circle of radius up to 16.
+      float radius = (float)randrange(seed, 17);
+      n = tree.QuerySphere(pt, radius, found.data(), maxResults);
+      expect.clear();
+      for (size_t i = 0; i < items.size(); ++i) {
+         if (distanceSq(pt, items[i].mBounds) <= radius * radius) {
+            expect.push_back(items[i].mId);
+         }
+      }
+      if (!sameIds(found, n, expect)) wrong++;
+
+      // Nearest k.
+      float nearest[k];
+      n = tree.QueryKNN(pt, k, found.data(), nearest);
+      for (size_t i = 0; i < items.size(); ++i) {
+         dist[i] = distanceSq(pt, items[i].mBounds);
+      }
+      partial_sort(dist.begin(), dist.begin() + k, dist.end());
+      bool same = n == k;
+      for (int j = 0; j < n && same; ++j) {
+         same = fabs(nearest[j] - sqrt(dist[j])) <= 1e-3f;
+      }
+      if (!same) wrong++;
+
+      // First hit of a ray up to 8 times dir (whole numbers of up to 16).
+      Quadtree::Point dir;
+      dir.x = (float)randrange(seed, 33) - 16;
+      dir.y = (float)randrange(seed, 33) - 16;
+      int id;
+      float t;
+      int hits = tree.RayCast(pt, dir, 8, &id, &t, 1);
+      float first = 9;
+      for (size_t i = 0; i < items.size(); ++i) {
+         float tEnter = 0;
+         float tExit = 8;
+         if (rayIn(pt, dir, items[i].mBounds, tEnter, tExit)) {
+            first = min(first, tEnter);
+         }
+      }
+      if (hits != (first <= 8 ? 1 : 0)) {
+         wrong++;
+      } else if (hits && fabsf(t - first) > 1e-4f) {
+         wrong++;
+      }
+   }
+
+   return wrong;
+}
+
+// Fills quadtrees of count items (the squares under the usual boxes) by
+// Build() and by Add() with straddling items kept and with loose nodes, and
+// checks each against a brute force search. The same items lying flat in an
+// octree are built for comparison: the quadtree has half as many children
+// per node to walk through and holds no z at all.
+static bool benchQuad(size_t count)
+{
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   vector<Quadtree::Item> squares(count);
+   vector<Item> flat(items);
+   for (size_t n = 0; n < count; ++n) {
+      aabb const& b = items[n].mBounds;
+      squares[n].mId = items[n].mId;
+      squares[n].mBounds.min.x = b.min.x;
+      squares[n].mBounds.min.y = b.min.y;
+      squares[n].mBounds.max.x = b.max.x;
+      squares[n].mBounds.max.y = b.max.y;
+      flat[n].mBounds.min.z = flat[n].mBounds.max.z = 0;
+   }
+
+   vector<Point> points(count);
+   vector<Quadtree::Point> points2(count);
+   uint64_t seed = 0x13579bdf2468ace0ull;
+   for (size_t q = 0; q < count; ++q) {
+      points[q] = randomPoint(seed);
+      points[q].z = 0;
+      points2[q].x = points[q].x;
+      points2[q].y = points[q].y;
+   }
+
+   Quadtree::aabb world = { { 0, 0 }, { gWorld, gWorld } };
+   const char* names[] = { "default", "keep 8", "loose 2" };
+   OctreePolicy policies[3];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+   policies[2] = octreeDefaultPolicy;
+   policies[2].mMaxLeafItems = 8;
+   policies[2].mLooseness = 2.0f;
+
+   const int maxResults = 4096;
+   vector<int> found(maxResults);
+   bool ok = true;
+   for (int p = 0; p < 3; ++p) {
+      size_t before = gLiveBytes;
+      gPeakBytes = before;
+      Quadtree tree(world, policies[p]);
+      auto start = chrono::steady_clock::now();
+      if (p == 0) {
+         tree.Build(squares.data(), count);
+      } else {
+         for (size_t n = 0; n < count; ++n) {
+            tree.Add(squares[n].mBounds, squares[n].mId);
+         }
+      }
+      double secs = elapsed(start);
+      size_t peak = gPeakBytes - before;
+
+      start = chrono::steady_clock::now();
+      for (size_t q = 0; q < count; ++q) {
+         tree.Query(points2[q], found.data(), maxResults);
+      }
+      double querySecs = elapsed(start);
+
+      size_t wrong = checkQuad(tree, squares, 0xfedcba9876543210ull);
+      printf("quad  %9zu items  %-7s  %-5s %8.3fs  %7.1f MB  Query %8.3f Mq/s"
+         "  (%zu wrong)  %s\n", count, names[p], p == 0 ? "Build" : "Add",
+         secs, peak / 1048576.0, count / querySecs / 1e6, wrong,
+         wrong == 0 ? "ok" : "MISMATCH");
+      ok = wrong == 0 && ok;
+   }
+
+   // The flat octree.
+   aabb world3 = { { 0, 0, 0 }, { gWorld, gWorld, gWorld } };
+   size_t before = gLiveBytes;
+   gPeakBytes = before;
+   Octree tree(world3);
+   auto start = chrono::steady_clock::now();
+   tree.Build(flat.data(), count);
+   double secs = elapsed(start);
+   size_t peak = gPeakBytes - before;
+
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < count; ++q) {
+      tree.Query(points[q], found.data(), maxResults);
+   }
+   double querySecs = elapsed(start);
+   printf("quad  %9zu items  octree   %-5s %8.3fs  %7.1f MB  Query %8.3f Mq/s"
+      "  flat items\n", count, "Build", secs, peak / 1048576.0,
+      count / querySecs / 1e6);
+   return ok;
+}
+
+// Fills trees of count items (every tenth up to 64 along each side) split as
+// per three policies and checks GetStats(): every item is counted once, the
+// histograms add up, items held once are not copied and the memory held
+// matches the heap the tree took. When the library counts queries, the work
+// of a point query is shown as well.
+static bool benchStats(size_t count)
+{
+   const size_t queries = 10000;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeItems(items, count, 0x0123456789abcdefull + count);
+   uint64_t seed = 0x5555aaaa3333ccccull;
+   for (size_t n = 0; n < count; n += 10) {
+      aabb& b = items[n].mBounds;
+      b.max.x = min(gWorld, b.min.x + 1 + randrange(seed, 64));
+      b.max.y = min(gWorld, b.min.y + 1 + randrange(seed, 64));
+      b.max.z = min(gWorld, b.min.z + 1 + randrange(seed, 64));
+   }
+
+   vector<Point> points(queries);
+   seed = 0x13579bdf2468ace0ull;
+   for (size_t q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+
+   const char* names[] = { "default", "keep 8", "loose 2" };
+   OctreePolicy policies[3];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+   policies[2] = octreeDefaultPolicy;
+   policies[2].mMaxLeafItems = 8;
+   policies[2].mLooseness = 2.0f;
+
+   const int maxResults = 4096;
+   vector<int> found(maxResults);
+   bool ok = true;
+   for (int p = 0; p < 3; ++p) {
+      size_t before = gLiveBytes;
+      Octree tree(world, policies[p]);
+      if (p == 0) {
+         tree.Build(items.data(), count);
+      } else {
+         for (size_t n = 0; n < count; ++n) {
+            tree.Add(items[n].mBounds, items[n].mId);
+         }
+      }
+      size_t heap = gLiveBytes - before;
+
+      OctreeStats stats;
+      auto start = chrono::steady_clock::now();
+      tree.GetStats(stats);
+      double secs = elapsed(start);
+
+      unsigned int nodes = 0;
+      size_t copies = 0;
+      for (unsigned int level = 0; level <= octreeMaxLevels; ++level) {
+         nodes += stats.mLevelNodes[level];
+         copies += stats.mLevelItems[level];
+      }
+      unsigned int leaves = 0;
+      for (unsigned int b = 0; b < octreeStatsBuckets; ++b) {
+         leaves += stats.mLeafItems[b];
+      }
+
+      // The heap counts whole allocations, a little more than was asked.
+      size_t held = stats.mBytes - sizeof(tree);
+      bool right = stats.mItems == count && nodes == stats.mNodes &&
+         copies == stats.mCopies && leaves == stats.mLeaves &&
+         (p == 0 || stats.mCopies == count) && held <= heap &&
+         held >= heap - heap / 16;
+
+      // Work per point query.
+      char work[64] = "";
+      for (size_t q = 0; q < queries; ++q) {
+         tree.Query(points[q], found.data(), maxResults);
+      }
+      OctreeCounters counters[octreeQueryKinds];
+      if (tree.GetCounters(counters)) {
+         OctreeCounters const& c = counters[octreeQueryPoint];
+         right = right && c.mQueries == queries;
+         snprintf(work, sizeof(work), "  %5.1f nodes %6.1f items/query",
+            c.mNodes / (double)queries, c.mItems / (double)queries);
+      }
+
+      printf("stats %9zu items  %-7s  %8u nodes  depth %2u  %5.2f copies"
+         "  %7.1f MB  (heap %7.1f MB)  GetStats %8.3fs%s  %s\n", count,
+         names[p], stats.mNodes, stats.mDepth, stats.mDuplication,
+         stats.mBytes / 1048576.0, heap / 1048576.0, secs, work,
+         right ? "ok" : "MISMATCH");
+      ok = right && ok;
+   }
+
+   return ok;
+}
+
+// Moves 10000 entities a little every frame through trees of count items
+// (of which one in a hundred is moved with Update() every frame as well)
+// and queries the point and box of each entity with and without a hint
+// kept per entity. The results must be the same; the times show what the
+// hints save.
+static bool benchHint(size_t count)
+{
+   const size_t entities = 10000;
+   const int frames = 30;
+   const int maxResults = 256;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   const char* names[] = { "default", "keep 8" };
+   OctreePolicy policies[2];
+   policies[0] = octreeDefaultPolicy;
+   policies[1] = octreeDefaultPolicy;
+   policies[1].mMaxLeafItems = 8;
+   policies[1].mKeepStraddlers = true;
+
+   bool ok = true;
+   vector<int> plain(entities * maxResults);
+   vector<int> plainCount(entities);
+   vector<int> hinted(entities * maxResults);
+   vector<int> hintedCount(entities);
+   vector<int> found(maxResults);
+   for (int p = 0; p < 2; ++p) {
+      vector<Item> items;
+      makeItems(items, count, 0x0123456789abcdefull + count);
+      Octree tree(world, policies[p]);
+      if (p == 0) {
+         tree.Build(items.data(), count);
+      } else {
+         for (size_t n = 0; n < count; ++n) {
+            tree.Add(items[n].mBounds, items[n].mId);
+         }
+      }
+
+      // Entities start anywhere and move up to half a unit per frame.
+      uint64_t seed = 0x0f1e2d3c4b5a6978ull;
+      vector<Point> points(entities);
+      vector<Point> steps(entities);
+      vector<Octree::Hint> pointHints(entities);
+      vector<Octree::Hint> boxHints(entities);
+      memset(pointHints.data(), 0, entities * sizeof(Octree::Hint));
+      memset(boxHints.data(), 0, entities * sizeof(Octree::Hint));
+      for (size_t e = 0; e < entities; ++e) {
+         points[e] = randomPoint(seed);
+         steps[e].x = ((float)randrange(seed, 17) - 8) / 16;
+         steps[e].y = ((float)randrange(seed, 17) - 8) / 16;
+         steps[e].z = ((float)randrange(seed, 17) - 8) / 16;
+      }
+
+      size_t wrong = 0;
+      double plainSecs[2] = { 0, 0 };
+      double hintSecs[2] = { 0, 0 };
+      for (int f = 0; f < frames; ++f) {
+         for (size_t n = (size_t)f; n < count; n += 100) {
+            aabb b = items[n].mBounds;
+            float d = (float)randrange(seed, 3) - 1;
+            if (b.min.x + d >= 0 && b.max.x + d <= gWorld) {
+               b.min.x += d;
+               b.max.x += d;
+            }
+            items[n].mBounds = b;
+            tree.Update(items[n].mId, b);
+         }
+         for (size_t e = 0; e < entities; ++e) {
+            float* pPt = &points[e].x;
+            float* pStep = &steps[e].x;
+            for (int a = 0; a < 3; ++a) {
+               if (pPt[a] + pStep[a] < 0 || pPt[a] + pStep[a] > gWorld) {
+                  pStep[a] = -pStep[a];
+               }
+               pPt[a] += pStep[a];
+            }
+         }
+
+         // Points: the same items in the same order.
+         auto start = chrono::steady_clock::now();
+         for (size_t e = 0; e < entities; ++e) {
+            plainCount[e] = tree.Query(points[e], &plain[e * maxResults],
+               maxResults);
+         }
+         plainSecs[0] += elapsed(start);
+         start = chrono::steady_clock::now();
+         for (size_t e = 0; e < entities; ++e) {
+            hintedCount[e] = tree.Query(points[e], &hinted[e * maxResults],
+               maxResults, pointHints[e]);
+         }
+         hintSecs[0] += elapsed(start);
+         for (size_t e = 0; e < entities; ++e) {
+            vector<int>::iterator a = plain.begin() + e * maxResults;
+            vector<int>::iterator b = hinted.begin() + e * maxResults;
+            if (plainCount[e] != hintedCount[e] ||
+               !equal(a, a + plainCount[e], b))
+            {
+               wrong++;
+            }
+         }
+
+         // Boxes of 8 along each side: the same items in any order.
+         vector<aabb> boxes(entities);
+         for (size_t e = 0; e < entities; ++e) {
+            boxes[e].min = points[e];
+            boxes[e].max.x = points[e].x + 8;
+            boxes[e].max.y = points[e].y + 8;
+            boxes[e].max.z = points[e].z + 8;
+         }
+         start = chrono::steady_clock::now();
+         for (size_t e = 0; e < entities; ++e) {
+            plainCount[e] = tree.QueryBox(boxes[e], &plain[e * maxResults],
+               maxResults);
+         }
+         plainSecs[1] += elapsed(start);
+         start = chrono::steady_clock::now();
+         for (size_t e = 0; e < entities; ++e) {
+            hintedCount[e] = tree.QueryBox(boxes[e], &hinted[e * maxResults],
+               maxResults, boxHints[e]);
+         }
+         hintSecs[1] += elapsed(start);
+         for (size_t e = 0; e < entities; ++e) {
+            vector<int>::iterator a = plain.begin() + e * maxResults;
+            vector<int>::iterator b = hinted.begin() + e * maxResults;
+            vector<int> expect(a, a + plainCount[e]);
+            copy(b, b + hintedCount[e], found.begin());
+            if (!sameIds(found, hintedCount[e], expect)) wrong++;
+         }
+      }
+
+      double queries = (double)entities * frames;
+      printf("hint  %9zu items  %-7s  Query %7.3f Mq/s  hinted %7.3f Mq/s"
+         "  QueryBox %7.3f Mq/s  hinted %7.3f Mq/s  %s\n", count, names[p],
+         queries / plainSecs[0] / 1e6, queries / hintSecs[0] / 1e6,
+         queries / plainSecs[1] / 1e6, queries / hintSecs[1] / 1e6,
+         wrong == 0 ? "ok" : "MISMATCH");
+      ok = wrong == 0 && ok;
+   }
+
+   return ok;
+}
+
+//
+// SCENES
+//
+
+// Kinds of scene: items spread evenly, crowded around 64 points and spread
+// evenly with every tenth item up to 256 along each side.
+static const char* gSceneKinds[] = { "uniform", "clustered", "large" };
+
+// Split policies scenes are built with (see scenePolicy()).
+static const char* gScenePolicies[] = { "default", "keep 8", "loose 2" };
+
+// Scenes run at each count: a kind and a policy each. Copying items into
+// every leaf they overlap (the default policy) only suits even items; when
+// items crowd or some are large, leaves get smaller than the items and the
+// copies grow with the square of the count.
+static const int gScenes[][2] = {
+   { 0, 0 }, { 0, 1 }, { 0, 2 },
+   { 1, 1 }, { 1, 2 },
+   { 2, 1 }, { 2, 2 }
+};
+static const int gSceneCount = sizeof(gScenes) / sizeof(gScenes[0]);
+
+// Queries of each kind timed per scene, of which the first gSceneBrute are
+// also run as a brute force search and checked.
+static const size_t gSceneQueries = 10000;
+static const size_t gSceneBrute = 100;
+
+// Items removed and added back per scene (at most).
+static const size_t gSceneMoves = 100000;
+
+// Latency of one kind of query in a scene, in microseconds.
+struct SceneLatency
+{
+   double mP50;
+   double mP90;
+   double mP99;
+   double mMax;
+   double mBrute;                   // per brute force query
+   size_t mWrong;                   // queries disagreeing with brute force
+};
+
+// What was measured of a scene.
+struct SceneResult
+{
+   const char* mKind;
+   const char* mPolicy;
+   size_t mCount;
+   double mBuild;                   // seconds
+   size_t mPeakBytes;               // most heap used while building
+   size_t mBytes;                   // memory held by the tree (GetStats())
+   double mDuplication;             // copies per item
+   unsigned int mDepth;
+   double mRemoveRate;              // items per second
+   double mAddRate;
+   SceneLatency mPoint;
+   SceneLatency mBox;
+   SceneLatency mKnn;
+};
+
+// Fills items with count items of a kind of scene (see gSceneKinds).
+static void makeScene(int kind, vector<Item>& items, size_t count,
+   uint64_t seed)
+{
+   makeItems(items, count, seed);
+   if (kind == 1) {
+      // Around 64 centres, up to 64 away along each axis (most much less).
+      const unsigned int span = (unsigned int)gWorld - 128;
+      Point centres[64];
+      for (int c = 0; c < 64; ++c) {
+         centres[c].x = (float)(64 + randrange(seed, span));
+         centres[c].y = (float)(64 + randrange(seed, span));
+         centres[c].z = (float)(64 + randrange(seed, span));
+      }
+
+      for (size_t n = 0; n < count; ++n) {
+         aabb& b = items[n].mBounds;
+         Point const& centre = centres[randrange(seed, 64)];
+         float offset[3];
+         for (int a = 0; a < 3; ++a) {
+            offset[a] = 0;
+            for (int r = 0; r < 4; ++r) {
+               offset[a] += (float)randrange(seed, 33) - 16;
+            }
+         }
+
+         float sx = b.max.x - b.min.x;
+         float sy = b.max.y - b.min.y;
+         float sz = b.max.z - b.min.z;
+         b.min.x = min(max(centre.x + offset[0], 0.0f), gWorld - 8);
+         b.min.y = min(max(centre.y + offset[1], 0.0f), gWorld - 8);
+         b.min.z = min(max(centre.z + offset[2], 0.0f), gWorld - 8);
+         b.max.x = b.min.x + sx;
+         b.max.y = b.min.y + sy;
+         b.max.z = b.min.z + sz;
+      }
+   } else if (kind == 2) {
+      for (size_t n = 0; n < count; n += 10) {
+         aabb& b = items[n].mBounds;
+         b.max.x = min(gWorld, b.min.x + 1 + randrange(seed, 256));
+         b.max.y = min(gWorld, b.min.y + 1 + randrange(seed, 256));
+         b.max.z = min(gWorld, b.min.z + 1 + randrange(seed, 256));
+      }
+   }
+}
+
+// Sorts the latencies (in seconds) of a kind of query and keeps the
+// percentiles in microseconds.
+static void percentiles(vector<double>& secs, SceneLatency& latency)
+{
+   sort(secs.begin(), secs.end());
+   size_t last = secs.size() - 1;
+   latency.mP50 = secs[last / 2] * 1e6;
+   latency.mP90 = secs[last * 9 / 10] * 1e6;
+   latency.mP99 = secs[last * 99 / 100] * 1e6;
+   latency.mMax = secs[last] * 1e6;
+}
+
+// Returns the split policy of gScenePolicies[policy].
+static OctreePolicy scenePolicy(int policy)
+{
+   OctreePolicy p = octreeDefaultPolicy;
+   if (policy > 0) p.mMaxLeafItems = 8;
+   if (policy == 1) p.mKeepStraddlers = true;
+   if (policy == 2) p.mLooseness = 2.0f;
+   return p;
+}
+
+// Builds a scene of count items, times Build(), each query (point, box of
+// up to 16 along each side and the 8 nearest items) from points where the
+// items are, a brute force search of the first few queries and removing
+// and adding back some of the items. Queries are checked against the brute
+// force search.
+static bool benchScene(int kind, int policy, size_t count,
+   SceneResult& result)
+{
+   const int k = 8;
+   const int maxResults = 1 << 20;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Item> items;
+   makeScene(kind, items, count, 0x0123456789abcdefull + count + kind);
+
+   // Query points near random items (within 8 of their lowest corner) and
+   // boxes from there.
+   vector<Point> points(gSceneQueries);
+   vector<aabb> boxes(gSceneQueries);
+   uint64_t seed = 0x13579bdf2468ace0ull + kind;
+   for (size_t q = 0; q < gSceneQueries; ++q) {
+      aabb const& b = items[randrange(seed, (unsigned int)count)].mBounds;
+      Point& pt = points[q];
+      pt.x = min(b.min.x + (float)randrange(seed, 128) / 16, gWorld);
+      pt.y = min(b.min.y + (float)randrange(seed, 128) / 16, gWorld);
+      pt.z = min(b.min.z + (float)randrange(seed, 128) / 16, gWorld);
+      boxes[q].min = pt;
+      boxes[q].max.x = pt.x + randrange(seed, 17);
+      boxes[q].max.y = pt.y + randrange(seed, 17);
+      boxes[q].max.z = pt.z + randrange(seed, 17);
+   }
+
+   result.mKind = gSceneKinds[kind];
+   result.mPolicy = gScenePolicies[policy];
+   result.mCount = count;
+
+   // Build.
+   size_t before = gLiveBytes;
+   gPeakBytes = before;
+   Octree tree(world, scenePolicy(policy));
+   auto start = chrono::steady_clock::now();
+   tree.Build(items.data(), count);
+   result.mBuild = elapsed(start);
+   result.mPeakBytes = gPeakBytes - before;
+
+   OctreeStats stats;
+   tree.GetStats(stats);
+   result.mBytes = stats.mBytes;
+   result.mDuplication = stats.mDuplication;
+   result.mDepth = stats.mDepth;
+
+   // Queries.
+   vector<int> found(maxResults);
+   vector<float> distances(k);
+   vector<double> secs(gSceneQueries);
+   vector<vector<int> > kept(gSceneBrute);
+   for (size_t q = 0; q < gSceneQueries; ++q) {
+      start = chrono::steady_clock::now();
+      int n = tree.Query(points[q], found.data(), maxResults);
+      secs[q] = elapsed(start);
+      if (q < gSceneBrute) kept[q].assign(found.begin(), found.begin() + n);
+   }
+   percentiles(secs, result.mPoint);
+
+   vector<int> expect;
+   result.mPoint.mWrong = 0;
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < gSceneBrute; ++q) {
+      expect.clear();
+      for (size_t i = 0; i < count; ++i) {
+         if (isPointIn(points[q], items[i].mBounds)) {
+            expect.push_back(items[i].mId);
+         }
+      }
+      if (!sameIds(kept[q], (int)kept[q].size(), expect)) {
+         result.mPoint.mWrong++;
+      }
+   }
+   result.mPoint.mBrute = elapsed(start) * 1e6 / gSceneBrute;
+
+   for (size_t q = 0; q < gSceneQueries; ++q) {
+      start = chrono::steady_clock::now();
+      int n = tree.QueryBox(boxes[q], found.data(), maxResults);
+      secs[q] = elapsed(start);
+      if (q < gSceneBrute) kept[q].assign(found.begin(), found.begin() + n);
+   }
+   percentiles(secs, result.mBox);
+
+   result.mBox.mWrong = 0;
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < gSceneBrute; ++q) {
+      expect.clear();
+      for (size_t i = 0; i < count; ++i) {
+         if (isOverlap(boxes[q], items[i].mBounds)) {
+            expect.push_back(items[i].mId);
+         }
+      }
+      if (!sameIds(kept[q], (int)kept[q].size(), expect)) {
+         result.mBox.mWrong++;
+      }
+   }
+   result.mBox.mBrute = elapsed(start) * 1e6 / gSceneBrute;
+
+   vector<float> nearest(gSceneBrute * k);
+   for (size_t q = 0; q < gSceneQueries; ++q) {
+      start = chrono::steady_clock::now();
+      int n = tree.QueryKNN(points[q], k, found.data(), distances.data());
+      secs[q] = elapsed(start);
+      if (q < gSceneBrute) {
+         for (int d = 0; d < k; ++d) {
+            nearest[q * k + d] = (d < n) ? distances[d] : -1;
+         }
+      }
+   }
+   percentiles(secs, result.mKnn);
+
+   vector<float> dist(count);
+   result.mKnn.mWrong = 0;
+   start = chrono::steady_clock::now();
+   for (size_t q = 0; q < gSceneBrute; ++q) {
+      for (size_t i = 0; i < count; ++i) {
+         dist[i] = distanceSq(points[q], items[i].mBounds);
+      }
+      partial_sort(dist.begin(), dist.begin() + k, dist.end());
+      for (int d = 0; d < k; ++d) {
+         if (fabs(nearest[q * k + d] - sqrt(dist[d])) > 1e-3f) {
+            result.mKnn.mWrong++;
+            break;
+         }
+      }
+   }
+   result.mKnn.mBrute = elapsed(start) * 1e6 / gSceneBrute;
+
+   // Remove and add back every (count / moves)th item. The first Remove()
+   // indexes the ids so one item is taken out and put back beforehand.
+   size_t moves = min(count, gSceneMoves);
+   size_t stride = count / moves;
+   tree.Remove(items[0].mId);
+   tree.Add(items[0].mBounds, items[0].mId);
+
+   start = chrono::steady_clock::now();
+   for (size_t m = 0; m < moves; ++m) tree.Remove(items[m * stride].mId);
+   result.mRemoveRate = moves / elapsed(start);
+
+   start = chrono::steady_clock::now();
+   for (size_t m = 0; m < moves; ++m) {
+      Item const& item = items[m * stride];
+      tree.Add(item.mBounds, item.mId);
+   }
+   result.mAddRate = moves / elapsed(start);
+
+   // Print.
+   const char* name = result.mKind;
+   const char* policyName = result.mPolicy;
+   printf("scene %-9s %-7s %9zu items  Build %8.3fs  peak %8.1f MB"
+      "  held %8.1f MB  %5.2f copies  depth %2u  Remove %6.3f M/s"
+      "  Add %6.3f M/s\n", name, policyName, count, result.mBuild,
+      result.mPeakBytes / 1048576.0,
+      result.mBytes / 1048576.0, result.mDuplication, result.mDepth,
+      result.mRemoveRate / 1e6, result.mAddRate / 1e6);
+
+   const char* queries[] = { "point", "box", "knn 8" };
+   SceneLatency const* latencies[] =
+      { &result.mPoint, &result.mBox, &result.mKnn };
+   bool ok = true;
+   for (int n = 0; n < 3; ++n) {
+      SceneLatency const& l = *latencies[n];
+      printf("scene %-9s %-7s %9zu items  %-6s p50 %8.2f  p90 %8.2f"
+         "  p99 %8.2f  max %8.2f us  brute %10.1f us  %8.1fx  (%zu wrong)"
+         "  %s\n", name, policyName, count, queries[n], l.mP50, l.mP90,
+         l.mP99, l.mMax, l.mBrute, l.mBrute / l.mP50, l.mWrong,
+         l.mWrong == 0 ? "ok" : "MISMATCH");
+      ok = l.mWrong == 0 && ok;
+   }
+
+   return ok;
+}
+
+// Writes the latencies of a kind of query as a JSON object.
+static void writeLatency(FILE* pFile, const char* name,
+   SceneLatency const& l, bool last)
+{
+   fprintf(pFile, "        \"%s\": { \"p50_us\": %.3f, \"p90_us\": %.3f, "
+      "\"p99_us\": %.3f, \"max_us\": %.3f, \"brute_us\": %.3f, "
+      "\"wrong\": %zu }%s\n", name, l.mP50, l.mP90, l.mP99, l.mMax,
+      l.mBrute, l.mWrong, last ? "" : ",");
+}
+
+// Writes the results of all scenes to path as JSON (for tracking from one
+// build to the next). Returns false if the file could not be written.
+static bool writeJson(const char* path, vector<SceneResult> const& results)
+{
+   FILE* pFile = fopen(path, "w");
+   if (!pFile) return false;
+
+   fprintf(pFile, "{\n");
+   fprintf(pFile, "  \"benchmark\": \"octree\",\n");
+   fprintf(pFile, "  \"threads\": %u,\n", thread::hardware_concurrency());
+   fprintf(pFile, "  \"queries\": %zu,\n", gSceneQueries);
+   fprintf(pFile, "  \"scenes\": [\n");
+   for (size_t s = 0; s < results.size(); ++s) {
+      SceneResult const& r = results[s];
+      fprintf(pFile, "    {\n");
+      fprintf(pFile, "      \"kind\": \"%s\",\n", r.mKind);
+      fprintf(pFile, "      \"policy\": \"%s\",\n", r.mPolicy);
+      fprintf(pFile, "      \"items\": %zu,\n", r.mCount);
+      fprintf(pFile, "      \"build_s\": %.6f,\n", r.mBuild);
+      fprintf(pFile, "      \"peak_bytes\": %zu,\n", r.mPeakBytes);
+      fprintf(pFile, "      \"held_bytes\": %zu,\n", r.mBytes);
+      fprintf(pFile, "      \"copies_per_item\": %.4f,\n", r.mDuplication);
+      fprintf(pFile, "      \"depth\": %u,\n", r.mDepth);
+      fprintf(pFile, "      \"remove_per_s\": %.1f,\n", r.mRemoveRate);
+      fprintf(pFile, "      \"add_per_s\": %.1f,\n", r.mAddRate);
+      fprintf(pFile, "      \"latency\": {\n");
+      writeLatency(pFile, "point", r.mPoint, false);
+      writeLatency(pFile, "box", r.mBox, false);
+      writeLatency(pFile, "knn", r.mKnn, true);
+      fprintf(pFile, "      }\n");
+      fprintf(pFile, "    }%s\n", (s + 1 < results.size()) ? "," : "");
+   }
+   fprintf(pFile, "  ]\n");
+   fprintf(pFile, "}\n");
+
+   return fclose(pFile) == 0;
+}
+
+// Runs every scene from 10000 items and ten times more up to most and
+// writes the results to jsonPath (when given).
+static bool benchScenes(size_t most, const char* jsonPath)
+{
+   vector<SceneResult> results;
+   bool ok = true;
+   for (size_t count = 10000; count <= most; count *= 10) {
+      for (int scene = 0; scene < gSceneCount; ++scene) {
+         SceneResult result;
+         ok = benchScene(gScenes[scene][0], gScenes[scene][1], count,
+            result) && ok;
+         results.push_back(result);
+      }
+   }
+
+   if (jsonPath && !writeJson(jsonPath, results)) {
+      printf("Could not write %s\n", jsonPath);
+      ok = false;
+   }
+
+   return ok;
+}
+
+//
+// BVH
+//
+
+// Builds a BVH and an octree (of the default policy for items spread evenly
+// and keeping straddlers otherwise, see gScenes) of count items of each
+// kind of scene. The BVH is checked against a brute
+// force search of point, box and sphere queries and of the hits of rays in
+// order; build time, point queries per second and memory are shown next to
+// those of the octree.
+static bool benchBvh(size_t count)
+{
+   const size_t rays = 200;
+   const int queries = 100000;
+   const int maxResults = 4096;
+   aabb world;
+   world.min.x = world.min.y = world.min.z = 0;
+   world.max.x = world.max.y = world.max.z = gWorld;
+
+   vector<Point> points(queries);
+   uint64_t seed = 0x13579bdf2468ace0ull;
+   for (int q = 0; q < queries; ++q) points[q] = randomPoint(seed);
+   vector<Point> origins(rays);
+   vector<Point> dirs(rays);
+   for (size_t r = 0; r < rays; ++r) {
+      origins[r] = randomPoint(seed);
+      Point to = randomPoint(seed);
+      dirs[r].x = to.x - origins[r].x;
+      dirs[r].y = to.y - origins[r].y;
+      dirs[r].z = to.z - origins[r].z;
+   }
+
+   bool ok = true;
+   vector<int> ids(maxResults);
+   vector<float> ts(maxResults);
+   for (int kind = 0; kind < 3; ++kind) {
+      vector<Item> items;
+      makeScene(kind, items, count, 0x0123456789abcdefull + count);
+
+      Bvh bvh;
+      auto start = chrono::steady_clock::now();
+      bvh.Build(items.data(), count);
+      double bvhBuild = elapsed(start);
+
+      int policy = kind == 0 ? 0 : 1;
+      Octree tree(world, scenePolicy(policy));
+      start = chrono::steady_clock::now();
+      tree.Build(items.data(), count);
+      double treeBuild = elapsed(start);
+
+      size_t wrong = check(bvh, items, 0x0fedcba987654321ull);
+
+      // Every hit of each ray, nearest first.
+      for (size_t r = 0; r < rays; ++r) {
+         vector<pair<float, int> > expect;
+         for (size_t i = 0; i < count; ++i) {
+            float tEnter = 0;
+            float tExit = 1e30f;
+            if (rayIn(origins[r], dirs[r], items[i].mBounds, tEnter, tExit)) {
+               expect.push_back(make_pair(tEnter, items[i].mId));
+            }
+         }
+         sort(expect.begin(), expect.end());
+
+         int n = bvh.RayCast(origins[r], dirs[r], 1e30f, ids.data(),
+            ts.data(), maxResults);
+         bool same = (size_t)n == expect.size();
+         for (int i = 0; same && i < n; ++i) {
+            same = fabs(ts[i] - expect[i].first) <= 1e-5f;
+         }
+
+         vector<int> want;
+         for (size_t i = 0; i < expect.size(); ++i) {
+            want.push_back(expect[i].second);
+         }
+         if (!same || !sameIds(ids, n, want)) wrong++;
+      }
+
+      // Point queries.
+      start = chrono::steady_clock::now();
+      for (int q = 0; q < queries; ++q) {
+         bvh.Query(points[q], ids.data(), maxResults);
+      }
+      double bvhSecs = elapsed(start);
+      start = chrono::steady_clock::now();
+      for (int q = 0; q < queries; ++q) {
+         tree.Query(points[q], ids.data(), maxResults);
+      }
+      double treeSecs = elapsed(start);
+
+      BvhStats bvhStats;
+      OctreeStats treeStats;
+      bvh.GetStats(bvhStats);
+      tree.GetStats(treeStats);
+      bool right = wrong == 0 && bvhStats.mItems == count;
+
+      printf("bvh   %9zu items  %-9s  Build %7.3fs  Query %7.3f Mq/s"
+         "  %6.1f MB  depth %2u  %4.2f lanes  octree %-7s  Build %7.3fs"
+         "  Query %7.3f Mq/s  %6.1f MB  %s\n", count, gSceneKinds[kind],
+         bvhBuild, queries / bvhSecs / 1e6, bvhStats.mBytes / 1048576.0,
+         bvhStats.mDepth, bvhStats.mLanesUsed, gScenePolicies[policy],
+         treeBuild, queries / treeSecs / 1e6, treeStats.mBytes / 1048576.0,
+         right ? "ok" : "MISMATCH");
+      ok = right && ok;
+   }
+
+   return ok;
+}
+
+//
+// MAIN
+//
+
+// Usage: octreebench [check|scenes|all] [most items] [json file]
+// A number alone is taken as the most items to check (as before there were
+// modes).
+int main(int argc, char** argv)
+{
+   string mode = "check";
+   int arg = 1;
+   if (argc > arg && !isdigit((unsigned char)argv[arg][0])) {
+      mode = argv[arg];
+      arg++;
+   }
+
+   size_t most = 1000000;
+   if (argc > arg) most = strtoull(argv[arg], nullptr, 10);
+   const char* jsonPath = (argc > arg + 1) ? argv[arg + 1] : nullptr;
+   if (mode != "check" && mode != "scenes" && mode != "all") {
+      printf("Usage: octreebench [check|scenes|all] [most items] "
+         "[json file]\n");
+      return 1;
+   }
+
+   bool ok = true;
+   if (mode == "scenes" || mode == "all") {
+      printf("Octree scenes\n");
+      printf("-------------\n");
+      ok = benchScenes(most, jsonPath) && ok;
+      if (mode == "scenes") return ok ? 0 : 1;
+      printf("\n");
+   }
+
+   printf("Octree benchmark\n");
+   printf("----------------\n");
+   for (size_t count = 10000; count <= most; count *= 10) {
+      ok = benchBuild(count) && ok;
+   }
+
+   OctreePolicy keep = octreeDefaultPolicy;
+   keep.mMaxLeafItems = 8;
+   keep.mKeepStraddlers = true;
+   ok = benchUpdate(min(most, gAddMost), octreeDefaultPolicy, "default") && ok;
+   ok = benchUpdate(min(most, gAddMost), keep, "keep 8") && ok;
+   OctreePolicy loose = octreeDefaultPolicy;
+   loose.mMaxLeafItems = 8;
+   loose.mLooseness = 2.0f;
+   ok = benchUpdate(min(most, gAddMost), loose, "loose 2") && ok;
+   ok = benchPolicy(min(most, gAddMost / 10)) && ok;
+   ok = benchCrowd(min(most, gAddMost / 10)) && ok;
+   ok = benchShapes(min(most, gAddMost / 10)) && ok;
+   ok = benchRebuild(min(most, gAddMost)) && ok;
+   ok = benchKnn(most, 1) && ok;
+   ok = benchKnn(most, 16) && ok;
+   ok = benchRay(most) && ok;
+   ok = benchPairs(min(most, gAddMost)) && ok;
+   for (size_t count = 1000; count <= most; count *= 10) {
+      ok = benchBatch(count) && ok;
+   }
+   ok = benchParallel(most) && ok;
+   ok = benchFile(most) && ok;
+   ok = benchFar(most) && ok;
+   ok = benchQuad(min(most, gAddMost)) && ok;
+   ok = benchStats(min(most, gAddMost)) && ok;
+   ok = benchHint(min(most, gAddMost)) && ok;
+   ok = benchBvh(min(most, gAddMost)) && ok;
+
+   return ok ? 0 : 1;
+}
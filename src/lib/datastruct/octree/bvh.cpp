@@ -0,0 +1,961 @@
+/*
+Date: 18 Oct 2026 10:41:19.026618394
+File: bvh.cpp
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: A bounding volume hierarchy answering the queries of the octree.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+
+*/
+
+#include <assert.h>
+#include <memory.h>
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
+#include <thread>
+#include <algorithm>
+
+#include "datastruct/octree.h"
+#include "datastruct/bvh.h"
+#include "spatial.h"
+
+using namespace std;
+
+// Coordinate and payload types compiled in, as for OctreeT.
+template class BvhT<float, int>;
+template class BvhT<float, long long>;
+template class BvhT<float, void*>;
+template class BvhT<double, int>;
+template class BvhT<double, long long>;
+template class BvhT<double, void*>;
+template class BvhT<int, int>;
+template class BvhT<int, long long>;
+template class BvhT<int, void*>;
+template class BvhT<float, int, 2>;
+template class BvhT<float, long long, 2>;
+template class BvhT<float, void*, 2>;
+template class BvhT<double, int, 2>;
+template class BvhT<double, long long, 2>;
+template class BvhT<double, void*, 2>;
+template class BvhT<int, int, 2>;
+template class BvhT<int, long long, 2>;
+template class BvhT<int, void*, 2>;
+
+//
+// BUILD BUFFERS
+//
+
+// Buffers used by Build(), kept from one build to the next. The binary tree
+// built over the sorted items has count - 1 internal nodes; a child of one
+// is either another internal node or (with bvhItem set) a sorted item.
+template <typename Scalar, unsigned int Dim>
+struct BvhScratch
+{
+   vector<unsigned int> mCodes;     // Morton codes of the items
+   vector<unsigned int> mOrder;     // items in code order
+   vector<unsigned int> mTmpKeys;   // radix sort buffers
+   vector<unsigned int> mTmpVals;
+   vector<size_t> mHist;
+   vector<aabbT<Scalar, Dim> > mSlices;   // bounds of centres per thread
+   vector<unsigned int> mLeft;      // children of each internal node
+   vector<unsigned int> mRight;
+   vector<unsigned int> mParent;    // parent of each internal node
+   vector<unsigned int> mItemParent;      // parent of each sorted item
+   vector<unsigned int> mVisits;    // children done (bounds pass)
+   vector<aabbT<Scalar, Dim> > mBounds;   // bounds of each internal node
+   vector<unsigned int> mFold;      // (internal node, node) pairs to fold
+};
+
+//
+// LANE TESTS
+//
+
+// Each test below has a version for any coordinate type, testing the lanes
+// of a node one at a time, and SIMD versions testing all bvhWidth lanes at
+// once. The masks returned include empty lanes whenever their (inverted)
+// boxes pass; callers keep only the lanes in use (see usedMask()).
+
+// Returns a mask with bit n set for each lane of node in use.
+template <typename Scalar, unsigned int Dim>
+static inline unsigned int usedMask(BvhNode<Scalar, Dim> const& node)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; ++n) {
+      if (node.mChild[n] != bvhNone) mask |= 1u << n;
+   }
+   return mask;
+}
+
+// Returns a mask with bit n set when the box of lane n holds (or touches)
+// pt.
+template <typename Scalar, unsigned int Dim>
+static inline unsigned int pointMask(BvhNode<Scalar, Dim> const& node,
+   PointT<Scalar, Dim> const& pt)
+{
+   const Scalar* p = &pt.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; ++n) {
+      bool in = true;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         if (p[a] < node.mMin[a][n] || p[a] > node.mMax[a][n]) in = false;
+      }
+      if (in) mask |= 1u << n;
+   }
+   return mask;
+}
+
+// Returns a mask with bit n set when the box of lane n overlaps (or
+// touches) box.
+template <typename Scalar, unsigned int Dim>
+static inline unsigned int boxMask(BvhNode<Scalar, Dim> const& node,
+   aabbT<Scalar, Dim> const& box)
+{
+   const Scalar* pLo = &box.min.x;
+   const Scalar* pHi = &box.max.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; ++n) {
+      bool in = true;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         if (node.mMin[a][n] > pHi[a] || pLo[a] > node.mMax[a][n]) in = false;
+      }
+      if (in) mask |= 1u << n;
+   }
+   return mask;
+}
+
+#if defined __SSE2__
+// Floats: all 4 lanes in one SSE register.
+template <unsigned int Dim>
+static inline unsigned int pointMask(BvhNode<float, Dim> const& node,
+   PointT<float, Dim> const& pt)
+{
+   const float* p = &pt.x;
+   __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m128 v = _mm_set1_ps(p[a]);
+      in = _mm_and_ps(in, _mm_and_ps(
+         _mm_cmple_ps(_mm_loadu_ps(node.mMin[a]), v),
+         _mm_cmple_ps(v, _mm_loadu_ps(node.mMax[a]))));
+   }
+   return (unsigned int)_mm_movemask_ps(in);
+}
+
+template <unsigned int Dim>
+static inline unsigned int boxMask(BvhNode<float, Dim> const& node,
+   aabbT<float, Dim> const& box)
+{
+   const float* pLo = &box.min.x;
+   const float* pHi = &box.max.x;
+   __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      in = _mm_and_ps(in, _mm_and_ps(
+         _mm_cmple_ps(_mm_loadu_ps(node.mMin[a]), _mm_set1_ps(pHi[a])),
+         _mm_cmple_ps(_mm_set1_ps(pLo[a]), _mm_loadu_ps(node.mMax[a]))));
+   }
+   return (unsigned int)_mm_movemask_ps(in);
+}
+
+// Doubles: all 4 lanes at once with AVX or as two halves with SSE2.
+template <unsigned int Dim>
+static inline unsigned int pointMask(BvhNode<double, Dim> const& node,
+   PointT<double, Dim> const& pt)
+{
+   const double* p = &pt.x;
+#if defined __AVX__
+   __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m256d v = _mm256_set1_pd(p[a]);
+      in = _mm256_and_pd(in, _mm256_and_pd(
+         _mm256_cmp_pd(_mm256_loadu_pd(node.mMin[a]), v, _CMP_LE_OQ),
+         _mm256_cmp_pd(v, _mm256_loadu_pd(node.mMax[a]), _CMP_LE_OQ)));
+   }
+   return (unsigned int)_mm256_movemask_pd(in);
+#else
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; n += 2) {
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128d v = _mm_set1_pd(p[a]);
+         in = _mm_and_pd(in, _mm_and_pd(
+            _mm_cmple_pd(_mm_loadu_pd(node.mMin[a] + n), v),
+            _mm_cmple_pd(v, _mm_loadu_pd(node.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_pd(in) << n;
+   }
+   return mask;
+#endif
+}
+
+template <unsigned int Dim>
+static inline unsigned int boxMask(BvhNode<double, Dim> const& node,
+   aabbT<double, Dim> const& box)
+{
+   const double* pLo = &box.min.x;
+   const double* pHi = &box.max.x;
+#if defined __AVX__
+   __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      in = _mm256_and_pd(in, _mm256_and_pd(
+         _mm256_cmp_pd(_mm256_loadu_pd(node.mMin[a]),
+            _mm256_set1_pd(pHi[a]), _CMP_LE_OQ),
+         _mm256_cmp_pd(_mm256_set1_pd(pLo[a]),
+            _mm256_loadu_pd(node.mMax[a]), _CMP_LE_OQ)));
+   }
+   return (unsigned int)_mm256_movemask_pd(in);
+#else
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; n += 2) {
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         in = _mm_and_pd(in, _mm_and_pd(
+            _mm_cmple_pd(_mm_loadu_pd(node.mMin[a] + n),
+               _mm_set1_pd(pHi[a])),
+            _mm_cmple_pd(_mm_set1_pd(pLo[a]),
+               _mm_loadu_pd(node.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_pd(in) << n;
+   }
+   return mask;
+#endif
+}
+
+// Fixed point: all 4 lanes in one SSE2 register, testing for the lanes
+// which miss since SSE2 only compares integers for greater than.
+static inline __m128i loadInts(const int* p)
+{
+   return _mm_loadu_si128((const __m128i*)p);
+}
+
+template <unsigned int Dim>
+static inline unsigned int pointMask(BvhNode<int, Dim> const& node,
+   PointT<int, Dim> const& pt)
+{
+   const int* p = &pt.x;
+   __m128i out = _mm_setzero_si128();
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m128i v = _mm_set1_epi32(p[a]);
+      out = _mm_or_si128(out, _mm_or_si128(
+         _mm_cmpgt_epi32(loadInts(node.mMin[a]), v),
+         _mm_cmpgt_epi32(v, loadInts(node.mMax[a]))));
+   }
+   return ~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xf;
+}
+
+template <unsigned int Dim>
+static inline unsigned int boxMask(BvhNode<int, Dim> const& node,
+   aabbT<int, Dim> const& box)
+{
+   const int* pLo = &box.min.x;
+   const int* pHi = &box.max.x;
+   __m128i out = _mm_setzero_si128();
+   for (unsigned int a = 0; a < Dim; ++a) {
+      out = _mm_or_si128(out, _mm_or_si128(
+         _mm_cmpgt_epi32(loadInts(node.mMin[a]), _mm_set1_epi32(pHi[a])),
+         _mm_cmpgt_epi32(_mm_set1_epi32(pLo[a]), loadInts(node.mMax[a]))));
+   }
+   return ~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xf;
+}
+#endif
+
+// Returns a mask with bit n set when the box of lane n lies within
+// sqrt(radiusSq) of centre.
+template <typename Scalar, unsigned int Dim, typename Real>
+static inline unsigned int sphereMask(BvhNode<Scalar, Dim> const& node,
+   PointT<Scalar, Dim> const& centre, Real radiusSq)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; ++n) {
+      Real d = 0;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         Real v = coord(centre, a);
+         Real da = max(max((Real)node.mMin[a][n] - v,
+            v - (Real)node.mMax[a][n]), (Real)0);
+         d += da * da;
+      }
+      if (d <= radiusSq) mask |= 1u << n;
+   }
+   return mask;
+}
+
+// Returns a mask with bit n set when the ray hits the box of lane n between
+// tMin and tMax and writes where it enters each lane to pT (an array of
+// bvhWidth). This is the slab test of rayBounds() done for each lane.
+template <typename Scalar, unsigned int Dim, typename Real>
+static inline unsigned int rayMask(BvhNode<Scalar, Dim> const& node,
+   OctreeRay<Real, Dim> const& ray, Real tMin, Real tMax, Real* pT)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < bvhWidth; ++n) {
+      aabbT<Scalar, Dim> ab;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         coord(ab.min, a) = node.mMin[a][n];
+         coord(ab.max, a) = node.mMax[a][n];
+      }
+      pT[n] = tMin;
+      Real tExit = tMax;
+      if (rayBounds(ab, ray, pT[n], tExit)) mask |= 1u << n;
+   }
+   return mask;
+}
+
+#if defined __SSE2__
+// Floats: all 4 lanes in one SSE register.
+template <unsigned int Dim>
+static inline unsigned int rayMask(BvhNode<float, Dim> const& node,
+   OctreeRay<float, Dim> const& ray, float tMin, float tMax, float* pT)
+{
+   __m128 enter = _mm_set1_ps(tMin);
+   __m128 exit = _mm_set1_ps(tMax);
+   __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m128 o = _mm_set1_ps(ray.mOrigin[a]);
+      const __m128 lo = _mm_loadu_ps(node.mMin[a]);
+      const __m128 hi = _mm_loadu_ps(node.mMax[a]);
+      if (ray.mDir[a] == 0) {
+         in = _mm_and_ps(in, _mm_and_ps(_mm_cmple_ps(lo, o),
+            _mm_cmple_ps(o, hi)));
+         continue;
+      }
+
+      const __m128 inv = _mm_set1_ps(ray.mInv[a]);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(lo, o), inv);
+      __m128 t2 = _mm_mul_ps(_mm_sub_ps(hi, o), inv);
+      enter = _mm_max_ps(enter, _mm_min_ps(t1, t2));
+      exit = _mm_min_ps(exit, _mm_max_ps(t1, t2));
+   }
+
+   in = _mm_and_ps(in, _mm_cmple_ps(enter, exit));
+   _mm_storeu_ps(pT, enter);
+   return (unsigned int)_mm_movemask_ps(in);
+}
+#endif
+
+//
+// BUILD HELPERS
+//
+
+// Returns the middle of lo and hi, worked out in double for fixed point.
+template <typename Scalar>
+static inline Scalar getCentre(Scalar lo, Scalar hi)
+{
+   return (Scalar)(lo + ((double)hi - lo) / 2);
+}
+
+// The length of the prefix shared by sorted items i and j: the bits their
+// Morton codes have in common, then those of their indices when the codes
+// are the same, so that every item is told apart. -1 when j is out of
+// range.
+static inline int commonPrefix(unsigned int const* pCodes, long long count,
+   long long i, long long j)
+{
+   if (j < 0 || j >= count) return -1;
+   unsigned int ci = pCodes[i];
+   unsigned int cj = pCodes[j];
+   if (ci == cj) {
+      return 32 + __builtin_clz((unsigned int)i ^ (unsigned int)j);
+   }
+   return __builtin_clz(ci ^ cj);
+}
+
+// The size of bounds used to pick which lane to open first when folding
+// the binary tree: its surface (or perimeter in 2D) up to a constant.
+template <typename Scalar, unsigned int Dim, typename Real>
+static inline Real getArea(aabbT<Scalar, Dim> const& bounds)
+{
+   Real area = 0;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Real e = (Real)coord(bounds.max, a) - coord(bounds.min, a);
+      if (Dim == 2) {
+         area += e;
+      } else {
+         unsigned int b = (a + 1) % Dim;
+         area += e * ((Real)coord(bounds.max, b) - coord(bounds.min, b));
+      }
+   }
+   return area;
+}
+
+//
+// BVH FUNCTIONALITY
+//
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+BvhT<Scalar, Payload, Dim>::BvhT()
+   : mNodeCount(0), mItemCount(0), mpScratch(nullptr)
+{
+   mpScratch = new Scratch;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+BvhT<Scalar, Payload, Dim>::~BvhT()
+{
+   delete mpScratch;
+   mpScratch = nullptr;
+}
+
+// Builds the tree in four passes (see bvh.h): Morton codes, the binary tree,
+// its bounds and the folded tree of bvhWidth lanes per node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool BvhT<Scalar, Payload, Dim>::Build(Item const* pItems, size_t count)
+{
+   // Validate parameters.
+   if (count > 0 && !pItems) return false;
+   if (count >= bvhItem) return false;
+
+   Reset();
+   if (count == 0) return true;
+
+   mItemCount = (unsigned int)count;
+   buildCodes(pItems, count);
+   buildTree();
+   buildBounds(pItems);
+   collapse(pItems);
+   return true;
+}
+
+// Clear the BVH. The arrays keep their memory for the next build.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool BvhT<Scalar, Payload, Dim>::Reset()
+{
+   mNodeCount = 0;
+   mItemCount = 0;
+   return true;
+}
+
+// Sorts the items by the Morton code of their centre within the bounds of
+// all centres and lays out their ids in that order.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::buildCodes(Item const* pItems, size_t count)
+{
+   Scratch& s = *mpScratch;
+   unsigned int threads = threadCount(count);
+
+   // Bounds of the centres, one slice per thread.
+   s.mSlices.resize(threads);
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int t) {
+         aabb& ab = s.mSlices[t];
+         for (unsigned int a = 0; a < Dim; ++a) {
+            coord(ab.min, a) = numeric_limits<Scalar>::max();
+            coord(ab.max, a) = numeric_limits<Scalar>::lowest();
+         }
+         for (size_t n = begin; n < end; ++n) {
+            aabb const& b = pItems[n].mBounds;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               Scalar c = getCentre(coord(b.min, a), coord(b.max, a));
+               coord(ab.min, a) = min(coord(ab.min, a), c);
+               coord(ab.max, a) = max(coord(ab.max, a), c);
+            }
+         }
+      });
+
+   aabb centres = s.mSlices[0];
+   for (unsigned int t = 1; t < threads; ++t) {
+      for (unsigned int a = 0; a < Dim; ++a) {
+         coord(centres.min, a) =
+            min(coord(centres.min, a), coord(s.mSlices[t].min, a));
+         coord(centres.max, a) =
+            max(coord(centres.max, a), coord(s.mSlices[t].max, a));
+      }
+   }
+
+   // Codes, then sorted.
+   s.mCodes.resize(count);
+   s.mOrder.resize(count);
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            aabb const& b = pItems[n].mBounds;
+            unsigned int code = 0;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               Scalar c = getCentre(coord(b.min, a), coord(b.max, a));
+               unsigned int cell = toCell(c, coord(centres.min, a),
+                  coord(centres.max, a));
+               code |= spreadBits<Dim>(cell) << a;
+            }
+            s.mCodes[n] = code;
+            s.mOrder[n] = (unsigned int)n;
+         }
+      });
+
+   radixSort(s.mCodes, s.mOrder, Dim * octreeMortonLevels, s.mTmpKeys,
+      s.mTmpVals, s.mHist);
+
+   mIds.resize(count);
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            mIds[n] = pItems[s.mOrder[n]].mId;
+         }
+      });
+}
+
+// Builds the binary radix tree over the sorted codes. Internal node i
+// covers a range of sorted items with i at one end; the range and where it
+// splits follow from the prefixes i shares with its neighbours alone, so
+// every node is found independently of the others (Karras, 2012). The
+// root is node 0.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::buildTree()
+{
+   Scratch& s = *mpScratch;
+   const long long count = mItemCount;
+   const size_t internals = mItemCount - 1;
+   s.mLeft.resize(internals);
+   s.mRight.resize(internals);
+   s.mParent.resize(internals);
+   s.mItemParent.resize(mItemCount);
+   if (internals == 0) {
+      s.mItemParent[0] = bvhNone;
+      return;
+   }
+
+   s.mParent[0] = bvhNone;
+   const unsigned int* pCodes = &s.mCodes[0];
+   parallelFor(internals, threadCount(internals),
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            long long i = (long long)n;
+
+            // Direction of the range: towards the neighbour sharing more.
+            int d = (commonPrefix(pCodes, count, i, i + 1) -
+               commonPrefix(pCodes, count, i, i - 1)) >= 0 ? 1 : -1;
+
+            // Far end of the range: everything sharing more than the
+            // neighbour on the other side.
+            int least = commonPrefix(pCodes, count, i, i - d);
+            long long most = 2;
+            while (commonPrefix(pCodes, count, i, i + most * d) > least) {
+               most *= 2;
+            }
+            long long length = 0;
+            for (long long t = most / 2; t >= 1; t /= 2) {
+               if (commonPrefix(pCodes, count, i, i + (length + t) * d) >
+                  least)
+               {
+                  length += t;
+               }
+            }
+            long long j = i + length * d;
+
+            // Split: the last item sharing more than the whole range.
+            int shared = commonPrefix(pCodes, count, i, j);
+            long long split = 0;
+            long long t = length;
+            do {
+               t = (t + 1) / 2;
+               if (commonPrefix(pCodes, count, i, i + (split + t) * d) >
+                  shared)
+               {
+                  split += t;
+               }
+            } while (t > 1);
+            long long gamma = i + split * d + min(d, 0);
+
+            // Children: items at the ends of the range, nodes otherwise.
+            unsigned int left = (unsigned int)gamma;
+            unsigned int right = (unsigned int)gamma + 1;
+            if (min(i, j) == gamma) {
+               s.mLeft[n] = bvhItem | left;
+               s.mItemParent[left] = (unsigned int)n;
+            } else {
+               s.mLeft[n] = left;
+               s.mParent[left] = (unsigned int)n;
+            }
+            if (max(i, j) == gamma + 1) {
+               s.mRight[n] = bvhItem | right;
+               s.mItemParent[right] = (unsigned int)n;
+            } else {
+               s.mRight[n] = right;
+               s.mParent[right] = (unsigned int)n;
+            }
+         }
+      });
+}
+
+// Works out the bounds of every internal node from the items up. Each item
+// climbs towards the root; of the two children of a node, the one arriving
+// second (both have their bounds by then) bounds the node and climbs on.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::buildBounds(Item const* pItems)
+{
+   Scratch& s = *mpScratch;
+   const size_t internals = mItemCount - 1;
+   if (internals == 0) return;
+
+   s.mBounds.resize(internals);
+   s.mVisits.resize(internals);
+   fill(s.mVisits.begin(), s.mVisits.end(), 0);
+   parallelFor(mItemCount, threadCount(mItemCount),
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            unsigned int node = s.mItemParent[n];
+            while (node != bvhNone) {
+               if (__atomic_fetch_add(&s.mVisits[node], 1,
+                  __ATOMIC_ACQ_REL) == 0)
+               {
+                  break;
+               }
+
+               aabb left;
+               aabb right;
+               getLaneBounds(pItems, s.mLeft[node], left);
+               getLaneBounds(pItems, s.mRight[node], right);
+               aabb& ab = s.mBounds[node];
+               for (unsigned int a = 0; a < Dim; ++a) {
+                  coord(ab.min, a) =
+                     min(coord(left.min, a), coord(right.min, a));
+                  coord(ab.max, a) =
+                     max(coord(left.max, a), coord(right.max, a));
+               }
+               node = s.mParent[node];
+            }
+         }
+      });
+}
+
+// Folds the binary tree into nodes of bvhWidth lanes. Starting from the two
+// children of an internal node, the lane with the largest internal node is
+// replaced by its two children until all lanes are full (or hold items).
+// Nodes are laid out in the order they are first reached.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::collapse(Item const* pItems)
+{
+   Scratch& s = *mpScratch;
+
+   // Every node folds at least one internal node (or the single item).
+   size_t most = max(mItemCount - 1, 1u);
+   if (mNodes.size() < most) mNodes.resize(most);
+
+   s.mFold.clear();
+   s.mFold.push_back(mItemCount == 1 ? bvhItem : 0);
+   s.mFold.push_back(0);
+   mNodeCount = 1;
+   while (!s.mFold.empty()) {
+      unsigned int index = s.mFold.back();
+      s.mFold.pop_back();
+      unsigned int ref = s.mFold.back();
+      s.mFold.pop_back();
+
+      unsigned int lanes[bvhWidth];
+      unsigned int used = 1;
+      lanes[0] = ref;
+      if (!(ref & bvhItem)) {
+         lanes[0] = s.mLeft[ref];
+         lanes[1] = s.mRight[ref];
+         used = 2;
+      }
+
+      while (used < bvhWidth) {
+         int widest = -1;
+         Real widestArea = 0;
+         for (unsigned int n = 0; n < used; ++n) {
+            if (lanes[n] & bvhItem) continue;
+            Real area = getArea<Scalar, Dim, Real>(s.mBounds[lanes[n]]);
+            if (widest < 0 || area > widestArea) {
+               widest = (int)n;
+               widestArea = area;
+            }
+         }
+         if (widest < 0) break;
+
+         unsigned int open = lanes[widest];
+         lanes[widest] = s.mLeft[open];
+         lanes[used++] = s.mRight[open];
+      }
+
+      Node& node = mNodes[index];
+      for (unsigned int n = 0; n < bvhWidth; ++n) {
+         if (n >= used) {
+            for (unsigned int a = 0; a < Dim; ++a) {
+               node.mMin[a][n] = numeric_limits<Scalar>::max();
+               node.mMax[a][n] = numeric_limits<Scalar>::lowest();
+            }
+            node.mChild[n] = bvhNone;
+            continue;
+         }
+
+         aabb ab;
+         getLaneBounds(pItems, lanes[n], ab);
+         for (unsigned int a = 0; a < Dim; ++a) {
+            node.mMin[a][n] = coord(ab.min, a);
+            node.mMax[a][n] = coord(ab.max, a);
+         }
+
+         if (lanes[n] & bvhItem) {
+            node.mChild[n] = lanes[n];
+         } else {
+            node.mChild[n] = mNodeCount;
+            s.mFold.push_back(lanes[n]);
+            s.mFold.push_back(mNodeCount);
+            mNodeCount++;
+         }
+      }
+   }
+}
+
+// The bounds of a child of the binary tree: a sorted item or an internal
+// node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::getLaneBounds(Item const* pItems,
+   unsigned int ref, aabb& bounds) const
+{
+   if (ref & bvhItem) {
+      bounds = pItems[mpScratch->mOrder[ref & ~bvhItem]].mBounds;
+   } else {
+      bounds = mpScratch->mBounds[ref];
+   }
+}
+
+// Walks the whole tree for its depth and the lanes in use.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void BvhT<Scalar, Payload, Dim>::GetStats(BvhStats& stats) const
+{
+   memset(&stats, 0, sizeof(stats));
+   stats.mNodes = mNodeCount;
+   stats.mItems = mItemCount;
+
+   size_t lanes = 0;
+   if (mNodeCount > 0) {
+      unsigned int stackNode[bvhStackSize];
+      unsigned int stackDepth[bvhStackSize];
+      int top = 0;
+      stackNode[0] = 0;
+      stackDepth[0] = 1;
+      while (top >= 0) {
+         Node const& node = mNodes[stackNode[top]];
+         unsigned int depth = stackDepth[top];
+         top--;
+         stats.mDepth = max(stats.mDepth, depth);
+         for (unsigned int n = 0; n < bvhWidth; ++n) {
+            unsigned int child = node.mChild[n];
+            if (child == bvhNone) continue;
+            lanes++;
+            if (child & bvhItem) continue;
+            top++;
+            stackNode[top] = child;
+            stackDepth[top] = depth + 1;
+         }
+      }
+      stats.mLanesUsed = (double)lanes / mNodeCount;
+   }
+
+   Scratch const& s = *mpScratch;
+   stats.mNodeBytes = mNodeCount * sizeof(Node);
+   stats.mIdBytes = mItemCount * sizeof(Payload);
+   stats.mScratchBytes = sizeof(s) +
+      (s.mCodes.capacity() + s.mOrder.capacity() + s.mTmpKeys.capacity() +
+      s.mTmpVals.capacity() + s.mLeft.capacity() + s.mRight.capacity() +
+      s.mParent.capacity() + s.mItemParent.capacity() +
+      s.mVisits.capacity() + s.mFold.capacity()) * sizeof(unsigned int) +
+      s.mHist.capacity() * sizeof(size_t) +
+      (s.mSlices.capacity() + s.mBounds.capacity()) * sizeof(aabb);
+   stats.mBytes = sizeof(*this) + mNodes.capacity() * sizeof(Node) +
+      mIds.capacity() * sizeof(Payload) + stats.mScratchBytes;
+}
+
+// Find up to 'maxResults' items holding point and write them into
+// 'outResults' array. Returns the actual number of results stored.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int BvhT<Scalar, Payload, Dim>::Query(Point const& point,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0 || mNodeCount == 0) return 0;
+
+   int results = 0;
+   unsigned int stackNode[bvhStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   while (top >= 0) {
+      Node const& node = mNodes[stackNode[top]];
+      top--;
+
+      unsigned int mask = pointMask(node, point) & usedMask(node);
+      while (mask) {
+         unsigned int n = __builtin_ctz(mask);
+         mask &= mask - 1;
+         unsigned int child = node.mChild[n];
+         if (child & bvhItem) {
+            outResults[results++] = mIds[child & ~bvhItem];
+            if (results == maxResults) return results;
+         } else {
+            stackNode[++top] = child;
+         }
+      }
+   }
+
+   // Done.
+   return results;
+}
+
+// Find up to 'maxResults' items overlapping box and write them into
+// 'outResults' array. Returns the actual number of results stored.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int BvhT<Scalar, Payload, Dim>::QueryBox(aabb const& box,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0 || mNodeCount == 0) return 0;
+
+   int results = 0;
+   unsigned int stackNode[bvhStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   while (top >= 0) {
+      Node const& node = mNodes[stackNode[top]];
+      top--;
+
+      unsigned int mask = boxMask(node, box) & usedMask(node);
+      while (mask) {
+         unsigned int n = __builtin_ctz(mask);
+         mask &= mask - 1;
+         unsigned int child = node.mChild[n];
+         if (child & bvhItem) {
+            outResults[results++] = mIds[child & ~bvhItem];
+            if (results == maxResults) return results;
+         } else {
+            stackNode[++top] = child;
+         }
+      }
+   }
+
+   // Done.
+   return results;
+}
+
+// Find up to 'maxResults' items within radius of centre and write them into
+// 'outResults' array. Returns the actual number of results stored.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int BvhT<Scalar, Payload, Dim>::QuerySphere(Point const& centre, Real radius,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0 || radius < 0 || mNodeCount == 0) {
+      return 0;
+   }
+
+   const Real radiusSq = radius * radius;
+   int results = 0;
+   unsigned int stackNode[bvhStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   while (top >= 0) {
+      Node const& node = mNodes[stackNode[top]];
+      top--;
+
+      unsigned int mask = sphereMask(node, centre, radiusSq) & usedMask(node);
+      while (mask) {
+         unsigned int n = __builtin_ctz(mask);
+         mask &= mask - 1;
+         unsigned int child = node.mChild[n];
+         if (child & bvhItem) {
+            outResults[results++] = mIds[child & ~bvhItem];
+            if (results == maxResults) return results;
+         } else {
+            stackNode[++top] = child;
+         }
+      }
+   }
+
+   // Done.
+   return results;
+}
+
+// Find up to 'maxResults' items hit by the ray, nearest first. Lanes are
+// visited front to back: the nodes hit are pushed furthest first so that
+// the nearest is visited next, and once enough items are found nodes
+// entered beyond the furthest of them are skipped.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int BvhT<Scalar, Payload, Dim>::RayCast(Point const& origin,
+   Point const& dir, Real maxT, Payload* outResults, Real* outT,
+   int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || !outT || maxResults <= 0 || !(maxT >= 0)) return 0;
+   if (mNodeCount == 0) return 0;
+
+   OctreeRay<Real, Dim> ray;
+   makeRay(origin, dir, ray);
+
+   int results = 0;
+   unsigned int stackNode[bvhStackSize];
+   Real stackT[bvhStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackT[0] = 0;
+   while (top >= 0) {
+      Node const& node = mNodes[stackNode[top]];
+      Real t = stackT[top];
+      top--;
+
+      // Skip nodes entered beyond the furthest result.
+      Real limit = (results == maxResults) ? outT[results - 1] : maxT;
+      if (t > limit) continue;
+
+      Real laneT[bvhWidth];
+      unsigned int mask = rayMask(node, ray, (Real)0, limit, laneT) &
+         usedMask(node);
+
+      // Items go straight into the results, nodes in order of entry.
+      unsigned int hitNode[bvhWidth];
+      Real hitT[bvhWidth];
+      unsigned int hits = 0;
+      while (mask) {
+         unsigned int n = __builtin_ctz(mask);
+         mask &= mask - 1;
+         unsigned int child = node.mChild[n];
+         if (child & bvhItem) {
+            rayInsert(outResults, outT, results, maxResults,
+               mIds[child & ~bvhItem], laneT[n], true);
+            continue;
+         }
+
+         unsigned int at = hits++;
+         while (at > 0 && hitT[at - 1] < laneT[n]) {
+            hitNode[at] = hitNode[at - 1];
+            hitT[at] = hitT[at - 1];
+            at--;
+         }
+         hitNode[at] = child;
+         hitT[at] = laneT[n];
+      }
+
+      for (unsigned int h = 0; h < hits; ++h) {
+         top++;
+         stackNode[top] = hitNode[h];
+         stackT[top] = hitT[h];
+      }
+   }
+
+   // Done.
+   return results;
+}
@@ -26,6 +26,13 @@ Purpose: Octree sampler.
 
 Version control
 22 Mar 2019 Duncan Camilleri           Added copyright notice
+18 Oct 2026 Duncan Camilleri           Box and sphere queries
+18 Oct 2026 Duncan Camilleri           Nearest items
+18 Oct 2026 Duncan Camilleri           Moving and removing items
+18 Oct 2026 Duncan Camilleri           Rays
+18 Oct 2026 Duncan Camilleri           Overlapping pairs
+18 Oct 2026 Duncan Camilleri           Statistics
+18 Oct 2026 Duncan Camilleri           Query hints
 */
 
 #include <assert.h>
@@ -39,6 +46,12 @@ Version control
 
 using namespace std;
 
+// Prints a pair of overlapping items.
+static void printPair(int idA, int idB, void*)
+{
+   printf("\t%d - %d\n", idA, idB);
+}
+
 int main(int argc, char** argv)
 {
    // some very quick tests.
@@ -104,5 +117,83 @@ int main(int argc, char** argv)
    for (int n = 0; n < intersect; ++n)
       printf("\t%d\n", results[n]);
 
+   // Ranges..
+   aabb box;
+   printf("Overlaps box 0, 0, 0 - 3, 3, 3\n");
+   box.min.x = 0; box.min.y = 0; box.min.z = 0;
+   box.max.x = 3; box.max.y = 3; box.max.z = 3;
+   intersect = o.QueryBox(box, results, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d\n", results[n]);
+
+   printf("Within 1.5 of 9, 9, 9\n");
+   pt.x = 9; pt.y = 9; pt.z = 9;
+   intersect = o.QuerySphere(pt, 1.5, results, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d\n", results[n]);
+
+   printf("Within 2 of 9, 9, 9\n");
+   intersect = o.QuerySphere(pt, 2, results, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d\n", results[n]);
+
+   // Nearest..
+   float distances[3];
+   printf("Nearest 3 to 9, 9, 9\n");
+   intersect = o.QueryKNN(pt, 3, results, distances);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d (%f)\n", results[n], distances[n]);
+
+   // Collisions..
+   printf("Overlapping pairs\n");
+   o.ForEachOverlappingPair(printPair, nullptr);
+
+   // Moving and removing..
+   printf("Bob moved to 6, 6, 6 - 7, 7, 7 and alice removed\n");
+   bob.mBounds.min.x = 6;
+   bob.mBounds.min.y = 6;
+   bob.mBounds.min.z = 6;
+   bob.mBounds.max.x = 7;
+   bob.mBounds.max.y = 7;
+   bob.mBounds.max.z = 7;
+   o.Update(bob.mId, bob.mBounds);
+   o.Remove(alice.mId);
+
+   printf("Intersects at 6.5, 6.5, 6.5\n");
+   pt.x = 6.5; pt.y = 6.5; pt.z = 6.5;
+   intersect = o.Query(pt, results, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d\n", results[n]);
+
+   printf("Intersects at 3, 3, 3\n");
+   pt.x = 3; pt.y = 3; pt.z = 3;
+   intersect = o.Query(pt, results, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d\n", results[n]);
+
+   // Rays..
+   Point dir;
+   printf("Ray from 0, 0, 0 along 1, 1, 1\n");
+   pt.x = 0; pt.y = 0; pt.z = 0;
+   dir.x = 1; dir.y = 1; dir.z = 1;
+   intersect = o.RayCast(pt, dir, 10, results, distances, 3);
+   for (int n = 0; n < intersect; ++n)
+      printf("\t%d (%f)\n", results[n], distances[n]);
+
+   // Query hints..
+   printf("Walking from 3, 3, 3 to 6.5, 6.5, 6.5 with a hint\n");
+   Octree::Hint hint;
+   memset(&hint, 0, sizeof(hint));
+   for (int step = 0; step <= 7; ++step) {
+      pt.x = pt.y = pt.z = 3 + step * 0.5f;
+      intersect = o.Query(pt, results, 3, hint);
+      printf("\t%.1f:", pt.x);
+      for (int n = 0; n < intersect; ++n) printf(" %d", results[n]);
+      printf("\n");
+   }
+
+   // Statistics..
+   o.printStats();
+
    return 0;
 }
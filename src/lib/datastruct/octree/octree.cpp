@@ -26,462 +26,3799 @@ Purpose: A 3D octagonal tree for collision detection and more.
 
 Version control
 22 Mar 2019 Duncan Camilleri           Added copyright notice
+18 Oct 2026 Duncan Camilleri           Linear (flat array) octree
+18 Oct 2026 Duncan Camilleri           Parallel bulk Build()
+18 Oct 2026 Duncan Camilleri           QueryBox() and QuerySphere()
+18 Oct 2026 Duncan Camilleri           QueryKNN()
+18 Oct 2026 Duncan Camilleri           QueryBatch() and SIMD item tests
+18 Oct 2026 Duncan Camilleri           Freeze() and ParallelQuery()
+18 Oct 2026 Duncan Camilleri           Remove() and Update()
+18 Oct 2026 Duncan Camilleri           Memory kept between builds
+18 Oct 2026 Duncan Camilleri           Split policy
+18 Oct 2026 Duncan Camilleri           Loose octree
+18 Oct 2026 Duncan Camilleri           RayCast()
+18 Oct 2026 Duncan Camilleri           ForEachOverlappingPair()
+18 Oct 2026 Duncan Camilleri           Save() and Map()
+18 Oct 2026 Duncan Camilleri           SIMD item overlap test
+18 Oct 2026 Duncan Camilleri           Templated coordinate and payload types
+18 Oct 2026 Duncan Camilleri           Quadtree (2D) from the same template
+18 Oct 2026 Duncan Camilleri           Statistics and query counters
+18 Oct 2026 Duncan Camilleri           Helpers shared with the BVH in spatial.h
+18 Oct 2026 Duncan Camilleri           Query hints for coherent queries
+18 Oct 2026 Duncan Camilleri           Loose octree pairs in one walk down
+18 Oct 2026 Duncan Camilleri           Small trees QueryBatch() point by point
+18 Oct 2026 Duncan Camilleri           Default policy bounds copies of items
 */
 
 #include <assert.h>
 #include <stdio.h>
 #include <memory.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <string>
 #include <vector>
-#include <cfloat>
+#include <cmath>
+#include <limits>
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
+#include <thread>
+#include <algorithm>
 
 #include "datastruct/octree.h"
+#include "spatial.h"
 
 using namespace std;
 
-Octree::Octree()
+// Coordinate and payload types compiled in, for octrees and quadtrees.
+template class OctreeT<float, int>;
+template class OctreeT<float, long long>;
+template class OctreeT<float, void*>;
+template class OctreeT<double, int>;
+template class OctreeT<double, long long>;
+template class OctreeT<double, void*>;
+template class OctreeT<int, int>;
+template class OctreeT<int, long long>;
+template class OctreeT<int, void*>;
+template class OctreeT<float, int, 2>;
+template class OctreeT<float, long long, 2>;
+template class OctreeT<float, void*, 2>;
+template class OctreeT<double, int, 2>;
+template class OctreeT<double, long long, 2>;
+template class OctreeT<double, void*, 2>;
+template class OctreeT<int, int, 2>;
+template class OctreeT<int, long long, 2>;
+template class OctreeT<int, void*, 2>;
+
+//
+// BUILD BUFFERS
+//
+
+// A range of sorted Morton codes which a node of the tree covers.
+struct BuildRange
+{
+   unsigned int mNode;
+   unsigned int mLevel;
+   size_t mBegin;
+   size_t mEnd;
+};
+
+// Buffers used by Build(). They are kept from one build to the next so that
+// rebuilding a tree of about the same size does not allocate memory.
+struct OctreeScratch
+{
+   vector<unsigned int> mCodes;     // Morton codes of the items
+   vector<unsigned int> mOrder;     // items in code order
+   vector<unsigned int> mTmpKeys;   // radix sort buffers
+   vector<unsigned int> mTmpVals;
+   vector<size_t> mHist;
+   vector<BuildRange> mQueue;       // nodes to split
+   vector<BuildRange> mRuns;        // items of each leaf
+   vector<vector<unsigned int> > mLeaves; // (leaf, item) pairs per thread
+   vector<vector<unsigned int> > mItems;
+   vector<unsigned int> mKeys;      // all pairs
+   vector<unsigned int> mVals;
+};
+
+// A node of a loose octree and its level (see forEachLoosePair()).
+struct OctreePairNode
+{
+   unsigned int mNode;
+   unsigned int mLevel;
+};
+
+// Buffers of each thread of ForEachOverlappingPair() in a loose octree: the
+// pair nodes of the nodes on the way down and the candidates for those of
+// their children (one list for each level), and the nodes (and bounds)
+// whose items the items of a node are tested against. mpHeld and mpBelow
+// are shared by all threads (see getPairBounds()).
+template <typename Scalar, unsigned int Dim>
+struct OctreePairWork
+{
+   vector<vector<OctreePairNode> > mNear;
+   vector<vector<OctreePairNode> > mCandidates;
+   vector<unsigned int> mOthers;
+   vector<aabbT<Scalar, Dim> > mReaches;
+   aabbT<Scalar, Dim> const* mpHeld;
+   aabbT<Scalar, Dim> const* mpBelow;
+};
+
+// Nodes of a loose octree walked a level at a time by each thread before
+// ForEachOverlappingPair() hands each thread whole branches.
+static const unsigned int gPairTasksPerThread = 8;
+
+//
+// FILES
+//
+
+// Start of a file written by Save(). The nodes and blocks follow at the
+// offsets given, each on a 64 byte boundary, exactly as they are in memory.
+// Files written on a machine of another byte order (or with other node or
+// block layouts) do not match the magic number or sizes and are refused, as
+// are those of octrees of other coordinate or payload types.
+struct OctreeFileHeader
+{
+   unsigned int mMagic;             // gOctreeMagic
+   unsigned int mVersion;           // gOctreeVersion
+   unsigned int mNodeSize;          // sizeof(OctreeNode)
+   unsigned int mBlockSize;         // sizeof(OctreeBlock)
+   unsigned int mNodeCount;
+   unsigned int mBlockCount;
+   unsigned int mFreeNode;          // first of unused sibling nodes
+   unsigned int mTypes;             // fileTypes()
+   unsigned long long mNodeOffset;  // from the start of the file
+   unsigned long long mBlockOffset;
+   double mBounds[6];               // min x, y, z and max x, y, z (or
+                                    // x, y and x, y in 2D)
+   OctreePolicy mPolicy;
+};
+
+static const unsigned int gOctreeMagic = 0x3145524f;    // "ORE1"
+static const unsigned int gOctreeVersion = 2;
+
+// Tells the coordinate and payload types of an octree apart: the size of
+// each, whether coordinates are whole numbers and the number of axes.
+template <typename Scalar, typename Payload, unsigned int Dim>
+static unsigned int fileTypes()
+{
+   unsigned int types = (unsigned int)sizeof(Scalar);
+   if (numeric_limits<Scalar>::is_integer) types |= 0x100;
+   types |= Dim << 24;
+   return types | ((unsigned int)sizeof(Payload) << 16);
+}
+
+// Rounds offset up to the next 64 byte boundary.
+static size_t fileAlign(size_t offset)
+{
+   return (offset + 63) & ~(size_t)63;
+}
+
+//
+// COUNTERS
+//
+
+// The nodes looked at and items tested by the query running on this thread.
+// Queries only count when built with OCTREE_COUNTERS; otherwise the tally
+// compiles to nothing.
+#if defined OCTREE_COUNTERS
+struct OctreeTally
+{
+   unsigned long long mNodes;
+   unsigned long long mItems;
+};
+
+static thread_local OctreeTally gTally;
+#define OCTREE_TALLY_NODES(n) (gTally.mNodes += (n))
+#define OCTREE_TALLY_ITEMS(n) (gTally.mItems += (n))
+#else
+#define OCTREE_TALLY_NODES(n) ((void)0)
+#define OCTREE_TALLY_ITEMS(n) ((void)0)
+#endif
+
+// Adds the tally of this thread (and queries) to counters when it goes out
+// of scope, however the query returns. Threads share counters so the adds
+// are atomic.
+class QueryTally
+{
+public:
+#if defined OCTREE_COUNTERS
+   QueryTally(OctreeCounters& counters, unsigned long long queries)
+      : mCounters(counters), mQueries(queries)
+   {
+      gTally.mNodes = 0;
+      gTally.mItems = 0;
+   }
+
+   ~QueryTally()
+   {
+      __atomic_fetch_add(&mCounters.mQueries, mQueries, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&mCounters.mNodes, gTally.mNodes, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&mCounters.mItems, gTally.mItems, __ATOMIC_RELAXED);
+   }
+
+private:
+   OctreeCounters& mCounters;
+   unsigned long long mQueries;
+#else
+   QueryTally(OctreeCounters&, unsigned long long) {}
+#endif
+};
+
+// Bytes held by a vector, used or not.
+template <typename T>
+static size_t vectorBytes(vector<T> const& v)
+{
+   return v.capacity() * sizeof(T);
+}
+
+//
+// HINTS
+//
+
+// Layouts handed out so far. Every layout of every octree is numbered apart
+// so a hint cannot match a tree it was not filled by, even one made later
+// at the same address. Trees on many threads take numbers at once.
+static unsigned int gLayouts = 0;
+
+static unsigned int newLayout()
+{
+   return __atomic_add_fetch(&gLayouts, 1, __ATOMIC_RELAXED);
+}
+
+//
+// NEAREST ITEMS
+//
+
+// Results of QueryKNN are kept as a max heap of squared distances (with the
+// ids alongside) so the furthest of the k nearest found so far is always at
+// the top and can be replaced in O(log k).
+
+// Moves entry n of the heap up to its place.
+template <typename Payload, typename Real>
+static void knnSiftUp(Payload* pIds, Real* pDist, int n)
+{
+   while (n > 0) {
+      int parent = (n - 1) / 2;
+      if (pDist[parent] >= pDist[n]) break;
+      swap(pDist[parent], pDist[n]);
+      swap(pIds[parent], pIds[n]);
+      n = parent;
+   }
+}
+
+// Moves entry n of a heap of count entries down to its place.
+template <typename Payload, typename Real>
+static void knnSiftDown(Payload* pIds, Real* pDist, int n, int count)
+{
+   for (;;) {
+      int largest = n;
+      int left = 2 * n + 1;
+      int right = left + 1;
+      if (left < count && pDist[left] > pDist[largest]) largest = left;
+      if (right < count && pDist[right] > pDist[largest]) largest = right;
+      if (largest == n) break;
+      swap(pDist[largest], pDist[n]);
+      swap(pIds[largest], pIds[n]);
+      n = largest;
+   }
+}
+
+//
+// COORDINATES
+//
+
+// Prints the extent of ab along each axis (" - x: lo - hi, y: lo - hi...").
+template <typename Scalar, unsigned int Dim>
+static void printAxes(aabbT<Scalar, Dim> const& ab)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      ::printf("%s%c: %f - %f", a ? ", " : " - ", "xyz"[a],
+         (double)coord(ab.min, a), (double)coord(ab.max, a));
+   }
+}
+
+//
+// ITEM TESTS
+//
+
+// Each test below has a version for any coordinate type, testing the items
+// of a block one at a time, and SIMD versions for float, double and int
+// coordinates. Being more specialized, the SIMD versions are picked whenever
+// they apply. All of them loop over the Dim axes of the tree, a loop the
+// compiler unrolls, so a quadtree tests two axes where an octree tests three.
+
+// Returns a mask with bit n set when item n of block b holds (or touches)
+// pt.
+template <typename Scalar, typename Payload, unsigned int Dim>
+static inline unsigned int pointMask(
+   OctreeBlock<Scalar, Payload, Dim> const& b, PointT<Scalar, Dim> const& pt)
+{
+   const Scalar* p = &pt.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; ++n) {
+      bool in = true;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         if (p[a] < b.mMin[a][n] || p[a] > b.mMax[a][n]) in = false;
+      }
+      if (in) mask |= 1u << n;
+   }
+   return mask;
+}
+
+// Returns a mask with bit n set when item n of block b overlaps (or
+// touches) box.
+template <typename Scalar, typename Payload, unsigned int Dim>
+static inline unsigned int boxMask(
+   OctreeBlock<Scalar, Payload, Dim> const& b, aabbT<Scalar, Dim> const& box)
+{
+   const Scalar* pLo = &box.min.x;
+   const Scalar* pHi = &box.max.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; ++n) {
+      bool in = true;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         if (b.mMin[a][n] > pHi[a] || pLo[a] > b.mMax[a][n]) in = false;
+      }
+      if (in) mask |= 1u << n;
+   }
+   return mask;
+}
+
+#if defined __SSE2__
+// Floats: all 8 items are tested at once with AVX or as two halves with SSE.
+template <typename Payload, unsigned int Dim>
+static inline unsigned int pointMask(OctreeBlock<float, Payload, Dim> const& b,
+   PointT<float, Dim> const& pt)
+{
+   const float* p = &pt.x;
+#if defined __AVX__
+   __m256 in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m256 v = _mm256_set1_ps(p[a]);
+      in = _mm256_and_ps(in, _mm256_and_ps(
+         _mm256_cmp_ps(_mm256_loadu_ps(b.mMin[a]), v, _CMP_LE_OQ),
+         _mm256_cmp_ps(v, _mm256_loadu_ps(b.mMax[a]), _CMP_LE_OQ)));
+   }
+   return (unsigned int)_mm256_movemask_ps(in);
+#else
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128 v = _mm_set1_ps(p[a]);
+         in = _mm_and_ps(in, _mm_and_ps(
+            _mm_cmple_ps(_mm_loadu_ps(b.mMin[a] + n), v),
+            _mm_cmple_ps(v, _mm_loadu_ps(b.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_ps(in) << n;
+   }
+   return mask;
+#endif
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int boxMask(OctreeBlock<float, Payload, Dim> const& b,
+   aabbT<float, Dim> const& box)
+{
+   const float* pLo = &box.min.x;
+   const float* pHi = &box.max.x;
+#if defined __AVX__
+   __m256 in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      in = _mm256_and_ps(in, _mm256_and_ps(
+         _mm256_cmp_ps(_mm256_loadu_ps(b.mMin[a]), _mm256_set1_ps(pHi[a]),
+            _CMP_LE_OQ),
+         _mm256_cmp_ps(_mm256_set1_ps(pLo[a]), _mm256_loadu_ps(b.mMax[a]),
+            _CMP_LE_OQ)));
+   }
+   return (unsigned int)_mm256_movemask_ps(in);
+#else
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         in = _mm_and_ps(in, _mm_and_ps(
+            _mm_cmple_ps(_mm_loadu_ps(b.mMin[a] + n), _mm_set1_ps(pHi[a])),
+            _mm_cmple_ps(_mm_set1_ps(pLo[a]), _mm_loadu_ps(b.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_ps(in) << n;
+   }
+   return mask;
+#endif
+}
+
+// Doubles: as two halves with AVX or four quarters with SSE2.
+template <typename Payload, unsigned int Dim>
+static inline unsigned int pointMask(
+   OctreeBlock<double, Payload, Dim> const& b, PointT<double, Dim> const& pt)
+{
+   const double* p = &pt.x;
+   unsigned int mask = 0;
+#if defined __AVX__
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m256d v = _mm256_set1_pd(p[a]);
+         in = _mm256_and_pd(in, _mm256_and_pd(
+            _mm256_cmp_pd(_mm256_loadu_pd(b.mMin[a] + n), v, _CMP_LE_OQ),
+            _mm256_cmp_pd(v, _mm256_loadu_pd(b.mMax[a] + n), _CMP_LE_OQ)));
+      }
+      mask |= (unsigned int)_mm256_movemask_pd(in) << n;
+   }
+#else
+   for (unsigned int n = 0; n < octreeBlockItems; n += 2) {
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128d v = _mm_set1_pd(p[a]);
+         in = _mm_and_pd(in, _mm_and_pd(
+            _mm_cmple_pd(_mm_loadu_pd(b.mMin[a] + n), v),
+            _mm_cmple_pd(v, _mm_loadu_pd(b.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_pd(in) << n;
+   }
+#endif
+   return mask;
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int boxMask(
+   OctreeBlock<double, Payload, Dim> const& b, aabbT<double, Dim> const& box)
+{
+   const double* pLo = &box.min.x;
+   const double* pHi = &box.max.x;
+   unsigned int mask = 0;
+#if defined __AVX__
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         in = _mm256_and_pd(in, _mm256_and_pd(
+            _mm256_cmp_pd(_mm256_loadu_pd(b.mMin[a] + n),
+               _mm256_set1_pd(pHi[a]), _CMP_LE_OQ),
+            _mm256_cmp_pd(_mm256_set1_pd(pLo[a]),
+               _mm256_loadu_pd(b.mMax[a] + n), _CMP_LE_OQ)));
+      }
+      mask |= (unsigned int)_mm256_movemask_pd(in) << n;
+   }
+#else
+   for (unsigned int n = 0; n < octreeBlockItems; n += 2) {
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         in = _mm_and_pd(in, _mm_and_pd(
+            _mm_cmple_pd(_mm_loadu_pd(b.mMin[a] + n), _mm_set1_pd(pHi[a])),
+            _mm_cmple_pd(_mm_set1_pd(pLo[a]), _mm_loadu_pd(b.mMax[a] + n))));
+      }
+      mask |= (unsigned int)_mm_movemask_pd(in) << n;
+   }
+#endif
+   return mask;
+}
+
+// Fixed point: all 8 items at once with AVX2 or as two halves with SSE2.
+// There is no 'less or equal' for integers so an item is out when any of
+// the 'greater than' tests holds.
+#if defined __AVX2__
+static inline __m256i loadInts(const int* p)
+{
+   return _mm256_loadu_si256((const __m256i*)p);
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int pointMask(OctreeBlock<int, Payload, Dim> const& b,
+   PointT<int, Dim> const& pt)
+{
+   const int* p = &pt.x;
+   __m256i out = _mm256_setzero_si256();
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m256i v = _mm256_set1_epi32(p[a]);
+      out = _mm256_or_si256(out, _mm256_or_si256(
+         _mm256_cmpgt_epi32(loadInts(b.mMin[a]), v),
+         _mm256_cmpgt_epi32(v, loadInts(b.mMax[a]))));
+   }
+   return ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xff;
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int boxMask(OctreeBlock<int, Payload, Dim> const& b,
+   aabbT<int, Dim> const& box)
+{
+   const int* pLo = &box.min.x;
+   const int* pHi = &box.max.x;
+   __m256i out = _mm256_setzero_si256();
+   for (unsigned int a = 0; a < Dim; ++a) {
+      out = _mm256_or_si256(out, _mm256_or_si256(
+         _mm256_cmpgt_epi32(loadInts(b.mMin[a]), _mm256_set1_epi32(pHi[a])),
+         _mm256_cmpgt_epi32(_mm256_set1_epi32(pLo[a]), loadInts(b.mMax[a]))));
+   }
+   return ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xff;
+}
+#else
+static inline __m128i loadInts(const int* p)
+{
+   return _mm_loadu_si128((const __m128i*)p);
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int pointMask(OctreeBlock<int, Payload, Dim> const& b,
+   PointT<int, Dim> const& pt)
+{
+   const int* p = &pt.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m128i out = _mm_setzero_si128();
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128i v = _mm_set1_epi32(p[a]);
+         out = _mm_or_si128(out, _mm_or_si128(
+            _mm_cmpgt_epi32(loadInts(b.mMin[a] + n), v),
+            _mm_cmpgt_epi32(v, loadInts(b.mMax[a] + n))));
+      }
+      mask |= (~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xf)
+         << n;
+   }
+   return mask;
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int boxMask(OctreeBlock<int, Payload, Dim> const& b,
+   aabbT<int, Dim> const& box)
+{
+   const int* pLo = &box.min.x;
+   const int* pHi = &box.max.x;
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m128i out = _mm_setzero_si128();
+      for (unsigned int a = 0; a < Dim; ++a) {
+         out = _mm_or_si128(out, _mm_or_si128(
+            _mm_cmpgt_epi32(loadInts(b.mMin[a] + n), _mm_set1_epi32(pHi[a])),
+            _mm_cmpgt_epi32(_mm_set1_epi32(pLo[a]), loadInts(b.mMax[a] + n))));
+      }
+      mask |= (~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xf)
+         << n;
+   }
+   return mask;
+}
+#endif
+#endif
+
+// Returns true if a and b overlap (touching counts).
+// Separating axis test: the boxes overlap unless they are apart along some
+// axis, that is unless the larger of the two minimums is beyond the smaller
+// of the two maximums.
+template <typename Scalar, unsigned int Dim>
+static inline bool isOverlapping(aabbT<Scalar, Dim> const& a,
+   aabbT<Scalar, Dim> const& b)
+{
+   const Scalar* pMinA = &a.min.x;
+   const Scalar* pMaxA = &a.max.x;
+   const Scalar* pMinB = &b.min.x;
+   const Scalar* pMaxB = &b.max.x;
+   for (unsigned int n = 0; n < Dim; ++n) {
+      if (!(max(pMinA[n], pMinB[n]) <= min(pMaxA[n], pMaxB[n]))) {
+         return false;
+      }
+   }
+   return true;
+}
+
+#if defined __SSE2__
+// With SSE all three axes of an octree are tested at once without
+// branching. The six coordinates of an aabb are loaded as min.x to max.x
+// and min.z to max.z (never reading past the aabb) and the spare lanes
+// ignored.
+static inline bool isOverlapping(aabbT<float> const& a, aabbT<float> const& b)
+{
+   __m128 aMin = _mm_loadu_ps(&a.min.x);
+   __m128 bMin = _mm_loadu_ps(&b.min.x);
+   __m128 aMax = _mm_loadu_ps(&a.min.z);
+   __m128 bMax = _mm_loadu_ps(&b.min.z);
+   aMax = _mm_shuffle_ps(aMax, aMax, _MM_SHUFFLE(3, 3, 2, 1));
+   bMax = _mm_shuffle_ps(bMax, bMax, _MM_SHUFFLE(3, 3, 2, 1));
+   __m128 lo = _mm_max_ps(aMin, bMin);
+   __m128 hi = _mm_min_ps(aMax, bMax);
+   return (_mm_movemask_ps(_mm_cmple_ps(lo, hi)) & 7) == 7;
+}
+
+// Fixed point: apart along an axis when either minimum is beyond the other
+// maximum.
+static inline bool isOverlapping(aabbT<int> const& a, aabbT<int> const& b)
+{
+   __m128i aMin = _mm_loadu_si128((const __m128i*)&a.min.x);
+   __m128i bMin = _mm_loadu_si128((const __m128i*)&b.min.x);
+   __m128i aMax = _mm_loadu_si128((const __m128i*)&a.min.z);
+   __m128i bMax = _mm_loadu_si128((const __m128i*)&b.min.z);
+   aMax = _mm_shuffle_epi32(aMax, _MM_SHUFFLE(3, 3, 2, 1));
+   bMax = _mm_shuffle_epi32(bMax, _MM_SHUFFLE(3, 3, 2, 1));
+   __m128i apart = _mm_or_si128(_mm_cmpgt_epi32(aMin, bMax),
+      _mm_cmpgt_epi32(bMin, aMax));
+   return (_mm_movemask_ps(_mm_castsi128_ps(apart)) & 7) == 0;
+}
+#endif
+
+//
+// RAYS
+//
+
+// Returns a mask with bit n set when the ray hits item n of block b between
+// tMin and tMax and writes where it enters each item to pT (an array of 8).
+// This is the slab test of rayBounds() done for each item in turn.
+template <typename Scalar, typename Payload, unsigned int Dim, typename Real>
+static inline unsigned int rayMask(OctreeBlock<Scalar, Payload, Dim> const& b,
+   OctreeRay<Real, Dim> const& ray, Real tMin, Real tMax, Real* pT)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; ++n) {
+      aabbT<Scalar, Dim> ab;
+      for (unsigned int a = 0; a < Dim; ++a) {
+         (&ab.min.x)[a] = b.mMin[a][n];
+         (&ab.max.x)[a] = b.mMax[a][n];
+      }
+      pT[n] = tMin;
+      Real tExit = tMax;
+      if (rayBounds(ab, ray, pT[n], tExit)) mask |= 1u << n;
+   }
+   return mask;
+}
+
+#if defined __SSE2__
+// Floats: all 8 items at once with AVX or as two halves with SSE.
+template <typename Payload, unsigned int Dim>
+static inline unsigned int rayMask(OctreeBlock<float, Payload, Dim> const& b,
+   OctreeRay<float, Dim> const& ray, float tMin, float tMax, float* pT)
+{
+#if defined __AVX__
+   __m256 enter = _mm256_set1_ps(tMin);
+   __m256 exit = _mm256_set1_ps(tMax);
+   __m256 in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+   for (unsigned int a = 0; a < Dim; ++a) {
+      const __m256 o = _mm256_set1_ps(ray.mOrigin[a]);
+      const __m256 lo = _mm256_loadu_ps(b.mMin[a]);
+      const __m256 hi = _mm256_loadu_ps(b.mMax[a]);
+      if (ray.mDir[a] == 0) {
+         in = _mm256_and_ps(in, _mm256_and_ps(
+            _mm256_cmp_ps(lo, o, _CMP_LE_OQ),
+            _mm256_cmp_ps(o, hi, _CMP_LE_OQ)));
+         continue;
+      }
+
+      const __m256 inv = _mm256_set1_ps(ray.mInv[a]);
+      __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv);
+      __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(hi, o), inv);
+      enter = _mm256_max_ps(enter, _mm256_min_ps(t1, t2));
+      exit = _mm256_min_ps(exit, _mm256_max_ps(t1, t2));
+   }
+
+   in = _mm256_and_ps(in, _mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+   _mm256_storeu_ps(pT, enter);
+   return (unsigned int)_mm256_movemask_ps(in);
+#else
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m128 enter = _mm_set1_ps(tMin);
+      __m128 exit = _mm_set1_ps(tMax);
+      __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128 o = _mm_set1_ps(ray.mOrigin[a]);
+         const __m128 lo = _mm_loadu_ps(b.mMin[a] + n);
+         const __m128 hi = _mm_loadu_ps(b.mMax[a] + n);
+         if (ray.mDir[a] == 0) {
+            in = _mm_and_ps(in, _mm_and_ps(_mm_cmple_ps(lo, o),
+               _mm_cmple_ps(o, hi)));
+            continue;
+         }
+
+         const __m128 inv = _mm_set1_ps(ray.mInv[a]);
+         __m128 t1 = _mm_mul_ps(_mm_sub_ps(lo, o), inv);
+         __m128 t2 = _mm_mul_ps(_mm_sub_ps(hi, o), inv);
+         enter = _mm_max_ps(enter, _mm_min_ps(t1, t2));
+         exit = _mm_min_ps(exit, _mm_max_ps(t1, t2));
+      }
+
+      in = _mm_and_ps(in, _mm_cmple_ps(enter, exit));
+      _mm_storeu_ps(pT + n, enter);
+      mask |= (unsigned int)_mm_movemask_ps(in) << n;
+   }
+   return mask;
+#endif
+}
+
+// Doubles and fixed point (converted to double as they are loaded): as two
+// halves with AVX or four quarters with SSE2. pMin and pMax are the mMin
+// and mMax arrays of a block.
+#if defined __AVX__
+static inline __m256d loadReals(const double* p)
+{
+   return _mm256_loadu_pd(p);
+}
+
+static inline __m256d loadReals(const int* p)
+{
+   return _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)p));
+}
+
+template <typename Scalar, unsigned int Dim>
+static inline unsigned int rayMaskReals(
+   Scalar const (*pMin)[octreeBlockItems],
+   Scalar const (*pMax)[octreeBlockItems], OctreeRay<double, Dim> const& ray,
+   double tMin, double tMax, double* pT)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 4) {
+      __m256d enter = _mm256_set1_pd(tMin);
+      __m256d exit = _mm256_set1_pd(tMax);
+      __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m256d o = _mm256_set1_pd(ray.mOrigin[a]);
+         const __m256d lo = loadReals(pMin[a] + n);
+         const __m256d hi = loadReals(pMax[a] + n);
+         if (ray.mDir[a] == 0) {
+            in = _mm256_and_pd(in, _mm256_and_pd(
+               _mm256_cmp_pd(lo, o, _CMP_LE_OQ),
+               _mm256_cmp_pd(o, hi, _CMP_LE_OQ)));
+            continue;
+         }
+
+         const __m256d inv = _mm256_set1_pd(ray.mInv[a]);
+         __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(lo, o), inv);
+         __m256d t2 = _mm256_mul_pd(_mm256_sub_pd(hi, o), inv);
+         enter = _mm256_max_pd(enter, _mm256_min_pd(t1, t2));
+         exit = _mm256_min_pd(exit, _mm256_max_pd(t1, t2));
+      }
+
+      in = _mm256_and_pd(in, _mm256_cmp_pd(enter, exit, _CMP_LE_OQ));
+      _mm256_storeu_pd(pT + n, enter);
+      mask |= (unsigned int)_mm256_movemask_pd(in) << n;
+   }
+   return mask;
+}
+#else
+static inline __m128d loadReals(const double* p)
+{
+   return _mm_loadu_pd(p);
+}
+
+static inline __m128d loadReals(const int* p)
+{
+   return _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)p));
+}
+
+template <typename Scalar, unsigned int Dim>
+static inline unsigned int rayMaskReals(
+   Scalar const (*pMin)[octreeBlockItems],
+   Scalar const (*pMax)[octreeBlockItems], OctreeRay<double, Dim> const& ray,
+   double tMin, double tMax, double* pT)
+{
+   unsigned int mask = 0;
+   for (unsigned int n = 0; n < octreeBlockItems; n += 2) {
+      __m128d enter = _mm_set1_pd(tMin);
+      __m128d exit = _mm_set1_pd(tMax);
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (unsigned int a = 0; a < Dim; ++a) {
+         const __m128d o = _mm_set1_pd(ray.mOrigin[a]);
+         const __m128d lo = loadReals(pMin[a] + n);
+         const __m128d hi = loadReals(pMax[a] + n);
+         if (ray.mDir[a] == 0) {
+            in = _mm_and_pd(in, _mm_and_pd(_mm_cmple_pd(lo, o),
+               _mm_cmple_pd(o, hi)));
+            continue;
+         }
+
+         const __m128d inv = _mm_set1_pd(ray.mInv[a]);
+         __m128d t1 = _mm_mul_pd(_mm_sub_pd(lo, o), inv);
+         __m128d t2 = _mm_mul_pd(_mm_sub_pd(hi, o), inv);
+         enter = _mm_max_pd(enter, _mm_min_pd(t1, t2));
+         exit = _mm_min_pd(exit, _mm_max_pd(t1, t2));
+      }
+
+      in = _mm_and_pd(in, _mm_cmple_pd(enter, exit));
+      _mm_storeu_pd(pT + n, enter);
+      mask |= (unsigned int)_mm_movemask_pd(in) << n;
+   }
+   return mask;
+}
+#endif
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int rayMask(OctreeBlock<double, Payload, Dim> const& b,
+   OctreeRay<double, Dim> const& ray, double tMin, double tMax, double* pT)
+{
+   return rayMaskReals(b.mMin, b.mMax, ray, tMin, tMax, pT);
+}
+
+template <typename Payload, unsigned int Dim>
+static inline unsigned int rayMask(OctreeBlock<int, Payload, Dim> const& b,
+   OctreeRay<double, Dim> const& ray, double tMin, double tMax, double* pT)
+{
+   return rayMaskReals(b.mMin, b.mMax, ray, tMin, tMax, pT);
+}
+#endif
+
+// Converts v to a coordinate. Fixed point coordinates are rounded down (or
+// up) and kept within the range of Scalar.
+template <typename Scalar, typename Real>
+static Scalar toScalar(Real v, bool up)
+{
+   if (!numeric_limits<Scalar>::is_integer) return (Scalar)v;
+
+   v = up ? ceil(v) : floor(v);
+   if (v <= (Real)numeric_limits<Scalar>::lowest()) {
+      return numeric_limits<Scalar>::lowest();
+   }
+   if (v >= (Real)numeric_limits<Scalar>::max()) {
+      return numeric_limits<Scalar>::max();
+   }
+   return (Scalar)v;
+}
+
+// Mixes the bits of id (an integer or a pointer) so that ids which follow
+// each other (or share their low bits) spread over the id table.
+template <typename Payload>
+static unsigned int idHash(Payload id)
+{
+   unsigned long long v = (unsigned long long)id;
+   unsigned int h = (unsigned int)(v ^ (v >> 32));
+   h ^= h >> 16;
+   h *= 0x45d9f3b;
+   h ^= h >> 16;
+   return h;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+OctreeT<Scalar, Payload, Dim>::OctreeT()
+{
+   mpScratch = new OctreeScratch;
+   mPolicy = octreeDefaultPolicy;
+   mIdCount = 0;
+   mFrozen = false;
+   mpMap = nullptr;
+   mMapSize = 0;
+   memset(mCounters, 0, sizeof(mCounters));
+   Reset();
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+OctreeT<Scalar, Payload, Dim>::OctreeT(aabb& bounds)
+{
+   mpScratch = new OctreeScratch;
+   mPolicy = octreeDefaultPolicy;
+   mIdCount = 0;
+   mFrozen = false;
+   mpMap = nullptr;
+   mMapSize = 0;
+   memset(mCounters, 0, sizeof(mCounters));
+   Reset();
+   memcpy(&mBounds, &bounds, sizeof(aabb));
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+OctreeT<Scalar, Payload, Dim>::OctreeT(aabb& bounds,
+   OctreePolicy const& policy)
+{
+   mpScratch = new OctreeScratch;
+   mPolicy = octreeDefaultPolicy;
+   mIdCount = 0;
+   mFrozen = false;
+   mpMap = nullptr;
+   mMapSize = 0;
+   memset(mCounters, 0, sizeof(mCounters));
+   Reset();
+   memcpy(&mBounds, &bounds, sizeof(aabb));
+   SetPolicy(policy);
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+OctreeT<Scalar, Payload, Dim>::~OctreeT()
+{
+   unmap();
+   delete mpScratch;
+}
+
+// Add an item to the octree.
+// We're adding a bounding cube to the tree which will enclose an object of id
+// 'id'. This is how it will work:
+// 1. Check if this octree is a leaf node or an intermediate node.
+// 1a.   If a leaf node, then add the item to it. Should the leaf now hold
+//          too many items cutting into it, promote the leaf node to an
+//          intermediate node, create leaf nodes and recurse add into the
+//          appropriate leaf nodes otherwise, leave it as a leaf node.
+// 2. If an intermediate node, then find out to which child nodes this object
+//    belongs to and add it to them.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Add(aabb const& bounds, Payload id)
+{
+   if (mFrozen) return false;
+
+   // Create the item first.
+   Item item;
+   item.mId = id;
+   item.mBounds = bounds;
+
+   add(0, mBounds, item, 0);
+   return true;
+}
+
+// Remove every item with id.
+// The index gives the leaves holding a copy of the item. The copy is taken
+// out of each of them and any leaf left empty is joined back into its parent
+// along with its siblings when they are all empty too.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Remove(Payload id)
+{
+   if (mFrozen) return false;
+   if (!mIndexed) buildIndex();
+
+   unsigned int slot = findId(id);
+   unsigned int ref = mIds[slot].mRef;
+   if (ref == octreeNone) return false;
+
+   eraseId(slot);
+   while (ref != octreeNone) {
+      unsigned int node = mRefs[ref].mNode;
+      unsigned int next = mRefs[ref].mNext;
+      unsigned int block;
+      unsigned int item;
+      if (findItem(node, id, block, item)) removeItem(node, block, item);
+      if (mpNodes[node].mCount == 0) collapse(node);
+
+      // Release the ref.
+      mRefs[ref].mNext = mFreeRef;
+      mFreeRef = ref;
+      ref = next;
+   }
+
+   return true;
+}
+
+// Move the items with id to bounds.
+// An item held by a single node which would still be held by that node alone
+// (without splitting it) is simply overwritten. Otherwise it is removed and
+// added again.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Update(Payload id, aabb const& bounds)
+{
+   if (mFrozen) return false;
+   if (!mIndexed) buildIndex();
+
+   unsigned int ref = mIds[findId(id)].mRef;
+   if (ref == octreeNone) return false;
+
+   if (mRefs[ref].mNext == octreeNone) {
+      unsigned int node = mRefs[ref].mNode;
+      aabb nodeBounds;
+      unsigned int level = getNodeBounds(node, nodeBounds);
+      unsigned int block;
+      unsigned int slot;
+      if (isKeptByNode(node, nodeBounds, level, bounds) &&
+         findItem(node, id, block, slot)) {
+         Item item;
+         item.mId = id;
+         item.mBounds = bounds;
+         setItem(block, slot, item);
+         return true;
+      }
+   }
+
+   Remove(id);
+   return Add(bounds, id);
+}
+
+// Bulk load of items.
+// 1. The Morton code of the centre of each item is worked out.
+// 2. Items are sorted by code (radix sort) so that the items of any node are
+//    next to each other.
+// 3. Nodes are split level by level while they hold more than
+//    octreeBuildLeafItems items, finding each child's items from the code.
+// 4. Each item is placed in every leaf it overlaps. All placements are then
+//    sorted by leaf so that the items of a leaf fill consecutive blocks.
+// Steps 1, 2 and 4 are shared across all cores.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Build(Item const* pItems, size_t count)
+{
+   // Start from an empty tree with the same bounds.
+   aabb bounds = mBounds;
+   if (!Reset()) return false;
+   mBounds = bounds;
+   if (!pItems || count == 0) return true;
+
+   // Morton codes.
+   OctreeScratch& scratch = *mpScratch;
+   vector<unsigned int>& codes = scratch.mCodes;
+   vector<unsigned int>& order = scratch.mOrder;
+   codes.resize(count);
+   order.resize(count);
+   parallelFor(count, threadCount(count),
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            aabb const& b = pItems[n].mBounds;
+            Point centre;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               (&centre.x)[a] = getHalf((&b.min.x)[a], (&b.max.x)[a]);
+            }
+            codes[n] = mortonCode(mBounds, centre);
+            order[n] = (unsigned int)n;
+         }
+      });
+
+   radixSort(codes, order, Dim * octreeMortonLevels, scratch.mTmpKeys,
+      scratch.mTmpVals, scratch.mHist);
+   buildNodes(pItems, order.data(), codes.data(), count);
+   buildLeaves(pItems, order.data(), count);
+   return true;
+}
+
+// Clear the octree.
+// Only the root node is left. All arrays keep their memory so that the
+// nodes and blocks of the next tree of a similar size are carved out of it
+// without allocating, and clearing takes the same time however big the tree
+// was. The id table is only emptied once the index is next needed.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Reset()
+{
+   if (mFrozen) return false;
+
+   memset(&mBounds, 0, sizeof(aabb));
+   mNodes.clear();
+   mBlocks.clear();
+   mFreeBlock = octreeNone;
+   mFreeNode = octreeNone;
+   mRefs.clear();
+   mFreeRef = octreeNone;
+   mIndexed = false;
+   mLayout = newLayout();
+
+   OctreeNode root;
+   root.mChild = 0;
+   root.mBlock = octreeNone;
+   root.mCount = 0;
+   root.mParent = octreeNone;
+   mNodes.push_back(root);
+   setArrays();
+   return true;
+}
+
+// Makes the octree a read only snapshot. The blocks of each leaf are copied
+// (in node order) to a new array where they follow each other so that a
+// query reads the items of a leaf in one go. Unused blocks are dropped.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::Freeze()
+{
+   if (mFrozen) return;
+
+   size_t used = 0;
+   for (size_t n = 0; n < mNodeCount; ++n) {
+      used += (mpNodes[n].mCount + octreeBlockItems - 1) / octreeBlockItems;
+   }
+
+   vector<Block> blocks;
+   blocks.reserve(used);
+   for (size_t n = 0; n < mNodeCount; ++n) {
+      unsigned int block = mpNodes[n].mBlock;
+      if (block == octreeNone) continue;
+
+      mpNodes[n].mBlock = (unsigned int)blocks.size();
+      while (block != octreeNone) {
+         blocks.push_back(mpBlocks[block]);
+         blocks.back().mNext = (unsigned int)blocks.size();
+         block = mpBlocks[block].mNext;
+      }
+
+      blocks.back().mNext = octreeNone;
+   }
+
+   mBlocks.swap(blocks);
+   mFreeBlock = octreeNone;
+   mNodes.shrink_to_fit();
+   setArrays();
+   mFrozen = true;
+}
+
+// Allows changes again. A mapped octree is first copied out of its file.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::Thaw()
+{
+   if (mpMap) {
+      mNodes.assign(mpNodes, mpNodes + mNodeCount);
+      mBlocks.assign(mpBlocks, mpBlocks + mBlockCount);
+      unmap();
+   }
+
+   mFrozen = false;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isFrozen() const
+{
+   return mFrozen;
+}
+
+// Writes the header, nodes and blocks to a temporary file which then takes
+// the place of path. Renaming leaves the old file to any process which has
+// it mapped rather than changing it under their feet. The blocks are packed
+// in node order as Freeze() packs them.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Save(const char* const path) const
+{
+   if (!path) return false;
+
+   vector<OctreeNode> nodes(mpNodes, mpNodes + mNodeCount);
+   vector<Block> blocks;
+   for (size_t n = 0; n < nodes.size(); ++n) {
+      unsigned int block = nodes[n].mBlock;
+      if (block == octreeNone) continue;
+
+      nodes[n].mBlock = (unsigned int)blocks.size();
+      while (block != octreeNone) {
+         blocks.push_back(mpBlocks[block]);
+         blocks.back().mNext = (unsigned int)blocks.size();
+         block = mpBlocks[block].mNext;
+      }
+
+      blocks.back().mNext = octreeNone;
+   }
+
+   OctreeFileHeader hdr;
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.mMagic = gOctreeMagic;
+   hdr.mVersion = gOctreeVersion;
+   hdr.mNodeSize = sizeof(OctreeNode);
+   hdr.mBlockSize = sizeof(Block);
+   hdr.mNodeCount = (unsigned int)nodes.size();
+   hdr.mBlockCount = (unsigned int)blocks.size();
+   hdr.mFreeNode = mFreeNode;
+   hdr.mTypes = fileTypes<Scalar, Payload, Dim>();
+   hdr.mNodeOffset = fileAlign(sizeof(hdr));
+   hdr.mBlockOffset = fileAlign(hdr.mNodeOffset +
+      nodes.size() * sizeof(OctreeNode));
+   const Scalar* pBounds = &mBounds.min.x;
+   for (unsigned int n = 0; n < 2 * Dim; ++n) hdr.mBounds[n] = pBounds[n];
+   memcpy(&hdr.mPolicy, &mPolicy, sizeof(OctreePolicy));
+
+   string tmp = string(path) + ".tmp";
+   FILE* pFile = fopen(tmp.c_str(), "wb");
+   if (!pFile) return false;
+
+   static const char zeros[64] = { 0 };
+   size_t nodeBytes = nodes.size() * sizeof(OctreeNode);
+   size_t blockBytes = blocks.size() * sizeof(Block);
+   bool ok = fwrite(&hdr, sizeof(hdr), 1, pFile) == 1 &&
+      fwrite(zeros, 1, hdr.mNodeOffset - sizeof(hdr), pFile) ==
+         hdr.mNodeOffset - sizeof(hdr) &&
+      fwrite(nodes.data(), 1, nodeBytes, pFile) == nodeBytes &&
+      fwrite(zeros, 1, hdr.mBlockOffset - hdr.mNodeOffset - nodeBytes,
+         pFile) == hdr.mBlockOffset - hdr.mNodeOffset - nodeBytes &&
+      fwrite(blocks.data(), 1, blockBytes, pFile) == blockBytes;
+   ok = fclose(pFile) == 0 && ok;
+   if (!ok || rename(tmp.c_str(), path) != 0) {
+      remove(tmp.c_str());
+      return false;
+   }
+
+   return true;
+}
+
+// Maps the file read only and points the nodes and blocks into it. The
+// header is checked against this build (byte order, layout, types) and the
+// file size so that queries never read past the mapping.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::Map(const char* const path)
+{
+   if (!path || (mFrozen && !mpMap)) return false;
+
+   int fd = open(path, O_RDONLY);
+   if (fd == -1) return false;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(OctreeFileHeader))
+   {
+      ::close(fd);
+      return false;
+   }
+
+   size_t size = (size_t)st.st_size;
+   void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (p == MAP_FAILED) return false;
+
+   OctreeFileHeader const& hdr = *(OctreeFileHeader const*)p;
+   bool ok = hdr.mMagic == gOctreeMagic && hdr.mVersion == gOctreeVersion &&
+      hdr.mNodeSize == sizeof(OctreeNode) &&
+      hdr.mBlockSize == sizeof(Block) &&
+      hdr.mTypes == fileTypes<Scalar, Payload, Dim>() && hdr.mNodeCount > 0 &&
+      hdr.mNodeOffset % 64 == 0 && hdr.mBlockOffset % 64 == 0 &&
+      hdr.mNodeOffset + (size_t)hdr.mNodeCount * sizeof(OctreeNode) <=
+         hdr.mBlockOffset &&
+      hdr.mBlockOffset + (size_t)hdr.mBlockCount * sizeof(Block) <=
+         size;
+   if (!ok) {
+      munmap(p, size);
+      return false;
+   }
+
+   // Drop the current contents (and any file mapped before).
+   unmap();
+   mFrozen = false;
+   Reset();
+
+   Scalar* pBounds = &mBounds.min.x;
+   for (unsigned int n = 0; n < 2 * Dim; ++n) {
+      pBounds[n] = (Scalar)hdr.mBounds[n];
+   }
+   memcpy(&mPolicy, &hdr.mPolicy, sizeof(OctreePolicy));
+   mFreeNode = hdr.mFreeNode;
+   mpMap = p;
+   mMapSize = size;
+   mpNodes = (OctreeNode*)((char*)p + hdr.mNodeOffset);
+   mpBlocks = (Block*)((char*)p + hdr.mBlockOffset);
+   mNodeCount = hdr.mNodeCount;
+   mBlockCount = hdr.mBlockCount;
+   mFrozen = true;
+   return true;
+}
+
+// Sets the split policy of an empty octree.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::SetPolicy(OctreePolicy const& policy)
+{
+   if (mFrozen) return false;
+   if (mNodeCount > 1 || mpNodes[0].mCount != 0) return false;
+
+   mPolicy = policy;
+   mPolicy.mMaxDepth = min(mPolicy.mMaxDepth, octreeMaxLevels);
+   return true;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+OctreePolicy const& OctreeT<Scalar, Payload, Dim>::GetPolicy() const
+{
+   return mPolicy;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::printf()
+{
+   printf(0, mBounds);
+}
+
+// Walks every node and item block of the tree. Items copied into many
+// leaves are counted once, by the leaf owning the lowest corner of their
+// part within the octree (as QueryBox() reports them).
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::GetStats(OctreeStats& stats) const
+{
+   memset(&stats, 0, sizeof(stats));
+
+   unsigned int stackNode[octreeStackSize];
+   unsigned int stackLevel[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackLevel[0] = 0;
+   stackBounds[0] = mBounds;
+   while (top >= 0) {
+      unsigned int node = stackNode[top];
+      unsigned int level = stackLevel[top];
+      aabb bounds = stackBounds[top];
+      top--;
+
+      unsigned int count = mpNodes[node].mCount;
+      stats.mNodes++;
+      stats.mDepth = max(stats.mDepth, level);
+      stats.mLevelNodes[level]++;
+      stats.mLevelItems[level] += count;
+      stats.mCopies += count;
+
+      if (isLeaf(node)) {
+         unsigned int bucket = 0;
+         while (bucket + 1 < octreeStatsBuckets && (count >> bucket) != 0) {
+            bucket++;
+         }
+
+         stats.mLeaves++;
+         stats.mLeafItems[bucket]++;
+         stats.mMostLeafItems = max(stats.mMostLeafItems, count);
+      } else {
+         unsigned int child = mpNodes[node].mChild;
+         for (int c = Children - 1; c >= 0; --c) {
+            top++;
+            stackNode[top] = child + c;
+            stackLevel[top] = level + 1;
+            getChildBound(bounds, c, stackBounds[top]);
+         }
+      }
+
+      unsigned int block = mpNodes[node].mBlock;
+      unsigned int inBlock = firstBlockItems(count);
+      while (block != octreeNone) {
+         Block const& b = mpBlocks[block];
+         stats.mBlocks++;
+         for (unsigned int n = 0; n < inBlock; ++n) {
+            if (isHeldOnce()) {
+               stats.mItems++;
+               continue;
+            }
+
+            Point lo;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               coord(lo, a) = max(b.mMin[a][n], coord(mBounds.min, a));
+            }
+            if (isPointOwned(lo, bounds)) stats.mItems++;
+         }
+
+         block = b.mNext;
+         inBlock = octreeBlockItems;
+      }
+   }
+
+   if (stats.mItems) stats.mDuplication = (double)stats.mCopies / stats.mItems;
+
+   // Memory.
+   OctreeScratch const& scratch = *mpScratch;
+   stats.mNodeBytes = stats.mNodes * sizeof(OctreeNode);
+   stats.mBlockBytes = stats.mBlocks * sizeof(Block);
+   stats.mIndexBytes = vectorBytes(mIds) + vectorBytes(mRefs);
+   stats.mScratchBytes = sizeof(OctreeScratch) + vectorBytes(scratch.mCodes) +
+      vectorBytes(scratch.mOrder) + vectorBytes(scratch.mTmpKeys) +
+      vectorBytes(scratch.mTmpVals) + vectorBytes(scratch.mHist) +
+      vectorBytes(scratch.mQueue) + vectorBytes(scratch.mRuns) +
+      vectorBytes(scratch.mLeaves) + vectorBytes(scratch.mItems) +
+      vectorBytes(scratch.mKeys) + vectorBytes(scratch.mVals);
+   for (size_t t = 0; t < scratch.mLeaves.size(); ++t) {
+      stats.mScratchBytes += vectorBytes(scratch.mLeaves[t]);
+   }
+   for (size_t t = 0; t < scratch.mItems.size(); ++t) {
+      stats.mScratchBytes += vectorBytes(scratch.mItems[t]);
+   }
+   stats.mMapBytes = mMapSize;
+   stats.mBytes = sizeof(*this) + vectorBytes(mNodes) + vectorBytes(mBlocks) +
+      stats.mIndexBytes + stats.mScratchBytes + stats.mMapBytes;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::printStats() const
+{
+   OctreeStats stats;
+   GetStats(stats);
+
+   const double mb = 1048576.0;
+   ::printf("%s: %zu items (%.2f copies each), %u nodes (%u leaves), "
+      "depth %u\n", (Dim == 2) ? "Quadtree" : "Octree", stats.mItems,
+      stats.mDuplication, stats.mNodes, stats.mLeaves, stats.mDepth);
+
+   for (unsigned int level = 0; level <= stats.mDepth; ++level) {
+      ::printf("   level %2u: %10u nodes %10zu items\n", level,
+         stats.mLevelNodes[level], stats.mLevelItems[level]);
+   }
+
+   ::printf("   items per leaf:");
+   for (unsigned int b = 0; b < octreeStatsBuckets; ++b) {
+      if (stats.mLeafItems[b] == 0) continue;
+      unsigned int lo = b ? 1u << (b - 1) : 0;
+      unsigned int hi = b ? (1u << b) - 1 : 0;
+      if (b + 1 == octreeStatsBuckets) {
+         ::printf(" %u+: %u", lo, stats.mLeafItems[b]);
+      } else if (hi > lo) {
+         ::printf(" %u-%u: %u", lo, hi, stats.mLeafItems[b]);
+      } else {
+         ::printf(" %u: %u", lo, stats.mLeafItems[b]);
+      }
+   }
+   ::printf(" (most %u)\n", stats.mMostLeafItems);
+
+   ::printf("   memory: %.2f MB held (nodes %.2f, blocks %.2f, index %.2f, "
+      "build %.2f, mapped %.2f)\n", stats.mBytes / mb,
+      stats.mNodeBytes / mb, stats.mBlockBytes / mb, stats.mIndexBytes / mb,
+      stats.mScratchBytes / mb, stats.mMapBytes / mb);
+
+   // Average work per query of each kind queried.
+   OctreeCounters counters[octreeQueryKinds];
+   if (!GetCounters(counters)) return;
+
+   const char* kinds[octreeQueryKinds] =
+      { "point", "box", "sphere", "knn", "ray" };
+   for (unsigned int k = 0; k < octreeQueryKinds; ++k) {
+      if (counters[k].mQueries == 0) continue;
+      double queries = (double)counters[k].mQueries;
+      ::printf("   %s: %llu queries, %.1f nodes and %.1f items each\n",
+         kinds[k], counters[k].mQueries, counters[k].mNodes / queries,
+         counters[k].mItems / queries);
+   }
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::GetCounters(
+   OctreeCounters* pCounters) const
+{
+   if (!pCounters) return false;
+
+   for (unsigned int k = 0; k < octreeQueryKinds; ++k) {
+      pCounters[k].mQueries =
+         __atomic_load_n(&mCounters[k].mQueries, __ATOMIC_RELAXED);
+      pCounters[k].mNodes =
+         __atomic_load_n(&mCounters[k].mNodes, __ATOMIC_RELAXED);
+      pCounters[k].mItems =
+         __atomic_load_n(&mCounters[k].mItems, __ATOMIC_RELAXED);
+   }
+
+#if defined OCTREE_COUNTERS
+   return true;
+#else
+   return false;
+#endif
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::ResetCounters()
+{
+   memset(mCounters, 0, sizeof(mCounters));
+}
+
+// Find up to 'maxResults' intersecting items and write them into
+// 'outResults' array. Returns the actual number of results stored.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::Query(Point const& point,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0) return 0;
+   QueryTally tally(mCounters[octreeQueryPoint], 1);
+   return queryPoint(point, outResults, maxResults);
+}
+
+// Runs Query for count points and writes the results of point n to
+// 'outResults' from outFirst[n] (outCount[n] of them). Returns the total
+// number of results stored. Once maxResults are stored, the points left get
+// no results.
+// The points of a tree bigger than the cache are queried in Morton order so
+// that points near each other are queried one after the other. Then the
+// nodes (and items) they need are already in the cache and often a point
+// falls in the same leaf as the one before it, which saves walking down the
+// tree at all. A smaller tree stays in the cache anyway and its points are
+// queried in the order given.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::QueryBatch(Point const* pPoints, int count,
+   Payload* outResults, int maxResults, int* outFirst, int* outCount) const
+{
+   // Validate parameters.
+   if (!pPoints || count <= 0) return 0;
+   if (!outResults || maxResults < 0 || !outFirst || !outCount) return 0;
+   QueryTally tally(mCounters[octreeQueryPoint], count);
+
+   if (!isBatchSorted()) {
+      int results = 0;
+      for (int n = 0; n < count; ++n) {
+         outFirst[n] = results;
+         outCount[n] = queryPoint(pPoints[n], outResults + results,
+            maxResults - results);
+         results += outCount[n];
+      }
+      return results;
+   }
+
+   vector<unsigned int> codes(count);
+   vector<unsigned int> order(count);
+   for (int n = 0; n < count; ++n) {
+      codes[n] = mortonCode(mBounds, pPoints[n]);
+      order[n] = (unsigned int)n;
+   }
+   radixSort(codes, order, Dim * octreeMortonLevels);
+
+   int results = 0;
+   unsigned int leaf = octreeNone;
+   aabb bounds;
+   for (int q = 0; q < count; ++q) {
+      int n = (int)order[q];
+      Point const& point = pPoints[n];
+      outFirst[n] = results;
+      outCount[n] = 0;
+      if (!isPointInBounds(point, mBounds)) continue;
+
+      if (isLoose()) {
+         outCount[n] = queryLoose(point, outResults + results,
+            maxResults - results);
+         results += outCount[n];
+         continue;
+      }
+
+      if (leaf == octreeNone || !isPointOwned(point, bounds)) {
+         leaf = findLeaf(point, bounds);
+      }
+
+      outCount[n] = queryPath(leaf, point, outResults + results,
+         maxResults - results);
+      results += outCount[n];
+   }
+
+   return results;
+}
+
+// As QueryBatch but with the points (in the order QueryBatch takes them) split
+// into one run per thread. Each thread keeps its results in a buffer of its
+// own with outFirst relative to that buffer. Once all are done the buffers
+// are copied one after the other into 'outResults' and outFirst is moved
+// accordingly.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::ParallelQuery(Point const* pPoints,
+   int count, Payload* outResults, int maxResults, int* outFirst,
+   int* outCount) const
+{
+   // Validate parameters.
+   if (!pPoints || count <= 0) return 0;
+   if (!outResults || maxResults < 0 || !outFirst || !outCount) return 0;
+
+   // Small trees keep the points in the order given, as QueryBatch does.
+   unsigned int threads = threadCount(count);
+   bool sorted = isBatchSorted();
+   vector<unsigned int> codes(sorted ? count : 0);
+   vector<unsigned int> order(count);
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t n = begin; n < end; ++n) {
+            if (sorted) codes[n] = mortonCode(mBounds, pPoints[n]);
+            order[n] = (unsigned int)n;
+         }
+      });
+   if (sorted) radixSort(codes, order, Dim * octreeMortonLevels);
+
+   // Query.
+   vector<vector<Payload> > found(threads);
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int t) {
+         QueryTally tally(mCounters[octreeQueryPoint], end - begin);
+         vector<Payload>& results = found[t];
+         unsigned int leaf = octreeNone;
+         aabb bounds;
+         for (size_t q = begin; q < end; ++q) {
+            int n = (int)order[q];
+            Point const& point = pPoints[n];
+            outFirst[n] = (int)results.size();
+            outCount[n] = 0;
+            if (!isPointInBounds(point, mBounds)) continue;
+
+            // The nodes around point in a loose octree may hold any number
+            // of items so the room is doubled until they all fit.
+            if (isLoose()) {
+               size_t at = results.size();
+               int room = 64;
+               for (;;) {
+                  results.resize(at + room);
+                  outCount[n] = queryLoose(point, results.data() + at, room);
+                  if (outCount[n] < room) break;
+                  room *= 2;
+               }
+               results.resize(at + outCount[n]);
+               continue;
+            }
+
+            if (leaf == octreeNone || !isPointOwned(point, bounds)) {
+               leaf = findLeaf(point, bounds);
+            }
+
+            // Room for every item which may hold point.
+            unsigned int room = getPathItems(leaf);
+            size_t at = results.size();
+            results.resize(at + room);
+            outCount[n] = queryPath(leaf, point, results.data() + at,
+               (int)room);
+            results.resize(at + outCount[n]);
+         }
+      });
+
+   // Where the results of each thread start.
+   vector<int> base(threads);
+   size_t total = 0;
+   for (unsigned int t = 0; t < threads; ++t) {
+      base[t] = (int)min(total, (size_t)maxResults);
+      total += found[t].size();
+   }
+
+   // Join (the slices are the same as above).
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int t) {
+         size_t room = (size_t)(maxResults - base[t]);
+         size_t copy = min(found[t].size(), room);
+         if (copy) memcpy(outResults + base[t], found[t].data(),
+            copy * sizeof(Payload));
+
+         for (size_t q = begin; q < end; ++q) {
+            int n = (int)order[q];
+            int first = min(outFirst[n], (int)copy);
+            outCount[n] = min(outCount[n], (int)copy - first);
+            outFirst[n] = base[t] + first;
+         }
+      });
+
+   return (int)min(total, (size_t)maxResults);
+}
+
+// Find up to 'maxResults' items overlapping box and write them into
+// 'outResults' array. Returns the actual number of results stored.
+// Items are stored in every leaf they overlap so to report each just once,
+// an item is only reported by the leaf owning the lowest corner of the part
+// of it which lies in the box (and the octree).
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::QueryBox(aabb const& box,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0) return 0;
+
+   QueryTally tally(mCounters[octreeQueryBox], 1);
+   return queryBox(0, mBounds, box, outResults, maxResults);
+}
+
+// Finds the items held by start (with bounds startBounds) and the nodes
+// below it which overlap box. Subtrees outside the box are skipped.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryBox(unsigned int start,
+   aabb const& startBounds, aabb const& box, Payload* outResults,
+   int maxResults) const
+{
+   int results = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   int top = 0;
+   stackNode[0] = start;
+   stackBounds[0] = startBounds;
+   while (top >= 0 && results < maxResults) {
+      unsigned int node = stackNode[top];
+      aabb bounds = stackBounds[top];
+      top--;
+      OCTREE_TALLY_NODES(1);
+
+      // Prune whole subtrees outside the box.
+      aabb reach;
+      getReach(node, bounds, reach);
+      if (!isCubeOverlap(reach, box)) continue;
+
+      if (!isLeaf(node)) {
+         unsigned int child = mpNodes[node].mChild;
+         for (int c = Children - 1; c >= 0; --c) {
+            top++;
+            stackNode[top] = child + c;
+            getChildBound(bounds, c, stackBounds[top]);
+         }
+
+         // Intermediates may hold straddling items (see OctreePolicy).
+         if (mpNodes[node].mCount == 0) continue;
+      }
+
+      results += queryBoxNode(node, bounds, box, outResults + results,
+         maxResults - results);
+   }
+
+   // Done.
+   return results;
+}
+
+// Reports the items of node (with the given bounds) overlapping box. An
+// item copied into many leaves is only reported by the leaf owning the
+// lowest corner of the overlap of item, box and octree; items held once
+// are always reported.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryBoxNode(unsigned int node,
+   aabb const& bounds, aabb const& box, Payload* outResults,
+   int maxResults) const
+{
+   OCTREE_TALLY_ITEMS(mpNodes[node].mCount);
+   int results = 0;
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone && results < maxResults) {
+      Block const& b = mpBlocks[block];
+      for (unsigned int n = 0; n < inBlock && results < maxResults; ++n) {
+         // The overlap of item, box and octree.
+         Point lo;
+         bool empty = false;
+         for (unsigned int a = 0; a < Dim; ++a) {
+            coord(lo, a) = max(max(b.mMin[a][n], coord(box.min, a)),
+               coord(mBounds.min, a));
+            Scalar hi = min(min(b.mMax[a][n], coord(box.max, a)),
+               coord(mBounds.max, a));
+            if (coord(lo, a) > hi) empty = true;
+         }
+         if (empty) continue;
+
+         if (isHeldOnce() || isPointOwned(lo, bounds)) {
+            outResults[results] = b.mId[n];
+            results++;
+         }
+      }
+
+      block = b.mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   return results;
+}
+
+// Query() starting from where the last query with hint ended. The leaf of
+// point is found from the deepest node the hint remembers which owns it.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::Query(Point const& point,
+   Payload* outResults, int maxResults, Hint& hint) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0) return 0;
+   if (isLoose()) return Query(point, outResults, maxResults);
+
+   QueryTally tally(mCounters[octreeQueryPoint], 1);
+   if (!isPointInBounds(point, mBounds)) return 0;
+
+   aabb bounds;
+   unsigned int leaf = findHinted(point, point, hint, bounds);
+   return queryPath(leaf, point, outResults, maxResults);
+}
+
+// QueryBox() starting from where the last query with hint ended: the
+// deepest node owning all of the box (within the octree). Items overlapping
+// the box are held by that node and those below it, or, when straddling
+// items are kept, by the nodes above it as well.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::QueryBox(aabb const& box,
+   Payload* outResults, int maxResults, Hint& hint) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0) return 0;
+   if (isLoose()) return QueryBox(box, outResults, maxResults);
+
+   QueryTally tally(mCounters[octreeQueryBox], 1);
+
+   // The part of the box within the octree.
+   Point lo;
+   Point hi;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      coord(lo, a) = max(coord(box.min, a), coord(mBounds.min, a));
+      coord(hi, a) = min(coord(box.max, a), coord(mBounds.max, a));
+      if (coord(lo, a) > coord(hi, a)) return 0;
+   }
+
+   aabb bounds;
+   unsigned int start = findHinted(lo, hi, hint, bounds);
+   int results = queryBox(start, bounds, box, outResults, maxResults);
+   if (!mPolicy.mKeepStraddlers) return results;
+
+   // Items kept above are held once, so their nodes' bounds do not matter.
+   unsigned int node = mpNodes[start].mParent;
+   while (node != octreeNone && results < maxResults) {
+      OCTREE_TALLY_NODES(1);
+      if (mpNodes[node].mCount) {
+         results += queryBoxNode(node, bounds, box, outResults + results,
+            maxResults - results);
+      }
+
+      node = mpNodes[node].mParent;
+   }
+
+   return results;
+}
+
+// Finds the deepest node owning both lo and hi, and so every point between
+// them (for a single point, its leaf), and returns it with its bounds. The
+// walk down starts from the deepest node remembered by hint which owns
+// both, found by walking up from the node the last query ended at, or from
+// the root when there is none. The hint then remembers the new node and
+// those above it.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::findHinted(Point const& lo,
+   Point const& hi, Hint& hint, aabb& bounds) const
+{
+   // Walk up.
+   unsigned int node = 0;
+   bounds = mBounds;
+   unsigned int kept = 0;
+   aabb above[octreeHintLevels];
+   if (hint.mpTree == this && hint.mLayout == mLayout) {
+      unsigned int up = hint.mNode;
+      for (unsigned int l = 0; l < hint.mLevels && up != octreeNone; ++l) {
+         OCTREE_TALLY_NODES(1);
+         aabb const& b = hint.mBounds[l];
+         if (isPointOwned(lo, b) && isPointOwned(hi, b)) {
+            node = up;
+            bounds = b;
+            for (unsigned int k = l + 1; k < hint.mLevels; ++k) {
+               above[kept++] = hint.mBounds[k];
+            }
+            break;
+         }
+         up = mpNodes[up].mParent;
+      }
+   }
+
+   // Walk down while one child owns both, keeping the last bounds passed.
+   aabb passed[octreeHintLevels];
+   unsigned int count = 0;
+   passed[count++ % octreeHintLevels] = bounds;
+   while (!isLeaf(node)) {
+      int idx = findPos(bounds, lo);
+      if (findPos(bounds, hi) != idx) break;
+      node = mpNodes[node].mChild + idx;
+      OCTREE_TALLY_NODES(1);
+      getChildBound(bounds, idx, bounds);
+      passed[count++ % octreeHintLevels] = bounds;
+   }
+
+   // Remember the path, deepest first.
+   unsigned int levels = 0;
+   for (unsigned int n = count; n > 0 && levels < octreeHintLevels; --n) {
+      hint.mBounds[levels++] = passed[(n - 1) % octreeHintLevels];
+   }
+   for (unsigned int k = 0; k < kept && levels < octreeHintLevels; ++k) {
+      hint.mBounds[levels++] = above[k];
+   }
+   hint.mpTree = this;
+   hint.mLayout = mLayout;
+   hint.mNode = node;
+   hint.mLevels = levels;
+   return node;
+}
+
+// Find up to 'maxResults' items within radius of centre and write them into
+// 'outResults' array. Returns the actual number of results stored.
+// As with QueryBox, each item is reported by one leaf only: the one owning
+// the point of the item (within the octree) nearest to centre.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::QuerySphere(Point const& centre, Real radius,
+   Payload* outResults, int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || maxResults <= 0 || radius < 0) return 0;
+
+   const Real radiusSq = radius * radius;
+   QueryTally tally(mCounters[octreeQuerySphere], 1);
+   int results = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackBounds[0] = mBounds;
+   while (top >= 0 && results < maxResults) {
+      unsigned int node = stackNode[top];
+      aabb bounds = stackBounds[top];
+      top--;
+      OCTREE_TALLY_NODES(1);
+
+      // Prune whole subtrees out of reach.
+      aabb reach;
+      getReach(node, bounds, reach);
+      if (distanceSq(centre, reach) > radiusSq) continue;
+
+      if (!isLeaf(node)) {
+         unsigned int child = mpNodes[node].mChild;
+         for (int c = Children - 1; c >= 0; --c) {
+            top++;
+            stackNode[top] = child + c;
+            getChildBound(bounds, c, stackBounds[top]);
+         }
+
+         if (mpNodes[node].mCount == 0) continue;
+      }
+
+      OCTREE_TALLY_ITEMS(mpNodes[node].mCount);
+      unsigned int block = mpNodes[node].mBlock;
+      unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+      while (block != octreeNone && results < maxResults) {
+         Block const& b = mpBlocks[block];
+         for (unsigned int n = 0; n < inBlock && results < maxResults; ++n) {
+            // The part of the item within the octree and its nearest point
+            // to centre.
+            aabb part;
+            Point closest;
+            bool empty = false;
+            Real d = 0;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               coord(part.min, a) = max(b.mMin[a][n], coord(mBounds.min, a));
+               coord(part.max, a) = min(b.mMax[a][n], coord(mBounds.max, a));
+               if (coord(part.min, a) > coord(part.max, a)) empty = true;
+               coord(closest, a) = min(max(coord(centre, a),
+                  coord(part.min, a)), coord(part.max, a));
+               Real da = (Real)coord(closest, a) - coord(centre, a);
+               d += da * da;
+            }
+            if (empty || d > radiusSq) continue;
+
+            if (isHeldOnce() || isPointOwned(closest, bounds)) {
+               outResults[results] = b.mId[n];
+               results++;
+            }
+         }
+
+         block = b.mNext;
+         inBlock = octreeBlockItems;
+      }
+   }
+
+   // Done.
+   return results;
+}
+
+// Find the k items nearest to point, nearest first. Returns the actual
+// number of results stored.
+// Nodes are visited depth first, nearest child first, and skipped once
+// they are further away than the k-th nearest item found so far. The
+// results are kept in the output arrays as a max heap (see NEAREST ITEMS)
+// and sorted at the end so that nothing is allocated.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::QueryKNN(Point const& point, int k,
+   Payload* outResults, Real* outDistances) const
+{
+   // Validate parameters.
+   if (!outResults || !outDistances || k <= 0) return 0;
+
+   QueryTally tally(mCounters[octreeQueryKNN], 1);
+   int results = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   Real stackDist[octreeStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackBounds[0] = mBounds;
+   stackDist[0] = distanceSq(point, mBounds);
+   while (top >= 0) {
+      unsigned int node = stackNode[top];
+      aabb bounds = stackBounds[top];
+      Real dist = stackDist[top];
+      top--;
+      OCTREE_TALLY_NODES(1);
+
+      // Prune nodes further than the furthest result.
+      if (results == k && dist >= outDistances[0]) continue;
+
+      if (!isLeaf(node)) {
+         // Order the children by distance (insertion sort) and push the
+         // furthest first so that the nearest comes out first.
+         unsigned int child = mpNodes[node].mChild;
+         aabb childBounds[Children];
+         Real childDist[Children];
+         int order[Children];
+         for (int c = 0; c < (int)Children; ++c) {
+            aabb reach;
+            getChildBound(bounds, c, childBounds[c]);
+            getReach(child + c, childBounds[c], reach);
+            childDist[c] = distanceSq(point, reach);
+            int n = c;
+            while (n > 0 && childDist[order[n - 1]] > childDist[c]) {
+               order[n] = order[n - 1];
+               n--;
+            }
+            order[n] = c;
+         }
+
+         for (int n = Children - 1; n >= 0; --n) {
+            int c = order[n];
+            if (results == k && childDist[c] >= outDistances[0]) continue;
+            top++;
+            stackNode[top] = child + c;
+            stackBounds[top] = childBounds[c];
+            stackDist[top] = childDist[c];
+         }
+
+         if (mpNodes[node].mCount == 0) continue;
+      }
+
+      OCTREE_TALLY_ITEMS(mpNodes[node].mCount);
+      unsigned int block = mpNodes[node].mBlock;
+      unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+      while (block != octreeNone) {
+         Block const& b = mpBlocks[block];
+         for (unsigned int n = 0; n < inBlock; ++n) {
+            // The part of the item within the octree.
+            aabb part;
+            for (unsigned int a = 0; a < Dim; ++a) {
+               coord(part.min, a) = max(b.mMin[a][n], coord(mBounds.min, a));
+               coord(part.max, a) = min(b.mMax[a][n], coord(mBounds.max, a));
+            }
+            Real d = distanceSq(point, part);
+            if (results == k && d >= outDistances[0]) continue;
+
+            // Items held by more than one leaf may already be in.
+            if (!isHeldOnce()) {
+               int found = 0;
+               while (found < results && outResults[found] != b.mId[n]) {
+                  found++;
+               }
+               if (found < results) continue;
+            }
+
+            if (results < k) {
+               outResults[results] = b.mId[n];
+               outDistances[results] = d;
+               knnSiftUp(outResults, outDistances, results);
+               results++;
+            } else {
+               outResults[0] = b.mId[n];
+               outDistances[0] = d;
+               knnSiftDown(outResults, outDistances, 0, results);
+            }
+         }
+
+         block = b.mNext;
+         inBlock = octreeBlockItems;
+      }
+   }
+
+   // Sort the heap (furthest moves to the end) and turn squared distances
+   // into distances.
+   for (int n = results - 1; n > 0; --n) {
+      swap(outDistances[0], outDistances[n]);
+      swap(outResults[0], outResults[n]);
+      knnSiftDown(outResults, outDistances, 0, n);
+   }
+
+   for (int n = 0; n < results; ++n) {
+      outDistances[n] = sqrt(outDistances[n]);
+   }
+
+   // Done.
+   return results;
+}
+
+// Find the items hit by a ray, nearest first. Returns the actual number of
+// results stored.
+// Children are visited front to back: the first is the one the ray points
+// away from along every axis, i.e. the Morton digit with the bits of the
+// negative axes of dir set, and the rest follow in the order of their
+// digits XOR that mask. Nodes entered beyond maxT or, once maxResults are
+// found, beyond the furthest of them are skipped so that looking for the
+// first hit stops early. The items of each block are slab tested at once.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::RayCast(Point const& origin,
+   Point const& dir, Real maxT, Payload* outResults, Real* outT,
+   int maxResults) const
+{
+   // Validate parameters.
+   if (!outResults || !outT || maxResults <= 0 || !(maxT >= 0)) return 0;
+
+   QueryTally tally(mCounters[octreeQueryRay], 1);
+   OctreeRay<Real, Dim> ray;
+   makeRay(origin, dir, ray);
+
+   // The part of the ray within the octree.
+   Real tMin = 0;
+   Real tMax = maxT;
+   if (!rayBounds(mBounds, ray, tMin, tMax)) return 0;
+
+   unsigned int mask = 0;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      if (ray.mDir[a] < 0) mask |= 1u << a;
+   }
+
+   int results = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   Real stackT[octreeStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackBounds[0] = mBounds;
+   stackT[0] = tMin;
+   while (top >= 0) {
+      unsigned int node = stackNode[top];
+      aabb bounds = stackBounds[top];
+      Real t = stackT[top];
+      top--;
+      OCTREE_TALLY_NODES(1);
+
+      // Skip nodes entered beyond the furthest result.
+      Real limit = (results == maxResults) ? outT[results - 1] : tMax;
+      if (t > limit) continue;
+
+      OCTREE_TALLY_ITEMS(mpNodes[node].mCount);
+      unsigned int block = mpNodes[node].mBlock;
+      unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+      while (block != octreeNone) {
+         Block const& b = mpBlocks[block];
+         Real hits[octreeBlockItems];
+         unsigned int hit = rayMask(b, ray, tMin, limit, hits);
+         hit &= (1u << inBlock) - 1;
+         while (hit) {
+            int n = __builtin_ctz(hit);
+            rayInsert(outResults, outT, results, maxResults, b.mId[n],
+               hits[n], isHeldOnce());
+            hit &= hit - 1;
+         }
+
+         limit = (results == maxResults) ? outT[results - 1] : tMax;
+         block = b.mNext;
+         inBlock = octreeBlockItems;
+      }
+
+      if (isLeaf(node)) continue;
+
+      // Children the ray reaches, pushed last first.
+      unsigned int child = mpNodes[node].mChild;
+      for (int n = Children - 1; n >= 0; --n) {
+         int c = n ^ mask;
+         aabb childBounds;
+         aabb reach;
+         getChildBound(bounds, c, childBounds);
+         getReach(child + c, childBounds, reach);
+         Real tEnter = tMin;
+         Real tExit = limit;
+         if (!rayBounds(reach, ray, tEnter, tExit)) continue;
+
+         top++;
+         stackNode[top] = child + c;
+         stackBounds[top] = childBounds;
+         stackT[top] = tEnter;
+      }
+   }
+
+   // Done.
+   return results;
+}
+
+// Calls fn for each pair of overlapping items. Returns the number of pairs.
+// Each node holding items is visited by one thread which pairs its items
+// with each other and, when items are held once, with the items of some
+// other nodes so that each pair is found at one node. Items kept where they
+// straddle children are paired with the nodes below them (see
+// forEachPair()) and the items of a loose octree with the nodes around them
+// (see forEachLoosePair()). When items are copied into every leaf they
+// overlap, a pair is only reported by the leaf owning the lowest corner of
+// the part where the two items overlap (as in QueryBox).
+template <typename Scalar, typename Payload, unsigned int Dim>
+size_t OctreeT<Scalar, Payload, Dim>::ForEachOverlappingPair(PairFn fn,
+   void* pCtx) const
+{
+   // Validate parameters.
+   if (!fn) return 0;
+
+   vector<unsigned int> nodes;
+   size_t items = 0;
+   for (size_t n = 0; n < mNodeCount; ++n) {
+      if (mpNodes[n].mCount == 0) continue;
+      nodes.push_back((unsigned int)n);
+      items += mpNodes[n].mCount;
+   }
+
+   unsigned int threads = threadCount(items);
+   vector<size_t> pairs(threads, 0);
+   if (isLoose()) {
+      forEachLoosePair(threads, fn, pCtx, pairs);
+   } else {
+      parallelFor(nodes.size(), threads,
+         [&](size_t begin, size_t end, unsigned int t) {
+            vector<unsigned int> others;
+            vector<aabb> reaches;
+            for (size_t n = begin; n < end; ++n) {
+               aabb bounds;
+               getNodeBounds(nodes[n], bounds);
+               pairs[t] += forEachPair(nodes[n], bounds, fn, pCtx, others,
+                  reaches);
+            }
+         });
+   }
+
+   size_t total = 0;
+   for (unsigned int t = 0; t < threads; ++t) total += pairs[t];
+   return total;
+}
+
+// Query() without checking its arguments or counting the query.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryPoint(Point const& point,
+   Payload* outResults, int maxResults) const
+{
+   if (maxResults <= 0 || !isPointInBounds(point, mBounds)) return 0;
+
+   // Items of a loose octree may stick out of the nodes holding them.
+   if (isLoose()) return queryLoose(point, outResults, maxResults);
+
+   // A point is a point - it can be found only in one leaf.
+   aabb bounds;
+   unsigned int leaf = findLeaf(point, bounds);
+   return queryPath(leaf, point, outResults, maxResults);
+}
+
+// QueryBatch() only sorts the points when the nodes and blocks of the tree
+// take more than this: the size of the L2 cache (1 MB when unknown). Below
+// it the whole tree stays in the cache whatever order the points come in,
+// and sorting them costs more than it saves.
+static size_t batchCacheBytes()
+{
+   static const size_t bytes = []() {
+      long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+      return l2 > 0 ? (size_t)l2 : (size_t)1 << 20;
+   }();
+   return bytes;
+}
+
+// Returns true if QueryBatch() and ParallelQuery() sort their points, that
+// is when the nodes and blocks of the tree do not fit in the cache.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isBatchSorted() const
+{
+   size_t bytes = mNodeCount * sizeof(OctreeNode) +
+      mBlockCount * sizeof(Block);
+   return bytes > batchCacheBytes();
+}
+
+// Walks down to the leaf holding point (which must lie within the octree)
+// and returns it along with its bounds. The child to descend into at each
+// level is the Morton digit of the point so finding the leaf takes one
+// comparison per axis per level.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::findLeaf(Point const& point,
+   aabb& bounds) const
+{
+   unsigned int node = 0;
+   bounds = mBounds;
+   OCTREE_TALLY_NODES(1);
+   while (!isLeaf(node)) {
+      int idx = findPos(bounds, point);
+      node = mpNodes[node].mChild + idx;
+      OCTREE_TALLY_NODES(1);
+      getChildBound(bounds, idx, bounds);
+   }
+
+   return node;
+}
+
+// Go through all the items within node and up until maxResults report each
+// only if it touches or encloses point. A block of items is tested at once.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryNode(unsigned int node,
+   Point const& point, Payload* outResults, int maxResults) const
+{
+   OCTREE_TALLY_ITEMS(mpNodes[node].mCount);
+   int results = 0;
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone && results < maxResults) {
+      Block const& b = mpBlocks[block];
+      unsigned int mask = pointMask(b, point) & ((1u << inBlock) - 1);
+      while (mask && results < maxResults) {
+         outResults[results] = b.mId[__builtin_ctz(mask)];
+         results++;
+         mask &= mask - 1;
+      }
+
+      block = b.mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   return results;
+}
+
+// Queries leaf and, when straddling items are kept by intermediates, every
+// node above it.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryPath(unsigned int leaf,
+   Point const& point, Payload* outResults, int maxResults) const
+{
+   int results = queryNode(leaf, point, outResults, maxResults);
+   if (!mPolicy.mKeepStraddlers) return results;
+
+   unsigned int node = mpNodes[leaf].mParent;
+   while (node != octreeNone && results < maxResults) {
+      if (mpNodes[node].mCount) {
+         results += queryNode(node, point, outResults + results,
+            maxResults - results);
+      }
+
+      node = mpNodes[node].mParent;
+   }
+
+   return results;
+}
+
+// The number of items queryPath() looks at for leaf.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::getPathItems(
+   unsigned int leaf) const
+{
+   unsigned int items = mpNodes[leaf].mCount;
+   if (!mPolicy.mKeepStraddlers) return items;
+
+   unsigned int node = mpNodes[leaf].mParent;
+   while (node != octreeNone) {
+      items += mpNodes[node].mCount;
+      node = mpNodes[node].mParent;
+   }
+
+   return items;
+}
+
+// Queries every node of a loose octree whose loose bounds hold point. Items
+// may stick out of their node so, unlike in other octrees, these need not
+// lie along one path.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::queryLoose(Point const& point,
+   Payload* outResults, int maxResults) const
+{
+   int results = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   int top = 0;
+   stackNode[0] = 0;
+   stackBounds[0] = mBounds;
+   while (top >= 0 && results < maxResults) {
+      unsigned int node = stackNode[top];
+      aabb bounds = stackBounds[top];
+      top--;
+      OCTREE_TALLY_NODES(1);
+
+      aabb reach;
+      getReach(node, bounds, reach);
+      if (!isPointInBounds(point, reach)) continue;
+
+      if (mpNodes[node].mCount) {
+         results += queryNode(node, point, outResults + results,
+            maxResults - results);
+      }
+
+      if (!isLeaf(node)) {
+         unsigned int child = mpNodes[node].mChild;
+         for (int c = Children - 1; c >= 0; --c) {
+            top++;
+            stackNode[top] = child + c;
+            getChildBound(bounds, c, stackBounds[top]);
+         }
+      }
+   }
+
+   return results;
+}
+
+// Calls fn for the pairs of overlapping items found at node (with bounds):
+// its items with each other (each with the items after it), with the items
+// of the nodes below it when it keeps items straddling its children and
+// with the items of others, whose reaches are given. Returns the number of
+// pairs.
+template <typename Scalar, typename Payload, unsigned int Dim>
+size_t OctreeT<Scalar, Payload, Dim>::forEachPair(unsigned int node,
+   aabb const& bounds, PairFn fn, void* pCtx,
+   vector<unsigned int> const& others, vector<aabb> const& reaches) const
+{
+   size_t pairs = 0;
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         Item item;
+         getItem(block, n, item);
+
+         // Items after n in this block and then those in later blocks.
+         unsigned int other = block;
+         unsigned int mask = boxMask(mpBlocks[block], item.mBounds) &
+            ((1u << inBlock) - 1) & ~((2u << n) - 1);
+         for (;;) {
+            while (mask) {
+               Item pair;
+               getItem(other, __builtin_ctz(mask), pair);
+               if (isPairOwned(item.mBounds, pair.mBounds, bounds)) {
+                  fn(item.mId, pair.mId, pCtx);
+                  pairs++;
+               }
+               mask &= mask - 1;
+            }
+
+            other = mpBlocks[other].mNext;
+            if (other == octreeNone) break;
+            mask = boxMask(mpBlocks[other], item.mBounds);
+         }
+
+         if (mPolicy.mKeepStraddlers && !isLoose() && !isLeaf(node)) {
+            pairs += forEachPairBelow(node, bounds, item, fn, pCtx);
+         }
+
+         // Items of the other nodes.
+         for (size_t o = 0; o < others.size(); ++o) {
+            if (!isCubeOverlap(reaches[o], item.mBounds)) continue;
+
+            other = mpNodes[others[o]].mBlock;
+            unsigned int inOther = firstBlockItems(mpNodes[others[o]].mCount);
+            while (other != octreeNone) {
+               mask = boxMask(mpBlocks[other], item.mBounds) &
+                  ((1u << inOther) - 1);
+               while (mask) {
+                  Item pair;
+                  getItem(other, __builtin_ctz(mask), pair);
+                  if (isPairOwned(item.mBounds, pair.mBounds, reaches[o])) {
+                     fn(item.mId, pair.mId, pCtx);
+                     pairs++;
+                  }
+                  mask &= mask - 1;
+               }
+
+               other = mpBlocks[other].mNext;
+               inOther = octreeBlockItems;
+            }
+         }
+      }
+
+      block = mpBlocks[block].mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   return pairs;
+}
+
+// Calls fn for item (held by node, with bounds) and each item it overlaps
+// in the nodes below node. Returns the number of pairs.
+template <typename Scalar, typename Payload, unsigned int Dim>
+size_t OctreeT<Scalar, Payload, Dim>::forEachPairBelow(unsigned int node,
+   aabb const& bounds, Item const& item, PairFn fn, void* pCtx) const
+{
+   size_t pairs = 0;
+   unsigned int stackNode[octreeStackSize];
+   aabb stackBounds[octreeStackSize];
+   int top = -1;
+   unsigned int child = mpNodes[node].mChild;
+   for (int c = Children - 1; c >= 0; --c) {
+      top++;
+      stackNode[top] = child + c;
+      getChildBound(bounds, c, stackBounds[top]);
+   }
+
+   while (top >= 0) {
+      unsigned int below = stackNode[top];
+      aabb belowBounds = stackBounds[top];
+      top--;
+      if (!isCubeOverlap(belowBounds, item.mBounds)) continue;
+
+      unsigned int block = mpNodes[below].mBlock;
+      unsigned int inBlock = firstBlockItems(mpNodes[below].mCount);
+      while (block != octreeNone) {
+         unsigned int mask = boxMask(mpBlocks[block], item.mBounds) &
+            ((1u << inBlock) - 1);
+         while (mask) {
+            Item pair;
+            getItem(block, __builtin_ctz(mask), pair);
+            if (isPairOwned(item.mBounds, pair.mBounds, belowBounds)) {
+               fn(item.mId, pair.mId, pCtx);
+               pairs++;
+            }
+            mask &= mask - 1;
+         }
+
+         block = mpBlocks[block].mNext;
+         inBlock = octreeBlockItems;
+      }
+
+      if (!isLeaf(below)) {
+         child = mpNodes[below].mChild;
+         for (int c = Children - 1; c >= 0; --c) {
+            top++;
+            stackNode[top] = child + c;
+            getChildBound(belowBounds, c, stackBounds[top]);
+         }
+      }
+   }
+
+   return pairs;
+}
+
+// Calls fn for each pair of overlapping items of a loose octree and adds
+// the pairs found by each thread to pairs. Items stick out of their nodes so
+// the items of a node may overlap those of nodes on other branches. Going
+// down from the root, each node is handed its pair nodes (see
+// getLoosePairCandidates()) and a pair is found at the deeper node of its
+// items. The top levels are walked one level at a time, sharing the nodes of
+// each level between threads, until there are enough to hand each thread
+// whole branches.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::forEachLoosePair(unsigned int threads,
+   PairFn fn, void* pCtx, vector<size_t>& pairs) const
+{
+   vector<aabb> held(mNodeCount);
+   vector<aabb> below(mNodeCount);
+   getPairBounds(0, held, below);
+   if (!isCubeOverlap(below[0], below[0])) return;
+
+   PairNode root;
+   root.mNode = 0;
+   root.mLevel = 0;
+   vector<vector<PairNode> > level(1, vector<PairNode>(1, root));
+   vector<vector<PairNode> > next;
+   vector<PairNode> candidates;
+   while (!level.empty()) {
+      bool branches = level.size() >= threads * gPairTasksPerThread;
+      parallelFor(level.size(), threads,
+         [&](size_t begin, size_t end, unsigned int t) {
+            PairWork work;
+            work.mNear.resize(octreeMaxLevels + 1);
+            work.mCandidates.resize(octreeMaxLevels + 1);
+            work.mpHeld = held.data();
+            work.mpBelow = below.data();
+            for (size_t n = begin; n < end; ++n) {
+               if (branches) {
+                  pairs[t] += forEachLoosePairBelow(level[n], 0, fn, pCtx,
+                     work);
+               } else {
+                  pairs[t] += forEachPairNear(level[n], fn, pCtx, work);
+               }
+            }
+         });
+      if (branches) break;
+
+      next.clear();
+      for (size_t n = 0; n < level.size(); ++n) {
+         if (isLeaf(level[n][0].mNode)) continue;
+
+         getLoosePairCandidates(level[n], below.data(), candidates);
+         for (unsigned int c = 0; c < Children; ++c) {
+            next.emplace_back();
+            if (!getLoosePairNodes(level[n][0], c, candidates, below.data(),
+               next.back()))
+            {
+               next.pop_back();
+            }
+         }
+      }
+      level.swap(next);
+   }
+}
+
+// Calls fn for the pairs found at near[0], whose pair nodes are near, and at
+// every node below it, depth levels below the node a thread started from.
+// Returns the number of pairs.
+template <typename Scalar, typename Payload, unsigned int Dim>
+size_t OctreeT<Scalar, Payload, Dim>::forEachLoosePairBelow(
+   vector<PairNode> const& near, unsigned int depth, PairFn fn, void* pCtx,
+   PairWork& work) const
+{
+   size_t pairs = forEachPairNear(near, fn, pCtx, work);
+   if (isLeaf(near[0].mNode)) return pairs;
+
+   vector<PairNode>& candidates = work.mCandidates[depth];
+   vector<PairNode>& below = work.mNear[depth];
+   getLoosePairCandidates(near, work.mpBelow, candidates);
+   for (unsigned int c = 0; c < Children; ++c) {
+      if (getLoosePairNodes(near[0], c, candidates, work.mpBelow, below)) {
+         pairs += forEachLoosePairBelow(below, depth + 1, fn, pCtx, work);
+      }
+   }
+
+   return pairs;
+}
+
+// Calls fn for the pairs found at near[0], whose pair nodes are near: its
+// items with each other and with the items of the nodes above it and of
+// those as deep which come after it. Items are held once so the bounds of
+// the node are not needed and those of its items are passed on instead.
+// Returns the number of pairs.
+template <typename Scalar, typename Payload, unsigned int Dim>
+size_t OctreeT<Scalar, Payload, Dim>::forEachPairNear(
+   vector<PairNode> const& near, PairFn fn, void* pCtx, PairWork& work) const
+{
+   PairNode const& at = near[0];
+   if (mpNodes[at.mNode].mCount == 0) return 0;
+
+   work.mOthers.clear();
+   work.mReaches.clear();
+   for (size_t n = 1; n < near.size(); ++n) {
+      PairNode const& other = near[n];
+      if (mpNodes[other.mNode].mCount == 0) continue;
+      if (other.mLevel == at.mLevel && other.mNode < at.mNode) continue;
+      if (!isCubeOverlap(work.mpHeld[other.mNode], work.mpHeld[at.mNode])) {
+         continue;
+      }
+
+      work.mOthers.push_back(other.mNode);
+      work.mReaches.push_back(work.mpHeld[other.mNode]);
+   }
+
+   return forEachPair(at.mNode, work.mpHeld[at.mNode], fn, pCtx, work.mOthers,
+      work.mReaches);
+}
+
+// Sets held[node] to the bounds of the items of node and below[node] to the
+// bounds of the items of node and all nodes below it, for node and every
+// node below it. Bounds holding no items are inverted (and overlap
+// nothing).
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getPairBounds(unsigned int node,
+   vector<aabb>& held, vector<aabb>& below) const
+{
+   aabb& box = held[node];
+   for (unsigned int a = 0; a < Dim; ++a) {
+      coord(box.min, a) = numeric_limits<Scalar>::max();
+      coord(box.max, a) = numeric_limits<Scalar>::lowest();
+   }
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      Block const& b = mpBlocks[block];
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         for (unsigned int a = 0; a < Dim; ++a) {
+            coord(box.min, a) = min(coord(box.min, a), b.mMin[a][n]);
+            coord(box.max, a) = max(coord(box.max, a), b.mMax[a][n]);
+         }
+      }
+
+      block = b.mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   below[node] = box;
+   if (isLeaf(node)) return;
+
+   unsigned int child = mpNodes[node].mChild;
+   for (unsigned int c = 0; c < Children; ++c) {
+      getPairBounds(child + c, held, below);
+      for (unsigned int a = 0; a < Dim; ++a) {
+         coord(below[node].min, a) =
+            min(coord(below[node].min, a), coord(below[child + c].min, a));
+         coord(below[node].max, a) =
+            max(coord(below[node].max, a), coord(below[child + c].max, a));
+      }
+   }
+}
+
+// The pair nodes of a node are the nodes no deeper than it holding items
+// (or, when as deep, with items below them) which may overlap the items of
+// the node and those below it, with the node itself first. Only these may
+// hold items overlapping its items. The bounds of the items below a node
+// (pBelow) lie within those of its parent, so the pair nodes of a child of
+// near[0] (whose pair nodes are near) are among the nodes of near holding
+// items and the children of the nodes of near as deep as near[0]. Those
+// are found into out, leaving out children whose items cannot overlap
+// those below near[0].
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getLoosePairCandidates(
+   vector<PairNode> const& near, aabb const* pBelow,
+   vector<PairNode>& out) const
+{
+   PairNode const& at = near[0];
+   out.clear();
+   for (size_t n = 0; n < near.size(); ++n) {
+      PairNode const& other = near[n];
+      if (mpNodes[other.mNode].mCount) out.push_back(other);
+      if (other.mLevel != at.mLevel || isLeaf(other.mNode)) continue;
+
+      PairNode child;
+      child.mLevel = at.mLevel + 1;
+      for (unsigned int c = 0; c < Children; ++c) {
+         child.mNode = mpNodes[other.mNode].mChild + c;
+         if (isCubeOverlap(pBelow[child.mNode], pBelow[at.mNode])) {
+            out.push_back(child);
+         }
+      }
+   }
+}
+
+// Finds into out the pair nodes of child c of parent from the candidates
+// found by getLoosePairCandidates() for parent. Returns false when there
+// are no items at or below the child.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::getLoosePairNodes(PairNode const& parent,
+   unsigned int c, vector<PairNode> const& candidates, aabb const* pBelow,
+   vector<PairNode>& out) const
+{
+   PairNode child;
+   child.mNode = mpNodes[parent.mNode].mChild + c;
+   child.mLevel = parent.mLevel + 1;
+   aabb const& box = pBelow[child.mNode];
+   if (!isCubeOverlap(box, box)) return false;
+
+   out.clear();
+   out.push_back(child);
+   for (size_t n = 0; n < candidates.size(); ++n) {
+      PairNode const& other = candidates[n];
+      if (other.mNode == child.mNode) continue;
+      if (isCubeOverlap(pBelow[other.mNode], box)) out.push_back(other);
+   }
+
+   return true;
+}
+
+// Returns true if a and b overlap within the octree and the pair is
+// reported at node: any node when items are held once, otherwise only the
+// leaf owning the lowest corner of the overlap.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isPairOwned(aabb const& a, aabb const& b,
+   aabb const& node) const
+{
+   Point lo;
+   for (unsigned int n = 0; n < Dim; ++n) {
+      coord(lo, n) = max(max(coord(a.min, n), coord(b.min, n)),
+         coord(mBounds.min, n));
+      Scalar hi = min(min(coord(a.max, n), coord(b.max, n)),
+         coord(mBounds.max, n));
+      if (coord(lo, n) > hi) return false;
+   }
+
+   return isHeldOnce() || isPointOwned(lo, node);
+}
+
+// Points mpNodes and mpBlocks at mNodes and mBlocks. Called whenever either
+// may have moved.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::setArrays()
+{
+   mpNodes = mNodes.data();
+   mpBlocks = mBlocks.data();
+   mNodeCount = (unsigned int)mNodes.size();
+   mBlockCount = (unsigned int)mBlocks.size();
+}
+
+// Lets go of the mapped file (if any) and goes back to the arrays.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::unmap()
+{
+   if (!mpMap) return;
+
+   munmap(mpMap, mMapSize);
+   mpMap = nullptr;
+   mMapSize = 0;
+   setArrays();
+}
+
+// am I a leaf?
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isLeaf(unsigned int node) const
+{
+   return mpNodes[node].mChild == 0;
+}
+
+// Returns true if pt belongs to leaf (see octree.h). Leaves own their lower
+// faces; upper faces belong to the next leaf unless they are the upper faces
+// of the octree itself.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isPointOwned(Point const& pt,
+   aabb const& leaf) const
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Scalar v = coord(pt, a);
+      if (v < coord(leaf.min, a) || v > coord(leaf.max, a)) return false;
+      if (v == coord(leaf.max, a) && v != coord(mBounds.max, a)) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Adds item to node (with the given bounds) or the nodes below it.
+// Note that mNodes and mBlocks may grow (and move) in here so nodes are
+// always referred to by index.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::add(unsigned int node, aabb const& bounds,
+   Item const& item, unsigned int level)
+{
+   // Do not add the item if it is not at least partially enclosed 
+   // within the bounds of this node. Below the root of a loose octree the
+   // item is known to fit the (loose) node.
+   if ((level == 0 || !isLoose()) && !isItemInBoundsPartial(bounds, item)) {
+      return;
+   }
+
+   aabb pChildBounds[Children];
+   getChildBounds(bounds, pChildBounds);
+
+   // Am I a leaf node?
+   if (isLeaf(node)) {
+      // Yes this is a leaf - Add item to this node first.
+      pushItem(node, item);
+      if (!canSplit(level)) return;
+
+      // A loose leaf is split once full. Items fitting no child stay.
+      if (isLoose()) {
+         unsigned int most = mPolicy.mMaxLeafItems ?
+            mPolicy.mMaxLeafItems : octreeBuildLeafItems;
+         if (mpNodes[node].mCount > most) promote(node, bounds, level);
+         return;
+      }
+
+      // Split once more items than the leaf capacity cut into the leaf.
+      // Items covering all of it or only touching its sides would be held by
+      // the children all the same so splitting does not help. By default
+      // leaves are split as Build() splits them: beyond octreeBuildLeafItems
+      // items but not below its smallest cells, or the faces of items not
+      // lining up with the cells could have leaves split along them down to
+      // the deepest level. Whatever the capacity, a leaf is not split when
+      // its children would hold octreeSplitGrowth times its items between
+      // them or more: crowded items about the size of the children would
+      // otherwise be copied into many leaves each. A leaf left unsplit with
+      // twice its capacity is only looked at again each time its items
+      // double so that filling it does not take quadratic time.
+      unsigned int most = mPolicy.mMaxLeafItems;
+      if (most == 0) {
+         if (level >= octreeMortonLevels) return;
+         most = octreeBuildLeafItems;
+      }
+
+      unsigned int count = mpNodes[node].mCount;
+      if (count > 2 * most && (count & (count - 1)) != 0) return;
+      if (count > most && isCutting(bounds, item.mBounds) &&
+         getCuttingItems(node, bounds) > most &&
+         isSplitUseful(node, pChildBounds)) {
+         promote(node, bounds, level);
+      }
+   } else if (isHeldOnce()) {
+      // Intermediate which keeps the items fitting no single child.
+      int c = findChild(bounds, item);
+      if (c < 0) {
+         pushItem(node, item);
+      } else {
+         add(mpNodes[node].mChild + c, pChildBounds[c], item, level + 1);
+      }
+   } else {
+      // No - this is intermediate.
+      unsigned int child = mpNodes[node].mChild;
+      for (unsigned int n = 0; n < Children; ++n) {
+         add(child + n, pChildBounds[n], item, level + 1);
+      }
+   }
+}
+
+// If this node is a leaf node, then it will be promoted to an intermediate node
+// otherwise nothing happens.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::promote(unsigned int node,
+   aabb const& bounds, unsigned int level)
 {
-   memset(&mBounds, 0, sizeof(aabb));
+   if (!isLeaf(node)) return;
+
+   // To promote, Children child nodes need to be created to represent equal
+   // cubes within the bounding cube of this node. Siblings are kept together so
+   // that the children are found from the index of the first. Siblings
+   // released by collapse() are used first.
+   OctreeNode leaf;
+   leaf.mChild = 0;
+   leaf.mBlock = octreeNone;
+   leaf.mCount = 0;
+   leaf.mParent = node;
+   unsigned int child = mFreeNode;
+   if (child != octreeNone) {
+      mFreeNode = mpNodes[child].mParent;
+      for (unsigned int n = 0; n < Children; ++n) mpNodes[child + n] = leaf;
+   } else {
+      child = (unsigned int)mNodes.size();
+      mNodes.insert(mNodes.end(), Children, leaf);
+      setArrays();
+   }
+
+   // Detach the items from this node.
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   mpNodes[node].mChild = child;
+   mpNodes[node].mBlock = octreeNone;
+   mpNodes[node].mCount = 0;
+
+   // Add each item in this node again so that it goes to the child nodes
+   // (or stays here if straddling ones are kept).
+   while (block != octreeNone) {
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         Item item;
+         getItem(block, n, item);
+         if (mIndexed) removeRef(item.mId, node);
+         add(node, bounds, item, level);
+      }
+
+      // Once done, release the block.
+      unsigned int next = mpBlocks[block].mNext;
+      freeBlock(block);
+      block = next;
+      inBlock = octreeBlockItems;
+   }
 }
 
-Octree::Octree(aabb& bounds)
+// Called once node is left without items. While all siblings of node are
+// empty leaves their parent is turned back into a leaf, and so on up the
+// tree. Released siblings are chained for promote() to reuse. An
+// intermediate node starts from its own children.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::collapse(unsigned int node)
 {
-   memcpy(&mBounds, &bounds, sizeof(aabb));
+   if (!isLeaf(node)) node = mpNodes[node].mChild;
+   while (node != 0) {
+      unsigned int parent = mpNodes[node].mParent;
+      unsigned int child = mpNodes[parent].mChild;
+      for (unsigned int n = 0; n < Children; ++n) {
+         if (!isLeaf(child + n) || mpNodes[child + n].mCount != 0) return;
+      }
+
+      mpNodes[parent].mChild = 0;
+      mpNodes[child].mParent = mFreeNode;
+      mFreeNode = child;
+      mLayout = newLayout();
+      node = parent;
+   }
 }
 
-Octree::~Octree()
+// Returns the number of items of node which cut into it (see isCutting()).
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::getCuttingItems(unsigned int node,
+   aabb const& bounds) const
 {
-   // Nothing to free.
+   unsigned int count = 0;
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         Item item;
+         getItem(block, n, item);
+         if (isCutting(bounds, item.mBounds)) count++;
+      }
+
+      block = mpBlocks[block].mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   return count;
 }
 
-// Add an item to the octree.
-// We're adding a bounding cube to the tree which will enclose an object of id
-// 'id'. This is how it will work:
-// 1. Check if this octree is a leaf node or an intermediate node.
-// 1a.   If a leaf node, then find out if more than one child cube enclose the
-//          object bounds. If they do, then promote the leaf node to an
-//          intermediate node, create leaf nodes and recurse add into the
-//          appropriate leaf nodes otherwise, just add the item to this node
-//          and leave it as a leaf node.
-// 2. If an intermediate node, then find out to which child nodes this object
-//    belongs to and add it to them.
-void Octree::Add(aabb const& bounds, int id)
+// Returns true if the children of node (with pChildBounds) would hold fewer
+// than octreeSplitGrowth times its items between them.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isSplitUseful(unsigned int node,
+   aabb const* pChildBounds) const
+{
+   size_t most = (size_t)octreeSplitGrowth * mpNodes[node].mCount;
+   size_t copies = 0;
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         Item item;
+         getItem(block, n, item);
+         copies += countChildren(pChildBounds, item.mBounds);
+      }
+
+      if (copies >= most) return false;
+      block = mpBlocks[block].mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   return true;
+}
+
+// Returns the number of children (with pChildBounds) box overlaps.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::countChildren(
+   aabb const* pChildBounds, aabb const& box)
+{
+   unsigned int count = 0;
+   for (unsigned int c = 0; c < Children; ++c) {
+      if (isCubeOverlap(pChildBounds[c], box)) count++;
+   }
+
+   return count;
+}
+
+// Returns true if the split policy allows nodes at level to be split.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::canSplit(unsigned int level) const
+{
+   if (level >= mPolicy.mMaxDepth) return false;
+
+   // Fixed point children are at least 1 unit across.
+   double least = mPolicy.mMinNodeSize;
+   if (numeric_limits<Scalar>::is_integer) least = max(least, 1.0);
+   if (least <= 0) return true;
+
+   // Size of the children along each axis.
+   int exp = -(int)(level + 1);
+   for (unsigned int a = 0; a < Dim; ++a) {
+      double size = (double)coord(mBounds.max, a) - coord(mBounds.min, a);
+      if (ldexp(size, exp) < least) return false;
+   }
+
+   return true;
+}
+
+// Returns true if node (at level, with nodeBounds) holding a single copy of
+// an item would still hold it alone, without being split, once the item is
+// moved to bounds. The item must stay clear of the sides of the node so that
+// no other node overlaps it. A leaf must then not be split by it (see add())
+// and an intermediate must still have the item straddling its children.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isKeptByNode(unsigned int node,
+   aabb const& nodeBounds, unsigned int level, aabb const& bounds) const
+{
+   if (isLoose()) {
+      return isCubeOverlap(mBounds, bounds) && findLooseNode(bounds) == node;
+   }
+
+   if (!isStrictlyIn(nodeBounds, bounds)) return false;
+   if (!isLeaf(node)) return isStraddling(nodeBounds, bounds);
+   if (mPolicy.mMaxLeafItems || !canSplit(level)) return true;
+   return !isStraddling(nodeBounds, bounds);
+}
+
+// Returns true for a loose octree (see OctreePolicy).
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isLoose() const
+{
+   return mPolicy.mLooseness > 1.0f;
+}
+
+// Returns true if every item is held by exactly one node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isHeldOnce() const
+{
+   return mPolicy.mKeepStraddlers || isLoose();
+}
+
+// Returns the child of an intermediate (with bounds) an item held once goes
+// to or -1 when it stays at the intermediate. In a loose octree it is the
+// child holding the centre of the item if the item fits its loose bounds.
+// Otherwise it is the only child the item overlaps.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::findChild(aabb const& bounds,
+   Item const& item) const
+{
+   if (!isLoose()) return findItemChild(bounds, item);
+
+   aabb const& b = item.mBounds;
+   Point centre;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      coord(centre, a) = getHalf(coord(b.min, a), coord(b.max, a));
+   }
+   PointIdx idx = findPos(bounds, centre);
+   if (idx == nodeIdxOutOfBounds) return -1;
+
+   aabb child;
+   aabb loose;
+   getChildBound(bounds, idx, child);
+   getLooseBounds(child, loose);
+   return isCubeEnclosed(loose, item.mBounds) ? (int)idx : -1;
+}
+
+// Returns the node of a loose octree an item with bounds belongs to as it
+// stands (without splitting any leaf).
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::findLooseNode(
+   aabb const& bounds) const
 {
-   // Create the item first.
    Item item;
-   item.mId = id;
+   item.mId = 0;
    item.mBounds = bounds;
+   unsigned int node = 0;
+   aabb nodeBounds = mBounds;
+   while (!isLeaf(node)) {
+      int c = findChild(nodeBounds, item);
+      if (c < 0) break;
 
-   // Do not add the item if it is not at least partially enclosed 
-   // within the bounds of this node.
-   if (!isItemInBoundsPartial(mBounds, item)) {
-      return;
+      node = mpNodes[node].mChild + c;
+      getChildBound(nodeBounds, c, nodeBounds);
    }
 
-   // Am I a leaf node?
-   if (isLeaf()) {
-      // Yes this is a leaf - Add item to this node first.
-      mItems.push_back(item);
+   return node;
+}
 
-      // Should this leaf node be promoted to an intermediate node, will this
-      // item be contained in more than one child leaf node? If yes, then just
-      // promote this node.
-      int count = 0;
-      aabb pChildBounds[8];
-      getChildBounds(mBounds, pChildBounds);
-      for (int n = 0; n < 8 && count < 2; ++n) {
-         if (isItemInBoundsPartial(pChildBounds[n], item)) {
-            count++;
-         }
+// Grows bounds about their centre to mLooseness times their size. Fixed
+// point bounds are rounded outwards.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getLooseBounds(aabb const& bounds,
+   aabb& loose) const
+{
+   Real grow = ((Real)mPolicy.mLooseness - 1) / 2;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Real lo = coord(bounds.min, a);
+      Real hi = coord(bounds.max, a);
+      Real d = (hi - lo) * grow;
+      coord(loose.min, a) = toScalar<Scalar>(lo - d, false);
+      coord(loose.max, a) = toScalar<Scalar>(hi + d, true);
+   }
+}
+
+// Gets the bounds which the items of node (with bounds) and those below it
+// lie within as far as queries go: the loose bounds of nodes of a loose
+// octree other than the root, whose items only count within the octree.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getReach(unsigned int node,
+   aabb const& bounds, aabb& reach) const
+{
+   if (node == 0 || !isLoose()) {
+      reach = bounds;
+   } else {
+      getLooseBounds(bounds, reach);
+   }
+}
+
+// Works out the bounds of node by following the parents up to the root and
+// descending back along the same children. Returns the level of node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::getNodeBounds(unsigned int node,
+   aabb& bounds) const
+{
+   unsigned int digits[octreeMaxLevels + 1];
+   unsigned int level = 0;
+   while (node != 0) {
+      unsigned int parent = mpNodes[node].mParent;
+      digits[level] = node - mpNodes[parent].mChild;
+      level++;
+      node = parent;
+   }
+
+   bounds = mBounds;
+   for (unsigned int n = level; n > 0; --n) {
+      getChildBound(bounds, digits[n - 1], bounds);
+   }
+
+   return level;
+}
+
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::printf(unsigned int node,
+   aabb const& bounds)
+{
+   // Nodes without items are shown as intermediates.
+   ::printf("(%s",
+      (!isLeaf(node) || mpNodes[node].mCount == 0) ? "Inode" : "Lnode");
+   printAxes(bounds);
+   ::printf(")\n");
+
+   // Print items!
+   unsigned int block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      for (unsigned int n = 0; n < inBlock; ++n) {
+         Item item;
+         getItem(block, n, item);
+         ::printf("   (item %lld", (long long)item.mId);
+         printAxes(item.mBounds);
+         ::printf(")\n");
+      }
+
+      block = mpBlocks[block].mNext;
+      inBlock = octreeBlockItems;
+   }
+
+   // Print children!
+   if (!isLeaf(node)) {
+      unsigned int child = mpNodes[node].mChild;
+      for (unsigned int n = 0; n < Children; ++n) {
+         aabb childBounds;
+         getChildBound(bounds, n, childBounds);
+         printf(child + n, childBounds);
       }
+   }
+}
+
+// Splits the (empty) root and its descendants for count sorted codes (of
+// the items in the order given by pOrder). Nodes are created a level at a
+// time so that each level of the tree is stored together. Unless items are
+// held once, a node is left unsplit, as in add(), when its children would
+// hold octreeSplitGrowth times the items centred in it between them or
+// more.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::buildNodes(Item const* pItems,
+   unsigned int const* pOrder, unsigned int const* pCodes, size_t count)
+{
+   OctreeNode leaf;
+   leaf.mChild = 0;
+   leaf.mBlock = octreeNone;
+   leaf.mCount = 0;
 
-      // Promote node to an intermediate one?
-      if (count >= 2) {
-         // Only promote the node of this item does not cover the entire area
-         // of this leaf's space.
-         if (!isCubeEnclosed(item.mBounds, mBounds)) {
-            promote();
+   unsigned int most = mPolicy.mMaxLeafItems ? mPolicy.mMaxLeafItems :
+      octreeBuildLeafItems;
+   vector<BuildRange>& queue = mpScratch->mQueue;
+   BuildRange root = { 0, 0, 0, count };
+   queue.clear();
+   queue.push_back(root);
+   for (size_t q = 0; q < queue.size(); ++q) {
+      BuildRange r = queue[q];
+      if (r.mEnd - r.mBegin <= most) continue;
+      if (r.mLevel == octreeMortonLevels || !canSplit(r.mLevel)) continue;
+      if (!isHeldOnce()) {
+         aabb bounds;
+         aabb pChildBounds[Children];
+         getNodeBounds(r.mNode, bounds);
+         getChildBounds(bounds, pChildBounds);
+         size_t copies = 0;
+         for (size_t n = r.mBegin; n < r.mEnd; ++n) {
+            copies += countChildren(pChildBounds, pItems[pOrder[n]].mBounds);
          }
+
+         if (copies >= octreeSplitGrowth * (r.mEnd - r.mBegin)) continue;
       }
-   } else if (mLeaves.size() == 8) {         // must always be 8.
-      // No - this is intermediate.
-      for (vector<Octree>::iterator it = mLeaves.begin(); 
-         it != mLeaves.end(); ++it)
-      {
-         it->Add(bounds, id);
+
+      unsigned int child = (unsigned int)mNodes.size();
+      leaf.mParent = r.mNode;
+      mNodes.insert(mNodes.end(), Children, leaf);
+      setArrays();
+      mpNodes[r.mNode].mChild = child;
+
+      // The codes are sorted so the codes of each child follow each other.
+      unsigned int shift = Dim * (octreeMortonLevels - 1 - r.mLevel);
+      size_t begin = r.mBegin;
+      for (unsigned int n = 0; n < Children; ++n) {
+         size_t end = begin;
+         while (end < r.mEnd &&
+            ((pCodes[end] >> shift) & (Children - 1)) == n) ++end;
+
+         BuildRange sub = { child + n, r.mLevel + 1, begin, end };
+         queue.push_back(sub);
+         begin = end;
       }
    }
 }
 
-// Clear the octree.
-void Octree::Reset()
+// Places each of count items (in the order given by pOrder) in every leaf it
+// overlaps, or the one node holding it when items are held once.
+// Items are tested against nodes exactly as Add() would.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::buildLeaves(Item const* pItems,
+   unsigned int const* pOrder, size_t count)
 {
-   memset(&mBounds, 0, sizeof(aabb));
-   mItems.clear();
-   mLeaves.clear();
+   // Find the leaves of each item. Each thread records (leaf, item) pairs
+   // for its own slice of the items.
+   OctreeScratch& scratch = *mpScratch;
+   unsigned int threads = threadCount(count);
+   vector<vector<unsigned int> >& leaves = scratch.mLeaves;
+   vector<vector<unsigned int> >& items = scratch.mItems;
+   if (leaves.size() < threads) {
+      leaves.resize(threads);
+      items.resize(threads);
+   }
+
+   for (unsigned int t = 0; t < threads; ++t) {
+      leaves[t].clear();
+      items[t].clear();
+   }
+
+   parallelFor(count, threads,
+      [&](size_t begin, size_t end, unsigned int t) {
+         // Up to Children - 1 siblings wait at each level with the last
+         // being tested.
+         unsigned int stackNode[(Children - 1) * octreeMortonLevels +
+            Children];
+         aabb stackBounds[(Children - 1) * octreeMortonLevels + Children];
+         for (size_t n = begin; n < end; ++n) {
+            Item const& item = pItems[pOrder[n]];
+            int top = 0;
+            stackNode[0] = 0;
+            stackBounds[0] = mBounds;
+            while (top >= 0) {
+               unsigned int node = stackNode[top];
+               aabb bounds = stackBounds[top];
+               top--;
+               if ((node == 0 || !isLoose()) &&
+                  !isItemInBoundsPartial(bounds, item)) continue;
+
+               // An intermediate keeping items held once may be where it
+               // goes.
+               int only = -1;
+               if (!isLeaf(node) && isHeldOnce()) {
+                  only = findChild(bounds, item);
+               }
+
+               if (isLeaf(node) || (isHeldOnce() && only < 0)) {
+                  leaves[t].push_back(node);
+                  items[t].push_back(pOrder[n]);
+                  continue;
+               }
+
+               unsigned int child = mpNodes[node].mChild;
+               if (only >= 0) {
+                  top++;
+                  stackNode[top] = child + only;
+                  getChildBound(bounds, only, stackBounds[top]);
+                  continue;
+               }
+
+               // Children are pushed last first so they come out in order.
+               for (int c = Children - 1; c >= 0; --c) {
+                  top++;
+                  stackNode[top] = child + c;
+                  getChildBound(bounds, c, stackBounds[top]);
+               }
+            }
+         }
+      });
+
+   // Join the slices in order and group them by leaf.
+   vector<unsigned int>& keys = scratch.mKeys;
+   vector<unsigned int>& vals = scratch.mVals;
+   keys.clear();
+   vals.clear();
+   for (unsigned int t = 0; t < threads; ++t) {
+      keys.insert(keys.end(), leaves[t].begin(), leaves[t].end());
+      vals.insert(vals.end(), items[t].begin(), items[t].end());
+   }
+
+   unsigned int keyBits = 0;
+   while (keyBits < 32 && (mNodes.size() >> keyBits) != 0) keyBits++;
+   radixSort(keys, vals, keyBits, scratch.mTmpKeys, scratch.mTmpVals,
+      scratch.mHist);
+
+   // Give each leaf consecutive blocks. The first block is the partly
+   // filled one (see ITEM BLOCKS).
+   vector<BuildRange>& runs = scratch.mRuns;
+   runs.clear();
+   unsigned int blocks = 0;
+   for (size_t begin = 0; begin < keys.size(); ) {
+      size_t end = begin;
+      while (end < keys.size() && keys[end] == keys[begin]) ++end;
+
+      OctreeNode& node = mpNodes[keys[begin]];
+      node.mCount = (unsigned int)(end - begin);
+      node.mBlock = blocks;
+      blocks += (node.mCount + octreeBlockItems - 1) / octreeBlockItems;
+
+      BuildRange run = { keys[begin], 0, begin, end };
+      runs.push_back(run);
+      begin = end;
+   }
+
+   // Fill the blocks.
+   mBlocks.resize(blocks);
+   setArrays();
+   parallelFor(runs.size(), threadCount(keys.size()),
+      [&](size_t begin, size_t end, unsigned int) {
+         for (size_t r = begin; r < end; ++r) {
+            OctreeNode const& node = mpNodes[runs[r].mNode];
+            unsigned int first = firstBlockItems(node.mCount);
+            unsigned int last = node.mBlock +
+               (node.mCount + octreeBlockItems - 1) / octreeBlockItems - 1;
+            for (unsigned int b = node.mBlock; b <= last; ++b) {
+               mpBlocks[b].mNext = (b == last) ? octreeNone : b + 1;
+            }
+
+            for (size_t n = runs[r].mBegin; n < runs[r].mEnd; ++n) {
+               unsigned int j = (unsigned int)(n - runs[r].mBegin);
+               if (j < first) {
+                  setItem(node.mBlock, j, pItems[vals[n]]);
+               } else {
+                  j -= first;
+                  setItem(node.mBlock + 1 + j / octreeBlockItems,
+                     j % octreeBlockItems, pItems[vals[n]]);
+               }
+            }
+         }
+      });
 }
 
-void Octree::printf()
+//
+// ITEM BLOCKS
+//
+// The items of a node are kept in a chain of blocks. Only the first block of
+// the chain may be partly filled; new items go there and a new first block is
+// started when it is full.
+//
+
+// Adds item to the items of node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::pushItem(unsigned int node,
+   Item const& item)
 {
-   // Intermediates do not have items.
-   if (mItems.size() == 0) {
-      ::printf("(Inode - x: %f - %f, y: %f - %f, z: %f - %f)\n", 
-         mBounds.min.x, mBounds.max.x,
-         mBounds.min.y, mBounds.max.y,
-         mBounds.min.z, mBounds.max.z);
-      
-      // Print leaves!
-      for (vector<Octree>::iterator it = mLeaves.begin(); 
-         it != mLeaves.end(); ++it)
-      {
-         it->printf();
-      }
-   } else {
-      ::printf("(Lnode - x: %f - %f, y: %f - %f, z: %f - %f)\n", 
-         mBounds.min.x, mBounds.max.x,
-         mBounds.min.y, mBounds.max.y,
-         mBounds.min.z, mBounds.max.z);
+   unsigned int slot = mpNodes[node].mCount % octreeBlockItems;
+   if (slot == 0) {
+      unsigned int block = allocBlock();
+      mpBlocks[block].mNext = mpNodes[node].mBlock;
+      mpNodes[node].mBlock = block;
+   }
+
+   setItem(mpNodes[node].mBlock, slot, item);
+   mpNodes[node].mCount++;
+   if (mIndexed) addRef(item.mId, node);
+}
 
-      // Print items!
-      for (vector<Item>::iterator it = mItems.begin(); 
-         it != mItems.end(); ++it)
-      {
-         ::printf("   (item %d - x: %f - %f, y: %f - %f, z: %f - %f)\n",
-            it->mId, 
-            it->mBounds.min.x, it->mBounds.max.x,
-            it->mBounds.min.y, it->mBounds.max.y,
-            it->mBounds.min.z, it->mBounds.max.z);
+// Finds the block and slot of an item with id held by node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::findItem(unsigned int node, Payload id,
+   unsigned int& block, unsigned int& slot) const
+{
+   block = mpNodes[node].mBlock;
+   unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+   while (block != octreeNone) {
+      Block const& b = mpBlocks[block];
+      for (slot = 0; slot < inBlock; ++slot) {
+         if (b.mId[slot] == id) return true;
       }
+
+      block = b.mNext;
+      inBlock = octreeBlockItems;
    }
+
+   return false;
 }
 
-// Find up to 'maxResults' intersecting items and write them into
-// 'outResults' array. Returns the actual number of results stored.
-int Octree::Query(Point const& point, int* outResults, int maxResults) const
+// Takes item 'slot' of block out of node. The last item of the first block
+// fills the gap and the first block is released once empty.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::removeItem(unsigned int node,
+   unsigned int block, unsigned int slot)
 {
-   // If the leaf node containing this point is identified, then the items
-   // within that node are searched such that any ones which enclose or touch
-   // the input point will be returned.
-   if (!isLeaf()) {
-      // Go through leaves and query...
-      for (vector<Octree>::const_iterator it = mLeaves.begin(); 
-         it != mLeaves.end(); ++it)
-      {
-         int found = it->Query(point, outResults, maxResults);
+   unsigned int first = mpNodes[node].mBlock;
+   unsigned int last = firstBlockItems(mpNodes[node].mCount) - 1;
+   if (block != first || slot != last) {
+      Item item;
+      getItem(first, last, item);
+      setItem(block, slot, item);
+   }
 
-         // A point is a point - it can be found only in one spot. Once found,
-         // the process can stop.
-         if (found > 0) return found;
-      }
+   mpNodes[node].mCount--;
+   if (last == 0) {
+      mpNodes[node].mBlock = mpBlocks[first].mNext;
+      freeBlock(first);
+   }
+}
 
-      // Not found in the leaf nodes of this intermediate.
-      return 0;
+// Reads item 'slot' of block.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getItem(unsigned int block,
+   unsigned int slot, Item& item) const
+{
+   Block const& b = mpBlocks[block];
+   item.mId = b.mId[slot];
+   for (unsigned int a = 0; a < Dim; ++a) {
+      coord(item.mBounds.min, a) = b.mMin[a][slot];
+      coord(item.mBounds.max, a) = b.mMax[a][slot];
    }
+}
 
-   // This is a leaf node. This node may enclose this point.
-   if (!isPointInBounds(point, mBounds)) return 0;
+// Writes item to 'slot' of block.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::setItem(unsigned int block,
+   unsigned int slot, Item const& item)
+{
+   Block& b = mpBlocks[block];
+   for (unsigned int a = 0; a < Dim; ++a) {
+      b.mMin[a][slot] = coord(item.mBounds.min, a);
+      b.mMax[a][slot] = coord(item.mBounds.max, a);
+   }
+   b.mId[slot] = item.mId;
+}
 
-   // Point is within this leaf node. Validate parameters.
-   if (!outResults || maxResults <= 0) return 0;
+// Returns an unused block, reusing released ones first.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::allocBlock()
+{
+   if (mFreeBlock != octreeNone) {
+      unsigned int block = mFreeBlock;
+      mFreeBlock = mpBlocks[block].mNext;
+      return block;
+   }
 
-   // Go through all the items within this node and up until maxResults report
-   // each only if it touches or encloses this point.
-   int results = 0;
-   for (vector<Item>::const_iterator it = mItems.begin(); 
-      it != mItems.end() && results < maxResults; ++it)
-   {
-      if (isPointInBounds(point, it->mBounds)) {
-         outResults[results] = it->mId;
-         results++;
+   mBlocks.push_back(Block());
+   setArrays();
+   return (unsigned int)mBlocks.size() - 1;
+}
+
+// Returns block to the free list.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::freeBlock(unsigned int block)
+{
+   mpBlocks[block].mNext = mFreeBlock;
+   mFreeBlock = block;
+}
+
+//
+// ID INDEX
+//
+// Each id maps to a chain of refs, one for every copy of an item with that id
+// and naming the leaf holding it. Ids are kept in an open addressing table
+// (a power of two in size) which keeps its memory across Reset(). The index
+// is only built when first needed and is then kept up to date as items are
+// added to and taken out of leaves.
+//
+
+// Indexes all items held by the octree.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::buildIndex()
+{
+   IdSlot empty = { 0, octreeNone };
+   mIds.assign(max(mIds.size(), (size_t)16), empty);
+   mIdCount = 0;
+   mIndexed = true;
+   for (unsigned int node = 0; node < mNodeCount; ++node) {
+      unsigned int block = mpNodes[node].mBlock;
+      unsigned int inBlock = firstBlockItems(mpNodes[node].mCount);
+      while (block != octreeNone) {
+         for (unsigned int n = 0; n < inBlock; ++n) {
+            addRef(mpBlocks[block].mId[n], node);
+         }
+
+         block = mpBlocks[block].mNext;
+         inBlock = octreeBlockItems;
       }
    }
-
-   // Done.
-   return results;
 }
 
-// am I a leaf?
-bool Octree::isLeaf() const
+// Records that node holds a copy of id.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::addRef(Payload id, unsigned int node)
 {
-   return mLeaves.size() == 0;
+   unsigned int ref = mFreeRef;
+   if (ref != octreeNone) {
+      mFreeRef = mRefs[ref].mNext;
+   } else {
+      ref = (unsigned int)mRefs.size();
+      mRefs.push_back(OctreeRef());
+   }
+
+   // Keep the table at most half full.
+   if ((mIdCount + 1) * 2 > mIds.size()) growIds();
+
+   unsigned int slot = findId(id);
+   if (mIds[slot].mRef == octreeNone) {
+      mIds[slot].mId = id;
+      mIdCount++;
+   }
+
+   mRefs[ref].mNode = node;
+   mRefs[ref].mNext = mIds[slot].mRef;
+   mIds[slot].mRef = ref;
 }
 
-// If this node is a leaf node, then it will be promoted to an intermediate node
-// otherwise nothing happens.
-void Octree::promote()
+// Drops one ref of id to node.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::removeRef(Payload id, unsigned int node)
 {
-   if (mLeaves.size() > 0) return;           // not a leaf
+   unsigned int slot = findId(id);
+   unsigned int* pLink = &mIds[slot].mRef;
+   while (*pLink != octreeNone && mRefs[*pLink].mNode != node) {
+      pLink = &mRefs[*pLink].mNext;
+   }
+   if (*pLink == octreeNone) return;
+
+   unsigned int ref = *pLink;
+   *pLink = mRefs[ref].mNext;
+   mRefs[ref].mNext = mFreeRef;
+   mFreeRef = ref;
+   if (mIds[slot].mRef == octreeNone) eraseId(slot);
+}
 
-   // To promote, 8 child nodes need to be created to represent 8 equal cubes
-   // within the bounding cube of this tree.
-   aabb pChildBounds[8];
-   getChildBounds(mBounds, pChildBounds);
-   for (int n = 0; n < 8; ++n) {
-      mLeaves.push_back(Octree(pChildBounds[n]));
+// Returns the slot of the id table holding id or else the empty slot where
+// it would go. Ids are found by linear probing from the slot of their hash.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::findId(Payload id) const
+{
+   unsigned int mask = (unsigned int)mIds.size() - 1;
+   unsigned int slot = idHash(id) & mask;
+   while (mIds[slot].mRef != octreeNone && mIds[slot].mId != id) {
+      slot = (slot + 1) & mask;
    }
 
-   // Add each item in this node to the child nodes.
-   for (vector<Item>::iterator it = mItems.begin(); it != mItems.end(); ++it) {
-      for (vector<Octree>::iterator leaf = mLeaves.begin();
-         leaf != mLeaves.end(); ++leaf)
-      {
-         leaf->Add(it->mBounds, it->mId);
+   return slot;
+}
+
+// Empties slot of the id table. The ids after it are moved back into the
+// gap where their probe would still find them so that no tombstones are
+// needed.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::eraseId(unsigned int slot)
+{
+   unsigned int mask = (unsigned int)mIds.size() - 1;
+   unsigned int gap = slot;
+   unsigned int n = (slot + 1) & mask;
+   while (mIds[n].mRef != octreeNone) {
+      unsigned int home = idHash(mIds[n].mId) & mask;
+      if (((n - home) & mask) >= ((n - gap) & mask)) {
+         mIds[gap] = mIds[n];
+         gap = n;
       }
+
+      n = (n + 1) & mask;
    }
 
-   // Once done, delete all items.
-   mItems.clear();
+   mIds[gap].mRef = octreeNone;
+   mIdCount--;
+}
+
+// Doubles the id table.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::growIds()
+{
+   vector<IdSlot> old;
+   old.swap(mIds);
+
+   IdSlot empty = { 0, octreeNone };
+   mIds.assign(max(old.size() * 2, (size_t)16), empty);
+   for (size_t n = 0; n < old.size(); ++n) {
+      if (old[n].mRef != octreeNone) mIds[findId(old[n].mId)] = old[n];
+   }
 }
 
-// Splits bounds into 8 halves (a cube split across 3 axis from the centre point
-// of each axis). Will get the enclosing cube for the specified point within the
-// bounds. Will return nodeIdxOutOfBounds when the point is invalid.
+// Determines the child of bounds holding point as a Morton digit (see
+// PointIdx). Points on the middle of an axis belong to the upper half.
+// Will return nodeIdxOutOfBounds when the point is outside bounds.
 // The orientation of the axis is as follows:
 // -x to +x: left to right.
 // -y to +y: top to bottom.
 // -z to +z: far to near
-PointIdx Octree::findPos(aabb const& bounds, Point const& point)
+template <typename Scalar, typename Payload, unsigned int Dim>
+PointIdx OctreeT<Scalar, Payload, Dim>::findPos(aabb const& bounds,
+   Point const& point)
 {
-   float halves[3];
-   halves[0] = bounds.min.x + ((bounds.max.x - bounds.min.x) / 2);
-   halves[1] = bounds.min.y + ((bounds.max.y - bounds.min.y) / 2);
-   halves[2] = bounds.min.z + ((bounds.max.z - bounds.min.z) / 2);
-
    // Validate the point to be within bounds.
-   if (point.x < bounds.min.x)   return nodeIdxOutOfBounds;
-   if (point.x >= bounds.max.x)  return nodeIdxOutOfBounds;
-   if (point.y < bounds.min.y)   return nodeIdxOutOfBounds;
-   if (point.y >= bounds.max.y)  return nodeIdxOutOfBounds;
-   if (point.z < bounds.min.z)   return nodeIdxOutOfBounds;
-   if (point.z >= bounds.max.z)  return nodeIdxOutOfBounds;
-
-   // Determine position of point within the bounds. This will be used to
-   // determine which node should be used for this point.
-   if (point.x >= halves[0]) {
-      // Right hand side.
-      if (point.y >= halves[1]) {
-         // Bottom half.
-         if (point.z >= halves[2]) {
-            // Far end.
-            return nodeIdxBtmRightNear;
-         } else if (point.z < halves[2]) {
-            // Closer.
-            return nodeIdxBtmRightFar;
-         }
-      } else if (point.y < halves[1]) {
-         // top half.
-         if (point.z >= halves[2]) {
-            // Far end.
-            return nodeIdxTopRightNear;
-         } else if (point.z < halves[2]) {
-            // Closer.
-            return nodeIdxTopRightFar;
-         }
-      }
-   } else if (point.x < halves[0]) {
-      // Left hand side.
-      if (point.y >= halves[1]) {
-         // Bottom half.
-         if (point.z >= halves[2]) {
-            // Far end.
-            return nodeIdxBtmLeftNear;
-         } else if (point.z < halves[2]) {
-            // Closer.
-            return nodeIdxBtmLeftFar;
-         }
-      } else if (point.y < halves[1]) {
-         // top half.
-         if (point.z >= halves[2]) {
-            // Far end.
-            return nodeIdxTopLeftNear;
-         } else if (point.z < halves[2]) {
-            // Closer.
-            return nodeIdxTopLeftFar;
-         }
-      }   
-   }
-
-   return nodeIdxOutOfBounds;
-}
-
-// Fills childBounds with the 8 child bounds of bound. I.e., one large cube will
-// be split into 8 equally sized child cubes. childbounds MUST be an array of 8
-// aabb structs.
+   if (!isPointInBounds(point, bounds)) return nodeIdxOutOfBounds;
+
+   // Each axis contributes one bit: right hand side, bottom half, near end.
+   int idx = 0;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Scalar half = getHalf(coord(bounds.min, a), coord(bounds.max, a));
+      if (coord(point, a) >= half) idx |= 1 << a;
+   }
+   return (PointIdx)idx;
+}
+
+// Fills childBounds with the Children child bounds of bound. I.e., one large
+// cube will be split into 8 (or in 2D 4) equally sized child cubes.
+// childbounds MUST be an array of Children aabb structs indexed by PointIdx.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getChildBounds(aabb const& bounds,
+   aabb* childbounds)
+{
+   for (unsigned int n = 0; n < Children; ++n) {
+      getChildBound(bounds, n, childbounds[n]);
+   }
+}
+
+// Gets the bounds of one of the child cubes of bounds. The bits of idx
+// (see PointIdx) select the smaller or larger half of each axis. Siblings
+// share the middle of each axis exactly; which of them a point on it belongs
+// to is settled by findPos() and isPointOwned().
 // The orientation of the axis is as follows:
 // -x to +x: left to right.
 // -y to +y: top to bottom.
 // -z to +z: far to near
-void Octree::getChildBounds(aabb const& bounds, aabb* childbounds)
-{
-   float halves[3];
-   halves[0] = bounds.min.x + ((bounds.max.x - bounds.min.x) / 2.0);
-   halves[1] = bounds.min.y + ((bounds.max.y - bounds.min.y) / 2.0);
-   halves[2] = bounds.min.z + ((bounds.max.z - bounds.min.z) / 2.0);
-
-   // Top left near.
-   // smaller x plane (left)
-   // smaller y plane (top)
-   // larger z plane (near)
-   childbounds[nodeIdxTopLeftNear].min.x = bounds.min.x;
-   childbounds[nodeIdxTopLeftNear].max.x = halves[0] - FLT_MIN;
-   childbounds[nodeIdxTopLeftNear].min.y = bounds.min.y;
-   childbounds[nodeIdxTopLeftNear].max.y = halves[1] - FLT_MIN;
-   childbounds[nodeIdxTopLeftNear].min.z = halves[2];
-   childbounds[nodeIdxTopLeftNear].max.z = bounds.max.z - FLT_MIN;
-
-   // Top right near.
-   // larger x plane (right)
-   // smaller y plane (top)
-   // larger z plane (near)
-   childbounds[nodeIdxTopRightNear].min.x = halves[0];
-   childbounds[nodeIdxTopRightNear].max.x = bounds.max.x - FLT_MIN;
-   childbounds[nodeIdxTopRightNear].min.y = bounds.min.y;
-   childbounds[nodeIdxTopRightNear].max.y = halves[1] - FLT_MIN;
-   childbounds[nodeIdxTopRightNear].min.z = halves[2];
-   childbounds[nodeIdxTopRightNear].max.z = bounds.max.z - FLT_MIN;
-
-   // Bottom left near.
-   // smaller x plane (left)
-   // larger y plane (bottom)
-   // larger z plane (near)
-   childbounds[nodeIdxBtmLeftNear].min.x = bounds.min.x;
-   childbounds[nodeIdxBtmLeftNear].max.x = halves[0] - FLT_MIN;
-   childbounds[nodeIdxBtmLeftNear].min.y = halves[1];
-   childbounds[nodeIdxBtmLeftNear].max.y = bounds.max.y - FLT_MIN;
-   childbounds[nodeIdxBtmLeftNear].min.z = halves[2];
-   childbounds[nodeIdxBtmLeftNear].max.z = bounds.max.z - FLT_MIN;
-
-   // Bottom right near.
-   // larger x plane (right)
-   // larger y plane (bottom)
-   // larger z plane (near)
-   childbounds[nodeIdxBtmRightNear].min.x = halves[0];
-   childbounds[nodeIdxBtmRightNear].max.x = bounds.max.x - FLT_MIN;
-   childbounds[nodeIdxBtmRightNear].min.y = halves[1];
-   childbounds[nodeIdxBtmRightNear].max.y = bounds.max.y - FLT_MIN;
-   childbounds[nodeIdxBtmRightNear].min.z = halves[2];
-   childbounds[nodeIdxBtmRightNear].max.z = bounds.max.z - FLT_MIN;
-
-   // Top left far.
-   // smaller x plane (left)
-   // smaller y plane (top)
-   // smaller z plane (far)
-   childbounds[nodeIdxTopLeftFar].min.x = bounds.min.x;
-   childbounds[nodeIdxTopLeftFar].max.x = halves[0] - FLT_MIN;
-   childbounds[nodeIdxTopLeftFar].min.y = bounds.min.y;
-   childbounds[nodeIdxTopLeftFar].max.y = halves[1] - FLT_MIN;
-   childbounds[nodeIdxTopLeftFar].min.z = bounds.min.z;
-   childbounds[nodeIdxTopLeftFar].max.z = halves[2] - FLT_MIN;
-
-   // Top right far.
-   // larger x plane (right)
-   // smaller y plane (top)
-   // smaller z plane (far)
-   childbounds[nodeIdxTopRightFar].min.x = halves[0];
-   childbounds[nodeIdxTopRightFar].max.x = bounds.max.x - FLT_MIN;
-   childbounds[nodeIdxTopRightFar].min.y = bounds.min.y;
-   childbounds[nodeIdxTopRightFar].max.y = halves[1] - FLT_MIN;
-   childbounds[nodeIdxTopRightFar].min.z = bounds.min.z;
-   childbounds[nodeIdxTopRightFar].max.z = halves[2] - FLT_MIN;
-
-   // Bottom left far.
-   // smaller x plane (left)
-   // larger y plane (bottom)
-   // smaller z plane (far)
-   childbounds[nodeIdxBtmLeftFar].min.x = bounds.min.x;
-   childbounds[nodeIdxBtmLeftFar].max.x = halves[0] - FLT_MIN;
-   childbounds[nodeIdxBtmLeftFar].min.y = halves[1];
-   childbounds[nodeIdxBtmLeftFar].max.y = bounds.max.y - FLT_MIN;
-   childbounds[nodeIdxBtmLeftFar].min.z = bounds.min.z;
-   childbounds[nodeIdxBtmLeftFar].max.z = halves[2] - FLT_MIN;
-
-   // Bottom right far.
-   // larger x plane (right)
-   // larger y plane (bottom)
-   // smaller z plane (far)
-   childbounds[nodeIdxBtmRightFar].min.x = halves[0];
-   childbounds[nodeIdxBtmRightFar].max.x = bounds.max.x - FLT_MIN;
-   childbounds[nodeIdxBtmRightFar].min.y = halves[1];
-   childbounds[nodeIdxBtmRightFar].max.y = bounds.max.y - FLT_MIN;
-   childbounds[nodeIdxBtmRightFar].min.z = bounds.min.z;
-   childbounds[nodeIdxBtmRightFar].max.z = halves[2] - FLT_MIN;
+// The loop over the axes has a fixed count (Dim) and is unrolled.
+// childbound may be the same as bounds.
+template <typename Scalar, typename Payload, unsigned int Dim>
+void OctreeT<Scalar, Payload, Dim>::getChildBound(aabb const& bounds, int idx,
+   aabb& childbound)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Scalar lo = coord(bounds.min, a);
+      Scalar hi = coord(bounds.max, a);
+      Scalar half = getHalf(lo, hi);
+      if (idx & (1 << a)) {
+         coord(childbound.min, a) = half;
+         coord(childbound.max, a) = hi;
+      } else {
+         coord(childbound.min, a) = lo;
+         coord(childbound.max, a) = half;
+      }
+   }
+}
+
+// Returns the Morton code of the cell of pt (see octree.h).
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::mortonCode(aabb const& bounds,
+   Point const& pt)
+{
+   unsigned int code = 0;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      unsigned int cell = toCell(coord(pt, a), coord(bounds.min, a),
+         coord(bounds.max, a));
+      code |= spreadBits<Dim>(cell) << a;
+   }
+   return code;
+}
+
+// Returns the number of items in the first block of a node with count items.
+template <typename Scalar, typename Payload, unsigned int Dim>
+unsigned int OctreeT<Scalar, Payload, Dim>::firstBlockItems(unsigned int count)
+{
+   unsigned int rem = count % octreeBlockItems;
+   return (rem == 0) ? octreeBlockItems : rem;
 }
 
 // Returns true if the point 'ppt' falls within the bounds 'pAb'.
-bool Octree::isPointInBounds(Point const& pt, aabb const& ab)
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isPointInBounds(Point const& pt,
+   aabb const& ab)
 {
-   if (pt.x < ab.min.x)    return false;
-   if (pt.y < ab.min.y)    return false;
-   if (pt.z < ab.min.z)    return false;
-   if (pt.x > ab.max.x)    return false;
-   if (pt.y > ab.max.y)    return false;
-   if (pt.z > ab.max.z)    return false;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      if (coord(pt, a) < coord(ab.min, a))    return false;
+      if (coord(pt, a) > coord(ab.max, a))    return false;
+   }
 
    // In very simple terms the point is within bounds.
    return true;
 }
 
 // Determines if the searchItem exists within searchArea in full or in part.
-bool Octree::isItemInBoundsPartial(aabb const& searchArea, Item const& item)
-{
-   // Since this is a partial binding check, the item does not need to be wholly
-   // within the search area. If any point of the cube can be found within the
-   // search area, we got a hit!
-
-   // Check to see if any of the corners of the item's cube is within the search
-   // area. If at least one corner of the item's cube is within the search area,
-   // then we can say that the search area, to a certain extent owns this object
-   // id.
-   const Point* const pMin = &item.mBounds.min;
-   const Point* const pMax = &item.mBounds.max;
-
-   // There may yet be a better way to do this...
-   // Avoid loop?
-   Point pt;
-   for (int x = pMin->x;  x <= pMax->x; x += pMax->x - pMin->x) {
-      pt.x = x;
-      for (int y = pMin->y;  y <= pMax->y; y += pMax->y - pMin->y) {
-         pt.y = y;
-         for (int z = pMin->z;  z <= pMax->z; z += pMax->z - pMin->z) {
-            pt.z = z;
-            if (isPointInBounds(pt, searchArea)) {
-               return true;
-            }  
-         }
-      }
-   }
-
-   // Ok so none of the corners of the item's cube are within the search area.
-   // This means that this item is:
-   // a) either completely out of the search area.
-   // b) or enclosing totally the search area
-   //       (but obviously can't be fully enclosed within the search area).
-   if (isCubeEnclosed(item.mBounds, searchArea))
-      return true;
-
-   // Nowhere to be seen!
-   return false;
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isItemInBoundsPartial(
+   aabb const& searchArea, Item const& item)
+{
+   return isCubeOverlap(searchArea, item.mBounds);
 }
 
 // Returns true if ptBig wholly encloses ptSmall.
-bool Octree::isCubeEnclosed(aabb const& big, aabb const& small)
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isCubeEnclosed(aabb const& big,
+   aabb const& small)
 {
-   // small located before big.
-   if (small.min.x < big.min.x) return false;
-   if (small.min.y < big.min.y) return false;
-   if (small.min.z < big.min.z) return false;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      // small located before big.
+      if (coord(small.min, a) < coord(big.min, a)) return false;
 
-   // small located after end of big.
-   if (small.min.x > big.max.x) return false;
-   if (small.min.y > big.max.y) return false;
-   if (small.min.z > big.max.z) return false;
+      // small located after end of big.
+      if (coord(small.min, a) > coord(big.max, a)) return false;
 
-   // small cube starts inside big cube but overlaps edges :(.
-   // Small cube goes home...
-   if (small.max.x > big.max.x) return false;
-   if (small.max.y > big.max.y) return false;
-   if (small.max.z > big.max.z) return false;
+      // small cube starts inside big cube but overlaps edges :(.
+      // Small cube goes home...
+      if (coord(small.max, a) > coord(big.max, a)) return false;
+   }
 
    // Otherwise, small cube stays here - small cube is in big cube.
    return true;
 }
+
+// Returns true if a and b overlap (touching counts). See isOverlapping().
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isCubeOverlap(aabb const& a, aabb const& b)
+{
+   return isOverlapping(a, b);
+}
+
+// Returns the only child of bounds which item overlaps or -1.
+template <typename Scalar, typename Payload, unsigned int Dim>
+int OctreeT<Scalar, Payload, Dim>::findItemChild(aabb const& bounds,
+   Item const& item)
+{
+   int only = -1;
+   for (unsigned int c = 0; c < Children; ++c) {
+      aabb childBounds;
+      getChildBound(bounds, c, childBounds);
+      if (!isItemInBoundsPartial(childBounds, item)) continue;
+      if (only >= 0) return -1;
+      only = c;
+   }
+
+   return only;
+}
+
+// Returns true if bounds overlap the inside of node (more than touching its
+// sides) without covering all of it.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isCutting(aabb const& node,
+   aabb const& bounds)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      if (coord(bounds.min, a) >= coord(node.max, a) ||
+         coord(bounds.max, a) <= coord(node.min, a)) return false;
+   }
+   return !isCubeEnclosed(bounds, node);
+}
+
+// Returns true if bounds lie within node without touching its sides.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isStrictlyIn(aabb const& node,
+   aabb const& bounds)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      if (coord(bounds.min, a) <= coord(node.min, a) ||
+         coord(bounds.max, a) >= coord(node.max, a)) return false;
+   }
+   return true;
+}
+
+// Returns true if bounds touch or cross the middle of node (where its
+// children meet) along any axis.
+template <typename Scalar, typename Payload, unsigned int Dim>
+bool OctreeT<Scalar, Payload, Dim>::isStraddling(aabb const& node,
+   aabb const& bounds)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Scalar half = getHalf(coord(node.min, a), coord(node.max, a));
+      if (coord(bounds.min, a) <= half && coord(bounds.max, a) >= half) {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Returns the square of the distance between pt and the nearest point of ab
+// (0 when pt lies within ab).
+template <typename Scalar, typename Payload, unsigned int Dim>
+typename OctreeT<Scalar, Payload, Dim>::Real
+   OctreeT<Scalar, Payload, Dim>::distanceSq(Point const& pt, aabb const& ab)
+{
+   Real d = 0;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      Real v = coord(pt, a);
+      Real da = max(max((Real)coord(ab.min, a) - v, v - coord(ab.max, a)),
+         (Real)0);
+      d += da * da;
+   }
+   return d;
+}
+
+// Returns the middle of lo and hi. The difference is taken in double so that
+// it cannot overflow fixed point coordinates.
+template <typename Scalar, typename Payload, unsigned int Dim>
+Scalar OctreeT<Scalar, Payload, Dim>::getHalf(Scalar lo, Scalar hi)
+{
+   return (Scalar)(lo + ((double)hi - lo) / 2);
+}
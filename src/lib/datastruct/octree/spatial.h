@@ -0,0 +1,296 @@
+/*
+Date: 18 Oct 2026 09:12:44.318806125
+File: spatial.h
+
+Copyright Notice
+This document is protected by the GNU General Public License v3.0.
+
+This allows for commercial use, modification, distribution, patent and private
+use of this software only when the GNU General Public License v3.0 and this
+copyright notice are both attached in their original form.
+
+For developer and author protection, the GPL clearly explains that there is no
+warranty for this free software and that any source code alterations are to be
+shown clearly to identify the original author as well as any subsequent changes
+made and by who.
+
+For any questions or ideas, please contact:
+github:  https://github(dot)com/dnc77
+email:   dnc77(at)hotmail(dot)com
+web:     http://www(dot)dnc77(dot)com
+
+Copyright (C) 2000-2019 Duncan Camilleri, All rights reserved.
+End of Copyright Notice
+
+Purpose: Helpers shared by the octree and the BVH: threads, radix sort, rays
+         and Morton codes.
+
+Version control
+18 Oct 2026 Duncan Camilleri           Initial development
+
+*/
+
+#ifndef __SPATIAL_H_5A0C3E9B71D24F8E86B2D4C7E19F0A63__
+#define __SPATIAL_H_5A0C3E9B71D24F8E86B2D4C7E19F0A63__
+
+// Check for missing includes.
+#if not defined _GLIBCXX_VECTOR
+#error "spatial.h: missing include - vector"
+#elif not defined _GLIBCXX_CMATH
+#error "spatial.h: missing include - cmath"
+#elif not defined _GLIBCXX_NUMERIC_LIMITS
+#error "spatial.h: missing include - limits"
+#elif not defined _GLIBCXX_THREAD
+#error "spatial.h: missing include - thread"
+#elif not defined _GLIBCXX_ALGORITHM
+#error "spatial.h: missing include - algorithm"
+#elif not defined __OCTREE_H_C320E78EB2172B4CB9E10507D5D96B4A__
+#error "spatial.h: missing include - datastruct/octree.h"
+#endif
+
+//
+// THREADS
+//
+
+// Number of threads worth using on count elements (at least one).
+inline unsigned int threadCount(size_t count)
+{
+   unsigned int threads = std::thread::hardware_concurrency();
+   if (threads == 0) threads = 1;
+
+   // Not worth a thread for less than 16k elements.
+   size_t most = count / 16384 + 1;
+   if (threads > most) threads = (unsigned int)most;
+   return threads;
+}
+
+// Splits [0, count) into 'threads' slices and calls fn(begin, end, t) for
+// each at the same time, slice t on a thread of its own. The slices only
+// depend on count and threads.
+template <typename Fn>
+inline void parallelFor(size_t count, unsigned int threads, Fn const& fn)
+{
+   size_t slice = (count + threads - 1) / threads;
+   std::vector<std::thread> workers;
+   for (unsigned int t = 1; t < threads; ++t) {
+      size_t begin = std::min(count, slice * t);
+      size_t end = std::min(count, begin + slice);
+      workers.push_back(std::thread(fn, begin, end, t));
+   }
+
+   fn(0, std::min(count, slice), 0);
+   for (std::vector<std::thread>::iterator it = workers.begin();
+      it != workers.end(); ++it)
+   {
+      it->join();
+   }
+}
+
+// Sorts keys by their low keyBits bits and moves vals along with them. This
+// is a stable least significant digit radix sort of 8 bits per pass. Each
+// pass counts the digits of every thread's slice and then all slices are
+// scattered to their place at the same time. tmpKeys, tmpVals and hist are
+// working buffers.
+inline void radixSort(std::vector<unsigned int>& keys,
+   std::vector<unsigned int>& vals, unsigned int keyBits,
+   std::vector<unsigned int>& tmpKeys, std::vector<unsigned int>& tmpVals,
+   std::vector<size_t>& hist)
+{
+   size_t count = keys.size();
+   unsigned int threads = threadCount(count);
+   tmpKeys.resize(count);
+   tmpVals.resize(count);
+   hist.resize(threads * 256);
+
+   for (unsigned int shift = 0; shift < keyBits; shift += 8) {
+      // Count digits.
+      std::fill(hist.begin(), hist.end(), 0);
+      parallelFor(count, threads,
+         [&](size_t begin, size_t end, unsigned int t) {
+            size_t* pHist = &hist[t * 256];
+            for (size_t n = begin; n < end; ++n) {
+               pHist[(keys[n] >> shift) & 0xff]++;
+            }
+         });
+
+      // Starting position of each digit of each thread. Lower threads go
+      // first so that the sort is stable.
+      size_t pos = 0;
+      for (unsigned int d = 0; d < 256; ++d) {
+         for (unsigned int t = 0; t < threads; ++t) {
+            size_t c = hist[t * 256 + d];
+            hist[t * 256 + d] = pos;
+            pos += c;
+         }
+      }
+
+      // Scatter.
+      parallelFor(count, threads,
+         [&](size_t begin, size_t end, unsigned int t) {
+            size_t* pHist = &hist[t * 256];
+            for (size_t n = begin; n < end; ++n) {
+               size_t to = pHist[(keys[n] >> shift) & 0xff]++;
+               tmpKeys[to] = keys[n];
+               tmpVals[to] = vals[n];
+            }
+         });
+
+      keys.swap(tmpKeys);
+      vals.swap(tmpVals);
+   }
+}
+
+// As above with working buffers of its own.
+inline void radixSort(std::vector<unsigned int>& keys,
+   std::vector<unsigned int>& vals, unsigned int keyBits)
+{
+   std::vector<unsigned int> tmpKeys;
+   std::vector<unsigned int> tmpVals;
+   std::vector<size_t> hist;
+   radixSort(keys, vals, keyBits, tmpKeys, tmpVals, hist);
+}
+
+//
+// COORDINATES
+//
+
+// Coordinate a (0 for x, 1 for y, 2 for z) of p. Code which works for any
+// number of axes loops over them with this; the loops are unrolled by the
+// compiler.
+template <typename Scalar, unsigned int Dim>
+inline Scalar& coord(PointT<Scalar, Dim>& p, unsigned int a)
+{
+   return (&p.x)[a];
+}
+
+template <typename Scalar, unsigned int Dim>
+inline Scalar coord(PointT<Scalar, Dim> const& p, unsigned int a)
+{
+   return (&p.x)[a];
+}
+
+//
+// RAYS
+//
+
+// A ray as RayCast() tests it. Direction components too small to invert
+// are taken as 0: the ray is then parallel to the slabs of that axis.
+template <typename Real, unsigned int Dim>
+struct OctreeRay
+{
+   Real mOrigin[Dim];
+   Real mDir[Dim];
+   Real mInv[Dim];                  // 1 / mDir (0 where mDir is 0)
+};
+
+template <typename Scalar, typename Real, unsigned int Dim>
+inline void makeRay(PointT<Scalar, Dim> const& origin,
+   PointT<Scalar, Dim> const& dir, OctreeRay<Real, Dim>& ray)
+{
+   for (unsigned int a = 0; a < Dim; ++a) {
+      ray.mOrigin[a] = (&origin.x)[a];
+      ray.mDir[a] = (&dir.x)[a];
+      if (!(std::fabs(ray.mDir[a]) >= std::numeric_limits<Real>::min())) {
+         ray.mDir[a] = 0;
+      }
+      ray.mInv[a] = ray.mDir[a] ? 1 / ray.mDir[a] : 0;
+   }
+}
+
+// Slab test: narrows [tEnter, tExit] down to the part of the ray within ab
+// (touching counts). Returns false if nothing is left.
+template <typename Scalar, typename Real, unsigned int Dim>
+inline bool rayBounds(aabbT<Scalar, Dim> const& ab,
+   OctreeRay<Real, Dim> const& ray, Real& tEnter, Real& tExit)
+{
+   const Scalar* pMin = &ab.min.x;
+   const Scalar* pMax = &ab.max.x;
+   for (unsigned int a = 0; a < Dim; ++a) {
+      if (ray.mDir[a] == 0) {
+         if (ray.mOrigin[a] < pMin[a] || ray.mOrigin[a] > pMax[a]) {
+            return false;
+         }
+         continue;
+      }
+
+      Real t1 = (pMin[a] - ray.mOrigin[a]) * ray.mInv[a];
+      Real t2 = (pMax[a] - ray.mOrigin[a]) * ray.mInv[a];
+      tEnter = std::max(tEnter, std::min(t1, t2));
+      tExit = std::min(tExit, std::max(t1, t2));
+   }
+
+   return tEnter <= tExit;
+}
+
+// Results of RayCast are kept sorted by t in the output arrays. Adds item
+// id entered at t to the count results held (at most most of them). Items
+// held by more than one leaf are found again with exactly the same t, so
+// unless unique, the results with that t are checked for id first.
+template <typename Payload, typename Real>
+inline void rayInsert(Payload* pIds, Real* pT, int& count, int most,
+   Payload id, Real t, bool unique)
+{
+   if (count == most && t >= pT[count - 1]) return;
+
+   int at = (int)(std::lower_bound(pT, pT + count, t) - pT);
+   if (!unique) {
+      for (int n = at; n < count && pT[n] == t; ++n) {
+         if (pIds[n] == id) return;
+      }
+   }
+
+   int last = std::min(count, most - 1);
+   for (int n = last; n > at; --n) {
+      pIds[n] = pIds[n - 1];
+      pT[n] = pT[n - 1];
+   }
+
+   pIds[at] = id;
+   pT[at] = t;
+   if (count < most) count++;
+}
+
+//
+// MORTON CODES
+//
+
+// Spreads the low 10 bits of v so that there are Dim - 1 zero bits between
+// each, ready to be interleaved with the cells of the other axes.
+template <unsigned int Dim>
+inline unsigned int spreadBits(unsigned int v);
+
+template <>
+inline unsigned int spreadBits<3>(unsigned int v)
+{
+   v &= 0x000003ff;
+   v = (v | (v << 16)) & 0xff0000ff;
+   v = (v | (v << 8)) & 0x0300f00f;
+   v = (v | (v << 4)) & 0x030c30c3;
+   v = (v | (v << 2)) & 0x09249249;
+   return v;
+}
+
+template <>
+inline unsigned int spreadBits<2>(unsigned int v)
+{
+   v &= 0x000003ff;
+   v = (v | (v << 8)) & 0x00ff00ff;
+   v = (v | (v << 4)) & 0x0f0f0f0f;
+   v = (v | (v << 2)) & 0x33333333;
+   v = (v | (v << 1)) & 0x55555555;
+   return v;
+}
+
+// The cell (0 to 1023) holding v on an axis from lo to hi.
+template <typename Scalar>
+inline unsigned int toCell(Scalar v, Scalar lo, Scalar hi)
+{
+   typedef typename OctreeReal<Scalar>::type Real;
+   const Real cells = (Real)(1 << octreeMortonLevels);
+   Real cell = ((Real)v - lo) / ((Real)hi - lo) * cells;
+   if (!(cell > 0)) return 0;                   // also catches NaN
+   if (cell >= cells) return (1 << octreeMortonLevels) - 1;
+   return (unsigned int)cell;
+}
+
+#endif   // __SPATIAL_H_5A0C3E9B71D24F8E86B2D4C7E19F0A63__